@@ -0,0 +1,169 @@
+#ifndef SXPDB_BITSLICED_INDEX_H
+#define SXPDB_BITSLICED_INDEX_H
+
+#include <vector>
+#include <cstdint>
+
+#include "roaring++.h"
+
+#include "packed_index.h"
+
+// Index of an unsigned integer attribute of the values, such as their length.
+// Slice i is the bitmap of the values whose attribute has bit i set. A comparison with a constant
+// goes through the slices from the most significant bit, so it is a bitmap operation
+// per bit, whatever the number of distinct attribute values.
+//
+// In the packed index, the key of a slice is its bit, and the values that have been indexed are at
+// existence_key.
+class BitSlicedIndex {
+public:
+  static constexpr uint64_t existence_key = 64;
+
+private:
+  roaring::Roaring64Map existence;// all the values that have been indexed
+  std::vector<roaring::Roaring64Map> slices;
+
+  // The constant has a bit set above the slices: it is larger than all the indexed attributes
+  bool above_slices(uint64_t v) const {
+    return slices.size() < 64 && (v >> slices.size()) != 0;
+  }
+
+public:
+  void add(uint64_t index, uint64_t value) {
+    existence.add(index);
+    for(size_t bit = 0; value != 0; bit++, value >>= 1) {
+      if(value & 1) {
+        if(bit >= slices.size()) {
+          slices.resize(bit + 1);
+        }
+        slices[bit].add(index);
+      }
+    }
+  }
+
+  void remove(uint64_t index) {
+    existence.remove(index);
+    for(auto& slice : slices) {
+      slice.remove(index);
+    }
+  }
+
+  // For a value that may have already been indexed, with another attribute
+  void set(uint64_t index, uint64_t value) {
+    remove(index);
+    add(index, value);
+  }
+
+  // The other index must be on other values
+  void merge(const BitSlicedIndex& other) {
+    existence |= other.existence;
+    if(other.slices.size() > slices.size()) {
+      slices.resize(other.slices.size());
+    }
+    for(size_t bit = 0; bit < other.slices.size(); bit++) {
+      slices[bit] |= other.slices[bit];
+    }
+  }
+
+  roaring::Roaring64Map less_equal(uint64_t v) const {
+    if(above_slices(v)) {
+      return existence;
+    }
+    roaring::Roaring64Map lt;
+    roaring::Roaring64Map eq = existence;
+    for(size_t bit = slices.size(); bit-- > 0 && !eq.isEmpty();) {
+      if((v >> bit) & 1) {
+        lt |= eq - slices[bit];
+        eq &= slices[bit];
+      }
+      else {
+        eq -= slices[bit];
+      }
+    }
+    lt |= eq;
+    return lt;
+  }
+
+  roaring::Roaring64Map greater_equal(uint64_t v) const {
+    if(above_slices(v)) {
+      return roaring::Roaring64Map();
+    }
+    roaring::Roaring64Map gt;
+    roaring::Roaring64Map eq = existence;
+    for(size_t bit = slices.size(); bit-- > 0 && !eq.isEmpty();) {
+      if((v >> bit) & 1) {
+        eq &= slices[bit];
+      }
+      else {
+        gt |= eq & slices[bit];
+        eq -= slices[bit];
+      }
+    }
+    gt |= eq;
+    return gt;
+  }
+
+  roaring::Roaring64Map equal(uint64_t v) const {
+    if(above_slices(v)) {
+      return roaring::Roaring64Map();
+    }
+    roaring::Roaring64Map eq = existence;
+    for(size_t bit = slices.size(); bit-- > 0 && !eq.isEmpty();) {
+      if((v >> bit) & 1) {
+        eq &= slices[bit];
+      }
+      else {
+        eq -= slices[bit];
+      }
+    }
+    return eq;
+  }
+
+  // Bounds included
+  roaring::Roaring64Map range(uint64_t min, uint64_t max) const {
+    if(min > max) {
+      return roaring::Roaring64Map();
+    }
+    if(min == max) {
+      return equal(min);
+    }
+    roaring::Roaring64Map res = min == 0 ? existence : greater_equal(min);
+    if(!res.isEmpty() && !above_slices(max)) {
+      res &= less_equal(max);
+    }
+    return res;
+  }
+
+  void read(const PackedIndex& pack, index_family family) {
+    clear();
+    for(uint64_t key : pack.keys(family)) {
+      if(key == existence_key) {
+        existence = pack.read(family, key);
+      }
+      else if(key < existence_key) {
+        if(key >= slices.size()) {
+          slices.resize(key + 1);
+        }
+        slices[key] = pack.read(family, key);
+      }
+    }
+  }
+
+  void write(PackedIndexWriter& writer, index_family family) {
+    existence.runOptimize();
+    existence.shrinkToFit();
+    writer.add(family, existence_key, existence);
+    for(size_t bit = 0; bit < slices.size(); bit++) {
+      slices[bit].runOptimize();
+      slices[bit].shrinkToFit();
+      writer.add(family, bit, slices[bit]);
+    }
+  }
+
+  void clear() {
+    existence = roaring::Roaring64Map();
+    slices.clear();
+  }
+};
+
+#endif
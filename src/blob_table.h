@@ -0,0 +1,873 @@
+#ifndef SXPDB_BLOB_TABLE_H
+#define SXPDB_BLOB_TABLE_H
+
+#include <memory>
+#include <string>
+
+#include "table.h"
+#include "lz4_block.h"
+#include "dictionary_builder.h"
+
+// Storage layouts for the serialized values (the sexp table).
+// The layout of a database is recorded in its configuration file
+// and can be changed with Database::set_layout.
+//
+// - plain: a VSizeTable, one (size, value) record per value
+// - block: values are packed in blocks of about 64 KiB compressed with LZ4
+// - dict: each value is compressed on its own with LZ4, using a dictionary trained
+//   on the values of the database when converting to this layout
+// - inline: small values are stored directly in a fixed-size slot table
+
+
+// Keeps the last decompressed block, so that reading all the values of a block
+// only decompresses it once.
+// Views returned with a cursor are valid until the next read with the same cursor.
+// Use one cursor per thread.
+struct BlobCursor {
+  std::vector<std::byte> buffer;
+  uint64_t block = UINT64_MAX;
+};
+
+class BlobTable : public Table<std::vector<std::byte>> {
+protected:
+  mutable BlobCursor default_cursor;
+  mutable std::vector<std::byte> value;
+public:
+  virtual const char* layout() const = 0;
+
+  virtual Span<const std::byte> read_view(uint64_t idx, BlobCursor& cursor) const = 0;
+
+  // Like read_view, but returns false instead of failing if the value cannot be read:
+  // its location is outside of the files, or its data cannot be decompressed.
+  // Can be called concurrently with different cursors after map().
+  virtual bool read_checked(uint64_t idx, BlobCursor& cursor, Span<const std::byte>& view) const = 0;
+
+  // Not thread-safe: it uses the cursor of the table
+  Span<const std::byte> read_view(uint64_t idx) const {
+    return read_view(idx, default_cursor);
+  }
+
+  virtual void append_view(Span<const std::byte> val) = 0;
+
+  // Size of the (uncompressed) value, without reading it
+  virtual uint64_t value_size(uint64_t idx) const = 0;
+
+  // Number of bytes used to store the value in the data file
+  virtual uint64_t stored_size(uint64_t idx) const = 0;
+
+  // Called on an empty table before copying the values of source into it,
+  // for layouts that learn from the values
+  virtual void train(const BlobTable& source) {}
+
+  // Prepare the table for concurrent calls to read_view with different cursors
+  virtual void map() const = 0;
+
+  // Only meaningful for the plain layout
+  virtual void set_buffered(bool buffer) {}
+
+  // All the files used by the table, including configuration files
+  virtual std::vector<fs::path> files() const = 0;
+
+  // Drop the values from index n, for instance to repair the table
+  virtual void truncate(uint64_t n) = 0;
+
+  void append(const std::vector<std::byte>& val) override {
+    append_view(val);
+  }
+
+  void append(const std::vector<std::vector<std::byte>>& values) override {
+    for(const auto& val : values) {
+      append_view(val);
+    }
+  }
+
+  const std::vector<std::byte>& read(uint64_t idx) const override {
+    read_in(idx, value);
+    return value;
+  }
+
+  void read_in(uint64_t idx, std::vector<std::byte>& val) const override {
+    auto view = read_view(idx, default_cursor);
+    val.assign(view.begin(), view.end());
+  }
+
+  virtual ~BlobTable() {}
+};
+
+
+// Append-only data file of the compressed and inline layouts.
+// Appends are buffered and written in batches with pwrite; the written part of
+// the file is memory mapped for reads.
+class BlobFile {
+private:
+  fs::path path;
+  int fd = -1;
+  uint64_t file_end = 0;// written part of the file
+  std::vector<std::byte> pending;
+  size_t max_pending = 1024 * 1024;
+  mutable MappedFile mapping;
+  pid_t pid;
+
+  void ensure_mapped(uint64_t end) const {
+    if(end > mapping.size()) {
+      if(!mapping.map(fd, file_end)) {
+        Rf_error("Impossible to map the table file at %s: %s\n", path.string().c_str(), strerror(errno));
+      }
+      if(end > mapping.size()) {
+        Rf_error("Out of bounds read in table %s: %llu vs %llu bytes.\n", path.string().c_str(),
+                 (unsigned long long) end, (unsigned long long) mapping.size());
+      }
+    }
+  }
+
+public:
+  BlobFile() : pid(getpid()) {}
+  BlobFile(const BlobFile&) = delete;
+  BlobFile& operator=(const BlobFile&) = delete;
+
+  void open(const fs::path& p, bool write_mode) {
+    path = p;
+    fd = ::open(path.string().c_str(), O_CREAT | O_RDWR | O_BINARY, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if(fd == -1) {
+      Rf_error("Impossible to open the table file at %s: %s\n", path.string().c_str(), strerror(errno));
+    }
+    file_end = lseek(fd, 0, SEEK_END);
+    if(!write_mode) {
+      ensure_mapped(file_end);
+    }
+  }
+
+  const fs::path& get_path() const { return path; }
+
+  uint64_t size() const { return file_end + pending.size(); }
+
+  // Discard the end of the file, for instance data written after the last checkpoint
+  void truncate(uint64_t new_size) {
+    throw_assert(pending.empty() && new_size <= file_end);
+    if(ftruncate(fd, new_size) != 0) {
+      Rf_error("Impossible to truncate the table file at %s: %s\n", path.string().c_str(), strerror(errno));
+    }
+    file_end = new_size;
+    // The mapping could extend past the new end
+    mapping.unmap();
+  }
+
+  // Returns the offset of the data in the file
+  uint64_t append(Span<const std::byte> data) {
+    uint64_t offset = size();
+    pending.insert(pending.end(), data.begin(), data.end());
+    if(pending.size() >= max_pending) {
+      flush();
+    }
+    return offset;
+  }
+
+  // Valid until the next append
+  const std::byte* view(uint64_t offset, uint64_t length) const {
+    if(offset >= file_end) {
+      throw_assert(offset + length <= size());
+      return pending.data() + (offset - file_end);
+    }
+    ensure_mapped(offset + length);
+    return mapping.data() + offset;
+  }
+
+  void flush() {
+    if(pending.empty() || pid != getpid()) {
+      return;
+    }
+
+    size_t written = 0;
+    while(written < pending.size()) {
+      ssize_t res = pwrite(fd, pending.data() + written, pending.size() - written, file_end + written);
+      if(res <= 0) {
+        Rf_error("Error while writing to table %s: %s\n", path.string().c_str(), strerror(errno));
+      }
+      written += res;
+    }
+    file_end += pending.size();
+    pending.clear();
+  }
+
+  void map() const {
+    ensure_mapped(file_end);
+    mapping.advise_sequential();
+  }
+
+  ~BlobFile() {
+    if(fd != -1) {
+      flush();
+      ::close(fd);
+    }
+  }
+};
+
+
+class PlainBlobTable : public BlobTable {
+private:
+  VSizeTable<std::vector<std::byte>> table;
+public:
+  const char* layout() const override { return "plain"; }
+
+  void open(const fs::path& path, bool write = true) override {
+    write_mode = write;
+    table.open(path, write);
+  }
+
+  Span<const std::byte> read_view(uint64_t idx, BlobCursor& cursor) const override {
+    return table.read_view(idx);
+  }
+
+  bool read_checked(uint64_t idx, BlobCursor& cursor, Span<const std::byte>& view) const override {
+    return table.read_view_checked(idx, view);
+  }
+
+  void append_view(Span<const std::byte> val) override {
+    table.append_view(val);
+  }
+
+  uint64_t value_size(uint64_t idx) const override {
+    return table.read_view(idx).size();
+  }
+
+  uint64_t stored_size(uint64_t idx) const override {
+    return sizeof(uint64_t) + value_size(idx);
+  }
+
+  // Can read in parallel because of pread
+  void read_in(uint64_t idx, std::vector<std::byte>& val) const override {
+    table.read_in(idx, val);
+  }
+
+  void write(uint64_t idx, const std::vector<std::byte>& val) override {
+    table.write(idx, val);
+  }
+
+  void map() const override { table.map(); }
+
+  void set_buffered(bool buffer) override { table.set_buffered(buffer); }
+
+  void truncate(uint64_t n) override { table.truncate(n); }
+
+  void load_all() override { table.load_all(); }
+
+  void flush() override { table.flush(); }
+
+  uint64_t nb_values() const override { return table.nb_values(); }
+
+  const fs::path& get_path() const override { return table.get_path(); }
+
+  bool loaded() const override { return table.loaded(); }
+
+  std::vector<fs::path> files() const override {
+    return {table.get_path(), fs::path(table.get_path()).replace_extension("conf"),
+            table.offsets_path(), fs::path(table.offsets_path()).replace_extension("conf")};
+  }
+};
+
+
+// LZ4 cannot expand data more than 255 times: larger raw sizes are corrupted
+constexpr uint64_t max_expansion = 255;
+
+struct block_t {
+  uint64_t offset = 0;// in the blob file
+  uint64_t compressed_size = 0;// equal to raw_size if the block is not compressed
+  uint64_t raw_size = 0;
+};
+
+struct block_entry_t {
+  uint32_t block = 0;
+  uint32_t offset = 0;// in the uncompressed block
+  uint64_t size = 0;
+};
+
+// Layout:
+// - <stem>.bin: compressed blocks, one after the other
+// - <stem>_blocks.bin: position and sizes of each block
+// - <stem>_directory.bin: block, offset in the block and size of each value
+// In write mode, the last block is kept uncompressed in memory until it is full,
+// or until the table is flushed or closed.
+class BlockBlobTable : public BlobTable {
+private:
+  mutable FSizeTable<block_entry_t> directory;
+  mutable FSizeTable<block_t> blocks;
+  BlobFile blob;
+
+  size_t block_size = 64 * 1024;
+  std::vector<std::byte> current;// block being filled
+  LZ4Codec codec;
+  std::vector<std::byte> compressed;
+
+  void seal_block() {
+    if(current.empty() || pid != getpid()) {
+      return;
+    }
+
+    compressed.resize(LZ4Codec::compress_bound(current.size()));
+    size_t compressed_size = codec.compress(current.data(), current.size(), compressed.data());
+    Span<const std::byte> data(compressed.data(), compressed_size);
+    if(compressed_size >= current.size()) {
+      // not worth it
+      data = current;
+    }
+
+    block_t block;
+    block.offset = blob.append(data);
+    block.compressed_size = data.size();
+    block.raw_size = current.size();
+    blocks.append(block);
+
+    current.clear();
+  }
+
+  bool decompress_block(uint64_t block_id, BlobCursor& cursor) const {
+    const block_t block = blocks.read(block_id);
+    const std::byte* data = blob.view(block.offset, block.compressed_size);
+
+    cursor.buffer.resize(block.raw_size);
+    if(block.compressed_size == block.raw_size) {
+      std::memcpy(cursor.buffer.data(), data, block.raw_size);
+    }
+    else if(!LZ4Codec::decompress(data, block.compressed_size, cursor.buffer.data(), block.raw_size)) {
+      cursor.block = UINT64_MAX;
+      return false;
+    }
+    cursor.block = block_id;
+    return true;
+  }
+
+  void load_block(uint64_t block_id, BlobCursor& cursor) const {
+    if(!decompress_block(block_id, cursor)) {
+      Rf_error("Corrupted block %llu in table %s.\n", (unsigned long long) block_id, file_path.string().c_str());
+    }
+  }
+
+public:
+  const char* layout() const override { return "block"; }
+
+  void open(const fs::path& path, bool write = true) override {
+    write_mode = write;
+    file_path = fs::absolute(path);
+    file_path.replace_extension("bin");
+    fs::path stem = file_path.parent_path() / file_path.stem();
+
+    directory.open(stem.string() + "_directory.bin", write);
+    blocks.open(stem.string() + "_blocks.bin", write);
+    blob.open(file_path, write);
+
+    uint64_t end = 0;
+    if(blocks.nb_values() > 0) {
+      const block_t& last = blocks.read(blocks.nb_values() - 1);
+      end = last.offset + last.compressed_size;
+    }
+    if(write && end < blob.size()) {
+      blob.truncate(end);
+    }
+    if(end != blob.size()) {
+      Rf_error("Inconsistent size for table %s: %llu vs %llu bytes.\n", file_path.string().c_str(),
+               (unsigned long long) end, (unsigned long long) blob.size());
+    }
+  }
+
+  Span<const std::byte> read_view(uint64_t idx, BlobCursor& cursor) const override {
+    const block_entry_t entry = directory.read(idx);
+
+    if(entry.block == blocks.nb_values()) {
+      // in the block being filled
+      return Span<const std::byte>(current.data() + entry.offset, entry.size);
+    }
+
+    if(cursor.block != entry.block) {
+      load_block(entry.block, cursor);
+    }
+    return Span<const std::byte>(cursor.buffer.data() + entry.offset, entry.size);
+  }
+
+  bool read_checked(uint64_t idx, BlobCursor& cursor, Span<const std::byte>& view) const override {
+    const block_entry_t entry = directory.read(idx);
+    uint64_t nb_blocks = blocks.nb_values();
+
+    if(entry.block == nb_blocks) {
+      if(entry.offset > current.size() || entry.size > current.size() - entry.offset) {
+        return false;
+      }
+      view = Span<const std::byte>(current.data() + entry.offset, entry.size);
+      return true;
+    }
+    if(entry.block > nb_blocks) {
+      return false;
+    }
+
+    // Blocks follow each other in the file
+    const block_t block = blocks.read(entry.block);
+    uint64_t start = 0;
+    if(entry.block > 0) {
+      const block_t previous = blocks.read(entry.block - 1);
+      start = previous.offset + previous.compressed_size;
+    }
+    if(block.offset != start || block.offset > blob.size() || block.compressed_size > blob.size() - block.offset ||
+       block.compressed_size > block.raw_size || block.raw_size > max_expansion * block.compressed_size + block_size ||
+       entry.offset > block.raw_size || entry.size > block.raw_size - entry.offset) {
+      return false;
+    }
+
+    if(cursor.block != entry.block && !decompress_block(entry.block, cursor)) {
+      return false;
+    }
+    view = Span<const std::byte>(cursor.buffer.data() + entry.offset, entry.size);
+    return true;
+  }
+
+  void append_view(Span<const std::byte> val) override {
+    block_entry_t entry;
+    entry.block = blocks.nb_values();
+    entry.offset = current.size();
+    entry.size = val.size();
+    directory.append(entry);
+
+    current.insert(current.end(), val.begin(), val.end());
+
+    if(current.size() >= block_size) {
+      seal_block();
+    }
+  }
+
+  uint64_t value_size(uint64_t idx) const override {
+    return directory.read(idx).size;
+  }
+
+  // The share of the compressed block corresponding to the value
+  uint64_t stored_size(uint64_t idx) const override {
+    const block_entry_t entry = directory.read(idx);
+    if(entry.block == blocks.nb_values()) {
+      return entry.size;
+    }
+    const block_t& block = blocks.read(entry.block);
+    return (entry.size * block.compressed_size + block.raw_size - 1) / block.raw_size;
+  }
+
+  void write(uint64_t idx, const std::vector<std::byte>& val) override {
+    Rf_error("Values cannot be overwritten in a block compressed table.\n");
+  }
+
+  void map() const override {
+    directory.load_all();
+    blocks.load_all();
+    blob.map();
+  }
+
+  void load_all() override {
+    directory.load_all();
+    blocks.load_all();
+  }
+
+  void flush() override {
+    seal_block();
+    blob.flush();
+    directory.flush();
+    blocks.flush();
+  }
+
+  // The block of the last value is kept whole; the next values go to a new block
+  void truncate(uint64_t n) override {
+    if(n >= directory.nb_values()) {
+      return;
+    }
+    seal_block();
+    blob.flush();
+    uint64_t nb_blocks = n == 0 ? 0 : directory.read(n - 1).block + 1;
+    directory.truncate(n);
+    blocks.truncate(nb_blocks);
+    uint64_t end = 0;
+    if(nb_blocks > 0) {
+      const block_t& last = blocks.read(nb_blocks - 1);
+      end = last.offset + last.compressed_size;
+    }
+    blob.truncate(end);
+    flush();
+  }
+
+  uint64_t nb_values() const override { return directory.nb_values(); }
+
+  bool loaded() const override { return directory.loaded(); }
+
+  std::vector<fs::path> files() const override {
+    return {file_path,
+            directory.get_path(), fs::path(directory.get_path()).replace_extension("conf"),
+            blocks.get_path(), fs::path(blocks.get_path()).replace_extension("conf")};
+  }
+
+  virtual ~BlockBlobTable() {
+    seal_block();
+  }
+};
+
+
+// Layout:
+// - <stem>.bin: compressed values, one after the other
+// - <stem>_index.bin: position and sizes of each value
+// - <stem>_dict.bin: the dictionary
+// Most values are small (scalars, short vectors with a few attributes), and do not
+// compress on their own; they mostly share their headers and attributes with other values,
+// which is what the dictionary captures. Reading a value only decompresses this value.
+// Values that do not get smaller are stored uncompressed and read without copy.
+class DictBlobTable : public BlobTable {
+private:
+  mutable FSizeTable<block_t> index;
+  BlobFile blob;
+
+  std::vector<std::byte> dictionary;
+  LZ4Codec codec;
+  std::vector<std::byte> compressed;
+
+  fs::path dict_path;
+
+  static constexpr size_t dict_size = 32 * 1024;
+  static constexpr size_t max_samples_size = 8 * 1024 * 1024;
+
+  void set_dictionary(std::vector<std::byte>&& dict) {
+    dictionary = std::move(dict);
+    codec.set_dictionary(dictionary.data(), dictionary.size());
+  }
+
+public:
+  const char* layout() const override { return "dict"; }
+
+  void open(const fs::path& path, bool write = true) override {
+    write_mode = write;
+    file_path = fs::absolute(path);
+    file_path.replace_extension("bin");
+    fs::path stem = file_path.parent_path() / file_path.stem();
+
+    index.open(stem.string() + "_index.bin", write);
+
+    dict_path = stem.string() + "_dict.bin";
+    if(fs::exists(dict_path)) {
+      std::vector<std::byte> dict(fs::file_size(dict_path));
+      std::ifstream dict_file(dict_path, std::fstream::binary);
+      dict_file.read(reinterpret_cast<char*>(dict.data()), dict.size());
+      if(!dict_file) {
+        Rf_error("Impossible to read the dictionary at %s.\n", dict_path.string().c_str());
+      }
+      set_dictionary(std::move(dict));
+    }
+
+    blob.open(file_path, write);
+
+    uint64_t end = 0;
+    if(index.nb_values() > 0) {
+      const block_t& last = index.read(index.nb_values() - 1);
+      end = last.offset + last.compressed_size;
+    }
+    if(write && end < blob.size()) {
+      blob.truncate(end);
+    }
+    if(end != blob.size()) {
+      Rf_error("Inconsistent size for table %s: %llu vs %llu bytes.\n", file_path.string().c_str(),
+               (unsigned long long) end, (unsigned long long) blob.size());
+    }
+  }
+
+  // Samples evenly spaced values of source
+  void train(const BlobTable& source) override {
+    throw_assert(write_mode && index.nb_values() == 0);
+
+    uint64_t n = source.nb_values();
+    uint64_t total_size = 0;
+    for(uint64_t i = 0; i < n; i++) {
+      total_size += source.value_size(i);
+    }
+    uint64_t step = std::max<uint64_t>(1, total_size / max_samples_size);
+
+    DictionaryBuilder builder;
+    BlobCursor cursor;
+    for(uint64_t i = 0; i < n; i += step) {
+      builder.add_sample(source.read_view(i, cursor));
+    }
+
+    auto dict = builder.build(dict_size);
+    std::ofstream dict_file(dict_path, std::fstream::binary | std::fstream::trunc);
+    dict_file.write(reinterpret_cast<const char*>(dict.data()), dict.size());
+    if(!dict_file) {
+      Rf_error("Impossible to write the dictionary at %s.\n", dict_path.string().c_str());
+    }
+    set_dictionary(std::move(dict));
+  }
+
+  Span<const std::byte> read_view(uint64_t idx, BlobCursor& cursor) const override {
+    const block_t entry = index.read(idx);
+    const std::byte* data = blob.view(entry.offset, entry.compressed_size);
+
+    if(entry.compressed_size == entry.raw_size) {
+      return Span<const std::byte>(data, entry.raw_size);
+    }
+
+    if(cursor.block != idx) {
+      cursor.buffer.resize(entry.raw_size);
+      if(!LZ4Codec::decompress(data, entry.compressed_size, cursor.buffer.data(), entry.raw_size,
+                               dictionary.data(), dictionary.size())) {
+        Rf_error("Corrupted value %llu in table %s.\n", (unsigned long long) idx, file_path.string().c_str());
+      }
+      cursor.block = idx;
+    }
+    return Span<const std::byte>(cursor.buffer.data(), entry.raw_size);
+  }
+
+  bool read_checked(uint64_t idx, BlobCursor& cursor, Span<const std::byte>& view) const override {
+    const block_t entry = index.read(idx);
+
+    // Values follow each other in the file
+    uint64_t start = 0;
+    if(idx > 0) {
+      const block_t previous = index.read(idx - 1);
+      start = previous.offset + previous.compressed_size;
+    }
+    if(entry.offset != start || entry.offset > blob.size() || entry.compressed_size > blob.size() - entry.offset ||
+       entry.compressed_size > entry.raw_size || entry.raw_size > max_expansion * entry.compressed_size + dict_size) {
+      return false;
+    }
+
+    const std::byte* data = blob.view(entry.offset, entry.compressed_size);
+    if(entry.compressed_size == entry.raw_size) {
+      view = Span<const std::byte>(data, entry.raw_size);
+      return true;
+    }
+
+    if(cursor.block != idx) {
+      cursor.buffer.resize(entry.raw_size);
+      if(!LZ4Codec::decompress(data, entry.compressed_size, cursor.buffer.data(), entry.raw_size,
+                               dictionary.data(), dictionary.size())) {
+        cursor.block = UINT64_MAX;
+        return false;
+      }
+      cursor.block = idx;
+    }
+    view = Span<const std::byte>(cursor.buffer.data(), entry.raw_size);
+    return true;
+  }
+
+  void append_view(Span<const std::byte> val) override {
+    block_t entry;
+    entry.raw_size = val.size();
+
+    compressed.resize(LZ4Codec::compress_bound(val.size()));
+    size_t compressed_size = codec.compress(val.data(), val.size(), compressed.data());
+    if(compressed_size < val.size()) {
+      entry.compressed_size = compressed_size;
+      entry.offset = blob.append(Span<const std::byte>(compressed.data(), compressed_size));
+    }
+    else {
+      entry.compressed_size = val.size();
+      entry.offset = blob.append(val);
+    }
+    index.append(entry);
+  }
+
+  uint64_t value_size(uint64_t idx) const override {
+    return index.read(idx).raw_size;
+  }
+
+  uint64_t stored_size(uint64_t idx) const override {
+    return index.read(idx).compressed_size;
+  }
+
+  void write(uint64_t idx, const std::vector<std::byte>& val) override {
+    Rf_error("Values cannot be overwritten in a dictionary compressed table.\n");
+  }
+
+  void map() const override {
+    index.load_all();
+    blob.map();
+  }
+
+  void load_all() override {
+    index.load_all();
+  }
+
+  void flush() override {
+    blob.flush();
+    index.flush();
+  }
+
+  void truncate(uint64_t n) override {
+    if(n >= index.nb_values()) {
+      return;
+    }
+    blob.flush();
+    index.truncate(n);
+    uint64_t end = 0;
+    if(n > 0) {
+      const block_t& last = index.read(n - 1);
+      end = last.offset + last.compressed_size;
+    }
+    blob.truncate(end);
+    flush();
+  }
+
+  uint64_t nb_values() const override { return index.nb_values(); }
+
+  bool loaded() const override { return index.loaded(); }
+
+  std::vector<fs::path> files() const override {
+    return {file_path, dict_path,
+            index.get_path(), fs::path(index.get_path()).replace_extension("conf")};
+  }
+};
+
+
+// Layout:
+// - <stem>.bin: one slot of slot_size bytes per value
+// - <stem>_large.bin: values that do not fit in a slot, one after the other
+// A slot starts with the size of the value, followed by the value itself if it fits,
+// or by its offset and size in the large file otherwise.
+// Scalars and short vectors, which are a large share of the values, are stored inline:
+// they cost slot_size bytes instead of 16 bytes of offset and size plus the value,
+// and reading them is a single access in the (mapped) slot table.
+struct inline_slot_t {
+  static constexpr uint8_t spilled = 255;
+  static constexpr size_t capacity = 23;
+
+  uint8_t size = 0;// spilled if the value is in the large file
+  std::byte data[capacity] = {};
+};
+
+class InlineBlobTable : public BlobTable {
+private:
+  mutable FSizeTable<inline_slot_t> slots;
+  BlobFile large;
+
+  struct large_ref_t {
+    uint64_t offset;
+    uint64_t size;
+  };
+  static_assert(sizeof(large_ref_t) <= inline_slot_t::capacity);
+
+  static large_ref_t large_ref(const inline_slot_t& slot) {
+    large_ref_t ref;
+    std::memcpy(&ref, slot.data, sizeof(ref));
+    return ref;
+  }
+
+public:
+  const char* layout() const override { return "inline"; }
+
+  void open(const fs::path& path, bool write = true) override {
+    write_mode = write;
+    file_path = fs::absolute(path);
+    file_path.replace_extension("bin");
+    fs::path stem = file_path.parent_path() / file_path.stem();
+
+    slots.open(file_path, write);
+    large.open(stem.string() + "_large.bin", write);
+  }
+
+  Span<const std::byte> read_view(uint64_t idx, BlobCursor& cursor) const override {
+    const inline_slot_t& slot = slots.read(idx);
+    if(slot.size != inline_slot_t::spilled) {
+      if(slots.loaded()) {
+        return Span<const std::byte>(slot.data, slot.size);
+      }
+      // slot is a reference to a temporary buffer of the table
+      cursor.buffer.assign(slot.data, slot.data + slot.size);
+      cursor.block = UINT64_MAX;
+      return cursor.buffer;
+    }
+    large_ref_t ref = large_ref(slot);
+    return Span<const std::byte>(large.view(ref.offset, ref.size), ref.size);
+  }
+
+  bool read_checked(uint64_t idx, BlobCursor& cursor, Span<const std::byte>& view) const override {
+    const inline_slot_t& slot = slots.read(idx);
+    if(slot.size != inline_slot_t::spilled) {
+      if(slot.size > inline_slot_t::capacity) {
+        return false;
+      }
+      view = read_view(idx, cursor);
+      return true;
+    }
+    large_ref_t ref = large_ref(slot);
+    if(ref.offset > large.size() || ref.size > large.size() - ref.offset) {
+      return false;
+    }
+    view = Span<const std::byte>(large.view(ref.offset, ref.size), ref.size);
+    return true;
+  }
+
+  void append_view(Span<const std::byte> val) override {
+    inline_slot_t slot;
+    if(val.size() <= inline_slot_t::capacity) {
+      slot.size = val.size();
+      if(val.size() > 0) {
+        std::memcpy(slot.data, val.data(), val.size());
+      }
+    }
+    else {
+      large_ref_t ref;
+      ref.size = val.size();
+      ref.offset = large.append(val);
+      slot.size = inline_slot_t::spilled;
+      std::memcpy(slot.data, &ref, sizeof(ref));
+    }
+    slots.append(slot);
+  }
+
+  uint64_t value_size(uint64_t idx) const override {
+    const inline_slot_t& slot = slots.read(idx);
+    return slot.size == inline_slot_t::spilled ? large_ref(slot).size : slot.size;
+  }
+
+  uint64_t stored_size(uint64_t idx) const override {
+    const inline_slot_t& slot = slots.read(idx);
+    return sizeof(inline_slot_t) + (slot.size == inline_slot_t::spilled ? large_ref(slot).size : 0);
+  }
+
+  void write(uint64_t idx, const std::vector<std::byte>& val) override {
+    Rf_error("Values cannot be overwritten in an inline table.\n");
+  }
+
+  void map() const override {
+    slots.load_all();
+    large.map();
+  }
+
+  void load_all() override {
+    slots.load_all();
+  }
+
+  void flush() override {
+    large.flush();
+    slots.flush();
+  }
+
+  // The values of the large file after the last kept one are just not referenced anymore
+  void truncate(uint64_t n) override {
+    slots.truncate(n);
+  }
+
+  uint64_t nb_values() const override { return slots.nb_values(); }
+
+  bool loaded() const override { return slots.loaded(); }
+
+  std::vector<fs::path> files() const override {
+    return {file_path, fs::path(file_path).replace_extension("conf"), large.get_path()};
+  }
+};
+
+
+inline std::unique_ptr<BlobTable> make_blob_table(const std::string& layout) {
+  if(layout == "plain") {
+    return std::make_unique<PlainBlobTable>();
+  }
+  else if(layout == "block") {
+    return std::make_unique<BlockBlobTable>();
+  }
+  else if(layout == "dict") {
+    return std::make_unique<DictBlobTable>();
+  }
+  else if(layout == "inline") {
+    return std::make_unique<InlineBlobTable>();
+  }
+  Rf_error("Unknown layout for the values: %s.\n", layout.c_str());
+}
+
+#endif
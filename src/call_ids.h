@@ -4,118 +4,398 @@
 
 #include <vector>
 #include <filesystem>
+#include <fstream>
 #include <unistd.h>
+#include <algorithm>
+#include <memory>
 
 #include "table.h"
+#include "csr_column.h"
+#include "varint.h"
 
 
 
+// A call id added to a value that was already in the files, in the log of the old format
+struct call_id_record_t {
+    uint64_t index;
+    uint64_t call_id;
+};
+
+// The call ids of each value are kept sorted and without duplicates, and stored as
+// the first id followed by the differences between consecutive ids, as varints, in a CSR column
+// (call_ids_delta). Call ids mostly increase during a trace, so the ids of a new value are
+// appended in place to its row.
+// The other ones (ids smaller than the last one of the value, or for a value already in the files)
+// go to an append-only log (call_ids_delta_log.bin), and are merged with the row when reading.
+// A record of the log is the index of the value and the difference with the call id of the previous
+// record, as varints: a few bytes, as the records mostly follow the trace.
+// The log is folded into the column by compact(), which also happens at checkpoints and at closing
+// when the log is larger than the column: the log, and its call ids kept in memory, do not grow
+// for the whole session.
+// The log is numbered with the companion generation of the column (call_ids_delta_log_<n>.bin):
+// compacting writes the new files of the column, and the switch of its configuration file
+// also switches to a new, empty, log. After a crash, the database has either the old column and
+// its log, or the compacted column, never both.
+//
+// Very frequent values (TRUE, NULL...) can accumulate millions of call ids: max_call_ids
+// caps the number of call ids of a value (0 for no cap). Only the smallest ones, i.e.
+// usually the first calls, are kept.
 class CallIds {
 private:
-    pid_t pid;
+    CSRColumn<uint8_t> call_ids;
+    std::unique_ptr<FSizeTable<uint8_t>> call_ids_log;
+    uint64_t log_last_call_id = 0;
+    // Old format, in read mode
+    std::unique_ptr<CSRColumn<uint64_t>> plain_call_ids;
+
+    struct pending_ids_t {
+        uint64_t nb_row_ids = 0;// in the column, when the value got its first log record
+        std::vector<uint64_t> ids;
+    };
+    robin_hood::unordered_map<uint64_t, pending_ids_t> pending;
+
+    // Last call id and number of call ids of the last row, while it is extendable
+    uint64_t last_call_id = 0;
+    uint64_t last_nb_ids = 0;
+
+    uint64_t max_call_ids = 0;
 
-    std::unique_ptr<VSizeTable<std::vector<uint64_t>>> call_ids_table;
-    std::vector<std::vector<uint64_t>> call_ids; // call_ids should be unique at the level of a file.
-    // provided there are less than 2^64 calls in one file.
+    mutable std::vector<uint64_t> current_ids;
+    mutable std::vector<uint8_t> encoded;
 
     bool write_mode = false;
-    bool new_call_ids = false;
+    pid_t pid;
 
     fs::path base_path = "";
+
+    void decode_row(uint64_t index, Span<const uint8_t> row, std::vector<uint64_t>& out) const {
+        if(!decode_deltas(row, out)) {
+            Rf_error("The call ids of value %llu are corrupted in %s.\n", (unsigned long long) index, base_path.string().c_str());
+        }
+    }
+
+    // False if the cap on the number of call ids drops it
+    bool add_pending(uint64_t index, uint64_t call_id) {
+        auto it = pending.find(index);
+        if(it == pending.end()) {
+            it = pending.insert({index, pending_ids_t{count_varints(call_ids.row(index)), {}}}).first;
+        }
+        pending_ids_t& p = it->second;
+        // The same call often adds several parameters with the same value
+        if(!p.ids.empty() && p.ids.back() == call_id) {
+            return true;
+        }
+        if(max_call_ids > 0 && p.nb_row_ids + p.ids.size() >= max_call_ids) {
+            // It can already be there, when the value is passed to several parameters of a call
+            if(std::find(p.ids.begin(), p.ids.end(), call_id) != p.ids.end()) {
+                return true;
+            }
+            current_ids.clear();
+            decode_row(index, call_ids.row(index), current_ids);
+            return std::binary_search(current_ids.begin(), current_ids.end(), call_id);
+        }
+        p.ids.push_back(call_id);
+        return true;
+    }
+
+    // Convert a table of plain call ids
+    void convert(CSRColumn<uint64_t>& plain) {
+        std::vector<uint64_t> ids;
+        for(uint64_t i = 0; i < plain.nb_rows(); i++) {
+            Span<const uint64_t> row = plain.row(i);
+            ids.assign(row.begin(), row.end());
+            std::sort(ids.begin(), ids.end());
+            ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+            encoded.clear();
+            encode_deltas(ids, encoded);
+            call_ids.append_row(encoded);
+        }
+        call_ids.flush();
+    }
+
+    void append_log(uint64_t index, uint64_t call_id) {
+        encoded.clear();
+        put_varint(encoded, index);
+        put_varint(encoded, zigzag(static_cast<int64_t>(call_id - log_last_call_id)));
+        call_ids_log->append(encoded);
+        log_last_call_id = call_id;
+    }
+
+    void read_log(Span<const uint8_t> bytes) {
+        size_t pos = 0;
+        uint64_t index = 0;
+        uint64_t delta = 0;
+        while(pos < bytes.size()) {
+            if(!get_varint(bytes, pos, index) || !get_varint(bytes, pos, delta)) {
+                Rf_error("Corrupted call id log in %s.\n", base_path.string().c_str());
+            }
+            log_last_call_id += unzigzag(delta);
+            if(index >= call_ids.nb_rows()) {
+                Rf_error("Call id log refers to value %llu, but there are only %llu values in the call id table.\n",
+                         (unsigned long long) index, (unsigned long long) call_ids.nb_rows());
+            }
+            add_pending(index, log_last_call_id);
+        }
+    }
+
+    fs::path log_path(uint64_t gen) const {
+        return base_path / ("call_ids_delta_log" + (gen == 0 ? std::string() : "_" + std::to_string(gen)) + ".bin");
+    }
+
+    void remove_log(uint64_t gen) const {
+        std::error_code ec;
+        fs::path path = log_path(gen);
+        fs::remove(path, ec);
+        fs::remove(path.replace_extension(".conf"), ec);
+    }
+
+    void open_log() {
+        call_ids_log.reset();
+        uint64_t gen = call_ids.get_companion_generation();
+        if(write_mode && gen > 0) {
+            // The log of the previous generation, if a compaction was interrupted after the switch
+            remove_log(gen - 1);
+        }
+        call_ids_log = std::make_unique<FSizeTable<uint8_t>>(log_path(gen), write_mode);
+        pending.clear();
+        log_last_call_id = 0;
+        if(write_mode) {
+            // Not through the table, which would then keep all the log in memory
+            std::vector<uint8_t> bytes(call_ids_log->nb_values());
+            std::ifstream file(log_path(gen), std::fstream::binary);
+            file.read(reinterpret_cast<char*>(bytes.data()), bytes.size());
+            if(!file) {
+                Rf_error("Cannot read the call id log in %s.\n", base_path.string().c_str());
+            }
+            read_log(bytes);
+        }
+        else {
+            read_log(call_ids_log->memory_view());
+        }
+
+        // Log of the old format, with plain records
+        if(fs::exists(base_path / "call_ids_log.conf")) {
+            auto old_log = std::make_unique<FSizeTable<call_id_record_t>>(base_path / "call_ids_log.bin", write_mode);
+            for(uint64_t i = 0; i < old_log->nb_values(); i++) {
+                const call_id_record_t& rec = old_log->read(i);
+                if(rec.index >= call_ids.nb_rows()) {
+                    Rf_error("Call id log refers to value %llu, but there are only %llu values in the call id table.\n",
+                             (unsigned long long) rec.index, (unsigned long long) call_ids.nb_rows());
+                }
+                if(add_pending(rec.index, rec.call_id) && write_mode) {
+                    append_log(rec.index, rec.call_id);
+                }
+            }
+            if(write_mode) {
+                call_ids_log->flush();
+                old_log.reset();
+                fs::remove(base_path / "call_ids_log.bin");
+                fs::remove(base_path / "call_ids_log.conf");
+            }
+        }
+    }
+
 public:
     CallIds() : pid(getpid()) {}
-    CallIds(const fs::path& base_path_, bool write = true) : pid(getpid()), write_mode(write) {
-        open(base_path_);
+    CallIds(const fs::path& base_path_, bool write = true) : write_mode(write), pid(getpid()) {
+        open(base_path_, write);
     }
 
     void open(const fs::path& base_path_, bool write = true) {
         write_mode = write;
         base_path = fs::absolute(base_path_);
 
-        call_ids_table = std::make_unique<VSizeTable<std::vector<uint64_t>>>(base_path / "call_ids.bin", write_mode);
-
-        if(write_mode) {
-            call_ids.clear();
-            call_ids.resize(call_ids_table->nb_values());
-
-            for(uint64_t i = 0 ; i < call_ids_table->nb_values() ; i++) {
-                const std::vector<uint64_t>& calls = call_ids_table->read(i);
-                assert(calls.size() > 0);
-                call_ids[i].reserve(calls.size());
-                std::copy_n(calls.begin(), calls.size(), call_ids[i].begin());
+        bool has_plain = fs::exists(base_path / "call_ids_column.conf") || fs::exists(base_path / "call_ids.conf");
+        if(!fs::exists(base_path / "call_ids_delta_column.conf") && has_plain) {
+            auto plain = std::make_unique<CSRColumn<uint64_t>>();
+            plain->open(base_path, "call_ids", false);
+            if(write_mode) {
+                call_ids.open(base_path, "call_ids_delta", true);
+                convert(*plain);
+                auto old_files = plain->files();
+                plain.reset();
+                for(const auto& file : old_files) {
+                    fs::remove(file);
+                }
             }
-
-            // No need anymore for the table, until the destructor
-            call_ids_table.reset();
+            else {
+                plain_call_ids = std::move(plain);
+                return;
+            }
+        }
+        else {
+            call_ids.open(base_path, "call_ids_delta", write_mode);
         }
+
+        open_log();
+        last_nb_ids = 0;
     }
 
-    void add_call_id(uint64_t index, uint64_t call_id) {
+    void set_max_call_ids(uint64_t n) { max_call_ids = n; }
+    uint64_t get_max_call_ids() const { return max_call_ids; }
+
+    // False if the call id is dropped because the value already has max_call_ids call ids
+    bool add_call_id(uint64_t index, uint64_t call_id) {
         assert(write_mode);
-        assert(pid == getpid());
 
-        if(index > call_ids.size()) {
+        if(index > call_ids.nb_rows()) {
               Rf_error("Cannot add a call id for a value that was not recorded in the main table."
                    " Last index is %llu, but the index of that new call id is %llu.\n",
-                   (unsigned long long) call_ids.size(), (unsigned long long) index);
+                   (unsigned long long) call_ids.nb_rows(), (unsigned long long) index);
         }
 
-        if(index < call_ids.size()) {
-            call_ids[index].push_back(call_id);
+        if(index == call_ids.nb_rows()) {
+            encoded.clear();
+            put_varint(encoded, call_id);
+            call_ids.append_row(encoded);
+            last_call_id = call_id;
+            last_nb_ids = 1;
         }
-        else if( index == call_ids.size()) {
-            call_ids.emplace_back(1, call_id);
-        }
-
-
-        new_call_ids = true;
-    }
-
-    const std::vector<uint64_t>& get_call_ids(uint64_t index) const {
-        if(write_mode) {
-            if(index < call_ids.size()) {
-                return call_ids[index];
+        else if(call_ids.extendable(index) && call_id >= last_call_id && pending.count(index) == 0) {
+            if(call_id == last_call_id) {
+                return true;
             }
-            else {
-                Rf_error("Trying to retrieve a call id for a value that does not exist. %llu values but %llu index.\n",
-                 (unsigned long long) call_ids.size(), (unsigned long long) index);
+            if(max_call_ids > 0 && last_nb_ids >= max_call_ids) {
+                return false;
+            }
+            encoded.clear();
+            put_varint(encoded, call_id - last_call_id);
+            for(uint8_t byte : encoded) {
+                call_ids.append_to_row(index, byte);
             }
+            last_call_id = call_id;
+            last_nb_ids++;
         }
         else {
-            return call_ids_table->read(index);
+            size_t nb_ids = pending.count(index) > 0 ? pending[index].ids.size() : 0;
+            if(!add_pending(index, call_id)) {
+                return false;
+            }
+            if(pending[index].ids.size() > nb_ids) {
+                append_log(index, call_id);
+            }
         }
+        return true;
     }
 
-    const fs::path& get_base_path() const { return base_path; }
+    // Sorted call ids, without duplicates.
+    // Valid until the next call
+    Span<const uint64_t> get_call_ids(uint64_t index) const {
+        if(index >= nb_values()) {
+            Rf_error("Trying to retrieve a call id for a value that does not exist. %llu values but %llu index.\n",
+             (unsigned long long) nb_values(), (unsigned long long) index);
+        }
+        if(plain_call_ids) {
+            return plain_call_ids->row(index);
+        }
 
-    virtual ~CallIds() {
-        if(write_mode && pid == getpid() && new_call_ids) {
-            fs::rename(base_path / "call_ids.bin", base_path / "call_ids-old.bin");
-            fs::rename(base_path / "call_ids.conf", base_path / "call_ids-old.conf");
-            fs::rename(base_path / "call_ids_offsets.bin", base_path / "call_ids_offsets-old.bin");
-            fs::rename(base_path / "call_ids_offsets.conf", base_path / "call_ids_offsets-old.conf");
+        current_ids.clear();
+        decode_row(index, call_ids.row(index), current_ids);
+        if(!pending.empty()) {
+            auto it = pending.find(index);
+            if(it != pending.end()) {
+                current_ids.insert(current_ids.end(), it->second.ids.begin(), it->second.ids.end());
+                std::sort(current_ids.begin(), current_ids.end());
+                current_ids.erase(std::unique(current_ids.begin(), current_ids.end()), current_ids.end());
+                if(max_call_ids > 0 && current_ids.size() > max_call_ids) {
+                    current_ids.resize(max_call_ids);
+                }
+            }
+        }
+        return current_ids;
+    }
 
-            VSizeTable<std::vector<uint64_t>> call_ids_table(base_path / "call_ids.bin");
+    // The stored call ids of the value can be decoded.
+    // Can be called concurrently, as long as nothing is added
+    bool valid(uint64_t index) const {
+        return plain_call_ids || valid_varints(call_ids.row(index));
+    }
 
-            for(const auto& call_ids : call_ids) {
-                call_ids_table.append(call_ids);
+    const fs::path& get_base_path() const { return base_path; }
+
+    // Fold the log into the column
+    void compact() {
+        if(pending.empty() && max_call_ids == 0) {
+            call_ids.flush();
+            return;
+        }
+        uint64_t gen = call_ids.get_companion_generation();
+        std::vector<uint64_t> ids;
+        call_ids.compact([&](uint64_t i, Span<const uint8_t> row, std::vector<uint8_t>& out) {
+            auto it = pending.find(i);
+            if(it == pending.end() && (max_call_ids == 0 || count_varints(row) <= max_call_ids)) {
+                out.insert(out.end(), row.begin(), row.end());
+                return;
             }
-            call_ids_table.flush();
+            ids.clear();
+            decode_row(i, row, ids);
+            if(it != pending.end()) {
+                ids.insert(ids.end(), it->second.ids.begin(), it->second.ids.end());
+                std::sort(ids.begin(), ids.end());
+                ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+            }
+            if(max_call_ids > 0 && ids.size() > max_call_ids) {
+                ids.resize(max_call_ids);
+            }
+            encode_deltas(ids, out);
+        }, gen + 1);
+        if(call_ids.get_companion_generation() == gen) {
+            return;// not compacted, in a forked process
+        }
 
+        // The records of the log are now in the column
+        call_ids_log.reset();
+        remove_log(gen);
+        open_log();
+        last_nb_ids = 0;
+    }
 
-            fs::remove(base_path / "call_ids-old.bin");
-            fs::remove(base_path / "call_ids-old.conf");
-            fs::remove(base_path / "call_ids_offsets-old.bin");
-            fs::remove(base_path / "call_ids_offsets-old.conf");
+    // Only keep the call ids of the first n values.
+    // The log is folded first, as it can refer to the removed values.
+    void truncate(uint64_t n) {
+        assert(write_mode);
+        if(n >= nb_values()) {
+            return;
         }
+        compact();
+        call_ids.truncate(n);
+        last_nb_ids = 0;
     }
 
-    uint64_t nb_values() const {
-        if(write_mode) {
-            return call_ids.size();
+    // Folding the log costs a rewrite of the column: it is worth it once the log is larger
+    bool log_too_large() const {
+        return call_ids_log->nb_values() > call_ids.nb_values();
+    }
+
+    // At a checkpoint of the database
+    void checkpoint() {
+        if(!write_mode) {
+            return;
+        }
+        if(log_too_large()) {
+            compact();
         }
         else {
-            return call_ids_table->nb_values();
+            flush();
+        }
+    }
+
+    // Write the column and the log to disk, without folding the log
+    void flush() {
+        if(!write_mode) {
+            return;
+        }
+        call_ids.flush();
+        call_ids_log->flush();
+    }
+
+    uint64_t nb_values() const {
+        return plain_call_ids ? plain_call_ids->nb_rows() : call_ids.nb_rows();
+    }
+
+    virtual ~CallIds() {
+        if(write_mode && pid == getpid() && log_too_large()) {
+            compact();
         }
     }
 };
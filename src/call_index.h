@@ -0,0 +1,253 @@
+#ifndef SXPDB_CALL_INDEX_H
+#define SXPDB_CALL_INDEX_H
+
+#define R_NO_REMAP
+#include <R.h>
+#include <Rinternals.h>
+
+#include <vector>
+#include <filesystem>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <system_error>
+
+#include "robin_hood.h"
+
+namespace fs = std::filesystem;
+
+// A value seen in a call of a function
+struct call_index_record_t {
+  uint64_t call_id;
+  uint64_t value;
+  uint32_t package;
+  uint32_t param;
+
+  bool operator<(const call_index_record_t& other) const {
+    if(call_id != other.call_id) return call_id < other.call_id;
+    if(value != other.value) return value < other.value;
+    if(package != other.package) return package < other.package;
+    return param < other.param;
+  }
+
+  bool operator==(const call_index_record_t& other) const {
+    return call_id == other.call_id && value == other.value &&
+      package == other.package && param == other.param;
+  }
+};
+
+struct call_index_header_t {
+  uint64_t magic = 0;
+  uint32_t version = 0;
+  uint32_t reserved = 0;
+  uint64_t nb_values = 0;// the values 0..nb_values - 1 traced before the call sites are in the index
+  uint64_t nb_functions = 0;
+  uint64_t nb_records = 0;
+  uint64_t nb_call_sites = 0;// the call sites 0..nb_call_sites - 1 are in the index
+};
+
+// Inverted index from the functions to their calls: for each function,
+// the records (call id, value, package, parameter) of the values it has seen,
+// sorted by call id then value.
+// All the calls of a function are then read at once, without going through the origins and
+// the call ids of its values.
+//
+// The file (calls_index.bin) has a header, the offsets of the records of each function,
+// and then the records. Only the offsets are read when opening it; the records of a function
+// are read when looking it up.
+// Records of values added by build_indexes are kept in memory until write(), which
+// merges them with the ones in the file.
+class CallIndex {
+private:
+  static constexpr uint64_t magic = 0x58444e494c4c4143;// "CALLINDX"
+  // Version 1 paired all the locations of a value with all its calls
+  static constexpr uint32_t version = 2;
+
+  fs::path path;
+  call_index_header_t header;
+  std::vector<uint64_t> offsets;// nb_functions + 1 offsets, in records
+
+  // Per function
+  robin_hood::unordered_map<uint32_t, std::vector<call_index_record_t>> pending;
+  uint64_t nb_values_pending = 0;
+  uint64_t nb_call_sites_pending = 0;
+
+  std::string error_message;
+
+  // False if the records cannot be read
+  bool read_records(std::ifstream& file, uint32_t function, std::vector<call_index_record_t>& records) const {
+    records.clear();
+    if(function >= header.nb_functions) {
+      return true;
+    }
+    uint64_t start = offsets[function];
+    uint64_t end = offsets[function + 1];
+    records.resize(end - start);
+    file.seekg(sizeof(call_index_header_t) + offsets.size() * sizeof(uint64_t) + start * sizeof(call_index_record_t));
+    file.read(reinterpret_cast<char*>(records.data()), records.size() * sizeof(call_index_record_t));
+    return static_cast<bool>(file);
+  }
+
+public:
+  CallIndex() {}
+
+  void open(const fs::path& p) {
+    path = p;
+    header = call_index_header_t();
+    offsets.clear();
+    pending.clear();
+    nb_values_pending = 0;
+    nb_call_sites_pending = 0;
+
+    if(!fs::exists(path)) {
+      return;
+    }
+
+    std::ifstream file(path, std::fstream::binary);
+    file.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if(!file || header.magic != magic || header.version != version) {
+      Rf_warning("Invalid call index at %s. It will be rebuilt at the next build of the indexes.\n", path.string().c_str());
+      header = call_index_header_t();
+      return;
+    }
+    offsets.resize(header.nb_functions + 1);
+    file.read(reinterpret_cast<char*>(offsets.data()), offsets.size() * sizeof(uint64_t));
+    if(!file) {
+      Rf_error("Cannot read the call index at %s.\n", path.string().c_str());
+    }
+  }
+
+  // Number of values traced before the call sites already indexed
+  uint64_t nb_values() const { return std::max(header.nb_values, nb_values_pending); }
+  // Number of call sites already indexed
+  uint64_t nb_call_sites() const { return std::max(header.nb_call_sites, nb_call_sites_pending); }
+
+  // Records of the values ..end - 1 traced before the call sites, and of the call sites ..end_sites - 1
+  void add(std::vector<std::vector<call_index_record_t>>& function_records, uint64_t end, uint64_t end_sites) {
+    for(uint32_t f = 0; f < function_records.size(); f++) {
+      if(!function_records[f].empty()) {
+        auto& recs = pending[f];
+        recs.insert(recs.end(), function_records[f].begin(), function_records[f].end());
+      }
+    }
+    nb_values_pending = end;
+    nb_call_sites_pending = end_sites;
+  }
+
+  // Sorted by call id, and then by value
+  std::vector<call_index_record_t> calls_of(uint32_t function) const {
+    std::vector<call_index_record_t> records;
+    if(function < header.nb_functions && offsets[function] < offsets[function + 1]) {
+      std::ifstream file(path, std::fstream::binary);
+      if(!read_records(file, function, records)) {
+        Rf_error("Cannot read the calls of function %u in the call index at %s.\n", function, path.string().c_str());
+      }
+    }
+
+    auto it = pending.find(function);
+    if(it != pending.end()) {
+      size_t middle = records.size();
+      records.insert(records.end(), it->second.begin(), it->second.end());
+      std::sort(records.begin() + middle, records.end());
+      std::inplace_merge(records.begin(), records.begin() + middle, records.end());
+      // A value seen again in the same call and at the same location has records in both
+      records.erase(std::unique(records.begin(), records.end()), records.end());
+    }
+    return records;
+  }
+
+  bool empty() const { return header.nb_records == 0 && pending.empty(); }
+
+  // Merge the records in memory with the file, and write them at p.
+  // Like PackedIndexWriter, it does not raise R errors: false if it could not read the records
+  // of the file or write the new one, and error() says why.
+  bool write(const fs::path& p) {
+    if(p == path && pending.empty() && nb_values_pending <= header.nb_values && nb_call_sites_pending <= header.nb_call_sites) {
+      return true;
+    }
+
+    uint32_t nb_functions = header.nb_functions;
+    for(const auto& fun : pending) {
+      nb_functions = std::max(nb_functions, fun.first + 1);
+    }
+
+    fs::path tmp_path = p;
+    tmp_path += ".tmp";
+    std::ofstream out(tmp_path, std::fstream::binary | std::fstream::trunc);
+    if(!out) {
+      error_message = "Cannot create call index file " + tmp_path.string() + ": " + strerror(errno) + ".\n";
+      return false;
+    }
+
+    call_index_header_t new_header = header;
+    new_header.magic = magic;
+    new_header.version = version;
+    new_header.nb_values = nb_values();
+    new_header.nb_call_sites = nb_call_sites();
+    new_header.nb_functions = nb_functions;
+
+    // The offsets are written once all the records are
+    std::vector<uint64_t> new_offsets(nb_functions + 1, 0);
+    size_t records_start = sizeof(call_index_header_t) + new_offsets.size() * sizeof(uint64_t);
+    out.seekp(records_start);
+
+    std::ifstream in;
+    if(header.nb_functions > 0) {
+      in.open(path, std::fstream::binary);
+    }
+
+    uint64_t nb_records = 0;
+    std::vector<call_index_record_t> records;
+    for(uint32_t f = 0; f < nb_functions; f++) {
+      new_offsets[f] = nb_records;
+      if(!read_records(in, f, records)) {
+        error_message = "Cannot read the calls of function " + std::to_string(f) + " in the call index at " + path.string() + ".\n";
+        out.close();
+        std::error_code ec;
+        fs::remove(tmp_path, ec);
+        return false;
+      }
+      auto it = pending.find(f);
+      if(it != pending.end()) {
+        records.insert(records.end(), it->second.begin(), it->second.end());
+        std::sort(records.begin(), records.end());
+        records.erase(std::unique(records.begin(), records.end()), records.end());
+      }
+      out.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(call_index_record_t));
+      nb_records += records.size();
+    }
+    new_offsets[nb_functions] = nb_records;
+    new_header.nb_records = nb_records;
+
+    out.seekp(0);
+    out.write(reinterpret_cast<const char*>(&new_header), sizeof(new_header));
+    out.write(reinterpret_cast<const char*>(new_offsets.data()), new_offsets.size() * sizeof(uint64_t));
+    out.close();
+    in.close();
+    std::error_code ec;
+    if(!out) {
+      error_message = "Cannot write call index file " + tmp_path.string() + ".\n";
+      fs::remove(tmp_path, ec);
+      return false;
+    }
+
+    fs::rename(tmp_path, p, ec);
+    if(ec) {
+      error_message = "Cannot replace call index file " + p.string() + ": " + ec.message() + ".\n";
+      fs::remove(tmp_path, ec);
+      return false;
+    }
+    path = p;
+
+    header = new_header;
+    offsets = std::move(new_offsets);
+    pending.clear();
+    return true;
+  }
+
+  const std::string& error() const { return error_message; }
+};
+
+#endif
@@ -6,28 +6,22 @@
 #include <unistd.h>
 
 #include "table.h"
+#include "csr_column.h"
 
 
 class ClassNames {
 private:
-  pid_t pid;
   bool write_mode = true;
-  uint64_t last_written = 0;
 
   // The order of classes is important in R
-  std::vector<std::vector<uint32_t>> classes;
+  CSRColumn<uint32_t> classes;
   UniqTextTable class_names;
 
-  std::unique_ptr<VSizeTable<std::vector<uint32_t>>> class_table;
-
-  std::vector<uint32_t> empty_class;
-  std::vector<uint32_t> dummy_class = {0};
-
   fs::path base_path = "";
 public:
-  ClassNames() : pid(getpid()) {}
+  ClassNames() {}
 
-  ClassNames(const fs::path& base_path_, bool write = true) : pid(getpid()), write_mode(write) {
+  ClassNames(const fs::path& base_path_, bool write = true) : write_mode(write) {
     open(base_path_, write);
   }
 
@@ -35,50 +29,31 @@ public:
     write_mode = write;
     base_path = fs::absolute(base_path_);
 
-    class_table = std::make_unique<VSizeTable<std::vector<uint32_t>>>(base_path / "classes.bin", write_mode);
+    // the old table stored a 0 for values without class names
+    classes.open(base_path, "classes", write_mode, true);
 
     // this will need to be loaded if we have to build the search indexes
     // classnames provide load_all for that
     class_names.open(base_path / "classnames.bin", write_mode);
 
-    // populate classes only in write_mode
-    if(write_mode) {
-      // if the class names are empty, we inject the empty class name, for values without class names
-      // (we only store class names for objects, i.e. the old class name)
-      classes.clear();
-      classes.resize(class_table->nb_values());
-      for(uint64_t i = 0 ; i < class_table->nb_values(); i++) {
-        const std::vector<uint32_t>& names = class_table->read(i);
-        assert(names.size() > 0);
-        if(names.size() != 1 || names[0] != 0) { // the value has a class
-          classes[i].reserve(names.size());
-          classes[i].insert(classes[i].end(), names.begin(), names.end());
-        }
-      }
-      class_table.reset();// we will create a new one in the destructor if in write_mode
-    }
-
     // inject an empty string at position 0
     // it indicates the absence of a class
     if(class_names.nb_values() == 0) {
       class_names.append("");
     }
-
-    last_written = classes.size();
   }
 
   void add_classnames(uint64_t index, SEXP klass) {
     assert(write_mode);
-    assert(pid == getpid());
-    if(index != classes.size()) {
+    if(index != classes.nb_rows()) {
       Rf_error("Cannot add a class name for a value that was not recorded in the main table."
                  " Last index is %llu, but the index of that new class name is %llu.\n",
-                 (unsigned long long) classes.size(), (unsigned long long) index);
+                 (unsigned long long) classes.nb_rows(), (unsigned long long) index);
     }
 
     //class names is an attribute with a vector of strings
     if(klass == R_NilValue) {
-      classes.push_back(empty_class);
+      classes.append_row(Span<const uint32_t>());
     }
     else if (TYPEOF(klass) == STRSXP ){
       std::vector<uint32_t> new_classes;
@@ -87,7 +62,7 @@ public:
           uint32_t idx = class_names.append_index(CHAR(STRING_ELT(klass, i)));
           new_classes.push_back(idx);
       }
-      classes.push_back(new_classes);
+      classes.append_row(new_classes);
     }
     else {
       Rf_warning("The class attribute for value at index %llu has a surprising type: %s.\n", (unsigned long long) index, Rf_type2char(TYPEOF(klass)));
@@ -97,40 +72,28 @@ public:
   void add_classname(uint64_t index, const std::string& classname) {
     assert(write_mode);
     uint32_t idx = class_names.append_index(classname);
-    if(classes.size() == index) {
-      classes.push_back({idx});
-    }
-    classes[index].push_back(idx);
+    classes.append_to_row(index, idx);
   }
 
   void add_emptyclass(uint64_t index) {
     assert(write_mode);
-    if(classes.size() == index) {
-      classes.push_back(empty_class);
+    if(classes.nb_rows() == index) {
+      classes.append_row(Span<const uint32_t>());
     }
   }
 
-  const std::vector<uint32_t>& get_classnames(uint64_t index) const {
+  // Valid until the next class name is added
+  Span<const uint32_t> get_classnames(uint64_t index) const {
     assert(index < nb_values());
-    if(write_mode) {
-      return classes[index];
-    }
-    else {
-      return class_table->read(index);
-    }
- }
+    return classes.row(index);
+  }
 
   uint32_t nb_classnames() const {return class_names.nb_values() - 1; }
 
   const std::string& class_name(uint32_t i) const { return class_names.read(i); }
 
   uint64_t nb_values() const {
-    if(write_mode) {
-      return classes.size();
-    }
-    else {
-      return class_table->nb_values();
-    }
+    return classes.nb_rows();
   }
 
   void load_all() {
@@ -150,32 +113,25 @@ public:
     return res ? std::optional<uint32_t>(res) : std::nullopt;
   }
 
-  virtual ~ClassNames() {
-    //TODO: open in write mode a VSizeTable and dump the class ids there
-    if(write_mode && pid == getpid() && last_written < classes.size()) {
-      fs::rename(base_path / "classes.bin", base_path / "classes-old.bin");
-      fs::rename(base_path / "classes.conf", base_path / "classes-old.conf");
-      fs::rename(base_path / "classes_offsets.bin", base_path / "classes_offsets-old.bin");
-      fs::rename(base_path / "classes_offsets.conf", base_path / "classes_offsets-old.conf");
-
-      VSizeTable<std::vector<uint32_t>> class_table(base_path / "classes.bin");
-
-      for(const auto& class_ids : classes) {
-        if(class_ids.size() == 0) {// No classes
-          class_table.append(dummy_class);
-        }
-        else {
-          class_table.append(class_ids);
-        }
-      }
+  void compact() {
+    class_names.flush();
+    classes.compact();
+  }
 
-      class_table.flush();
+  void flush() {
+    class_names.flush();
+    classes.flush();
+  }
 
-      fs::remove(base_path / "classes-old.bin");
-      fs::remove(base_path / "classes-old.conf");
-      fs::remove(base_path / "classes_offsets-old.bin");
-      fs::remove(base_path / "classes_offsets-old.conf");
-    }
+  // Only keep the classes of the first n values. The class names are kept.
+  void truncate(uint64_t n) {
+    class_names.flush();
+    classes.truncate(n);
+  }
+
+  virtual ~ClassNames() {
+    // The classes refer to the class names
+    class_names.flush();
   }
 };
 
@@ -53,17 +53,25 @@ Config::Config(const fs::path& path) {
   }
 }
 
+// The file is written next to the target and renamed, so that a crash leaves either
+// the old or the new configuration, never a truncated one
 void Config::write(const fs::path& filename) {
-  std::ofstream file(filename,std::ofstream::out | std::ofstream::trunc);
+  fs::path tmp_path = filename;
+  tmp_path += ".tmp";
+  std::ofstream file(tmp_path, std::ofstream::out | std::ofstream::trunc);
 
   if(!file) {
-    Rf_error("Impossible to open for write config file %s\n", filename.string().c_str());
+    Rf_error("Impossible to open for write config file %s\n", tmp_path.string().c_str());
   }
 
   for(auto& it : config) {
     file << it.first << "=" << it.second << "\n";
   }
-  file << std::flush;
+  file.close();
+  if(!file) {
+    Rf_error("Impossible to write config file %s\n", tmp_path.string().c_str());
+  }
+  fs::rename(tmp_path, filename);
 }
 
 
@@ -0,0 +1,480 @@
+#ifndef SXPDB_CSR_COLUMN_H
+#define SXPDB_CSR_COLUMN_H
+
+#define R_NO_REMAP
+#include <R.h>
+#include <Rinternals.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <filesystem>
+#include <algorithm>
+#include <type_traits>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "posix_compat.h"
+
+#include "table.h"
+#include "config.h"
+#include "mapped_file.h"
+#include "robin_hood.h"
+#include "span.h"
+
+namespace fs = std::filesystem;
+
+struct csr_overflow_record_t {
+  uint64_t row;
+  uint64_t value;
+};
+
+// Multi-valued column, with one row per value of the database, in compressed sparse row format:
+// - <name>_values.bin: the values of all the rows, one row after the other
+// - <name>_rows.bin: the end of each row in the values file (in number of values)
+// - <name>_overflow.bin: (row, value) records, for values appended to rows already in the files
+// - <name>_column.conf: the names of these files, and how many rows, values and records are valid
+//
+// The user of the column can keep other files with it, such as a log of updates to fold into it:
+// their generation (companion_generation) is in the configuration file, so that a rewrite switches
+// to the new files of the column and of its user at once.
+//
+// The files are mapped at opening, and new rows are appended to them when flushing.
+// A row with overflow records is merged in memory when the column is opened, or when
+// the first value is appended to it; the overflow is folded into the values file by compact(),
+// which also happens when closing the column if the overflow has more values than the column.
+//
+// Columns used to be stored as VSizeTable<std::vector<T>> (<name>.bin and <name>_offsets.bin).
+// Such a table is converted when opened in write mode, or read into memory in read mode.
+template<typename T>
+class CSRColumn {
+  static_assert(std::is_integral_v<T> && sizeof(T) <= sizeof(uint64_t), "CSRColumn only stores integers.");
+private:
+  fs::path base_path;
+  std::string name;
+  bool write_mode = false;
+  bool legacy_dummy = false;
+  pid_t pid;
+
+  uint64_t generation = 0;
+  uint64_t companion_generation = 0;
+  fs::path values_path;
+  fs::path rows_path;
+  fs::path overflow_path;
+
+  // Rows in the files when the column was opened
+  MappedFile values_mapping;
+  MappedFile rows_mapping;
+  std::vector<T> legacy_values;// old table opened in read mode
+  std::vector<uint64_t> legacy_ends;
+  const T* base_values = nullptr;
+  const uint64_t* base_ends = nullptr;
+  uint64_t nb_base_rows = 0;
+  uint64_t nb_base_values = 0;
+
+  // Rows added since then; the ends are absolute
+  std::vector<T> tail_values;
+  std::vector<uint64_t> tail_ends;
+  uint64_t nb_written_rows = 0;
+
+  // Rows with values in the overflow
+  robin_hood::unordered_map<uint64_t, std::vector<T>> overflow_rows;
+  std::vector<csr_overflow_record_t> pending_overflow;
+  uint64_t nb_overflow = 0;// records in the overflow file
+
+  fs::path conf_path() const {
+    return base_path / (name + "_column.conf");
+  }
+
+  fs::path generation_path(const std::string& kind, uint64_t gen) const {
+    return base_path / (name + "_" + kind + (gen == 0 ? "" : "_" + std::to_string(gen)) + ".bin");
+  }
+
+  uint64_t end_of(uint64_t row) const {
+    return row < nb_base_rows ? base_ends[row] : tail_ends[row - nb_base_rows];
+  }
+
+  Span<const T> file_row(uint64_t row) const {
+    uint64_t start = row == 0 ? 0 : end_of(row - 1);
+    uint64_t end = end_of(row);
+    const T* p = row < nb_base_rows ? base_values + start : tail_values.data() + (start - nb_base_values);
+    return Span<const T>(p, end - start);
+  }
+
+  std::vector<T>& overflow_row(uint64_t row) {
+    auto it = overflow_rows.find(row);
+    if(it == overflow_rows.end()) {
+      Span<const T> values = file_row(row);
+      it = overflow_rows.insert({row, std::vector<T>(values.begin(), values.end())}).first;
+    }
+    return it->second;
+  }
+
+  void write_all(const fs::path& path, const void* data, size_t size, uint64_t offset) const {
+    if(size == 0) {
+      return;
+    }
+    int fd = ::open(path.string().c_str(), O_CREAT | O_WRONLY | O_BINARY, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if(fd == -1) {
+      Rf_error("Impossible to open the column file at %s: %s\n", path.string().c_str(), strerror(errno));
+    }
+    size_t written = 0;
+    while(written < size) {
+      ssize_t res = pwrite(fd, static_cast<const char*>(data) + written, size - written, offset + written);
+      if(res <= 0) {
+        ::close(fd);
+        Rf_error("Error while writing to column %s: %s\n", path.string().c_str(), strerror(errno));
+      }
+      written += res;
+    }
+    ::close(fd);
+  }
+
+  // Config::write atomically replaces the configuration file
+  void write_conf(uint64_t gen, uint64_t rows, uint64_t values, uint64_t overflow) const {
+    std::unordered_map<std::string, std::string> conf;
+    conf["generation"] = std::to_string(gen);
+    conf["values"] = generation_path("values", gen).filename().string();
+    conf["rows"] = generation_path("rows", gen).filename().string();
+    conf["overflow"] = generation_path("overflow", gen).filename().string();
+    conf["nb_rows"] = std::to_string(rows);
+    conf["nb_values"] = std::to_string(values);
+    conf["nb_overflow"] = std::to_string(overflow);
+    conf["companion_generation"] = std::to_string(companion_generation);
+
+    Config config(std::move(conf));
+    config.write(conf_path());
+  }
+
+  void map_prefix(MappedFile& mapping, const fs::path& path, size_t size) {
+    if(size == 0) {
+      return;
+    }
+    int fd = ::open(path.string().c_str(), O_RDONLY | O_BINARY);
+    if(fd == -1 || fs::file_size(path) < size || !mapping.map(fd, size)) {
+      if(fd != -1) ::close(fd);
+      Rf_error("Impossible to map the column file at %s (%llu bytes expected).\n", path.string().c_str(), (unsigned long long) size);
+    }
+    ::close(fd);
+  }
+
+  bool is_legacy_dummy(Span<const T> row) const {
+    return legacy_dummy && row.size() == 1 && row[0] == 0;
+  }
+
+  // Read an old VSizeTable<std::vector<T>>
+  void read_legacy(std::vector<T>& values, std::vector<uint64_t>& ends) const {
+    VSizeTable<std::vector<T>> legacy(base_path / (name + ".bin"), false);
+    ends.reserve(legacy.nb_values());
+    for(uint64_t i = 0; i < legacy.nb_values(); i++) {
+      Span<const T> row = legacy.read_view(i);
+      if(!is_legacy_dummy(row)) {
+        values.insert(values.end(), row.begin(), row.end());
+      }
+      ends.push_back(values.size());
+    }
+  }
+
+  void remove_legacy() const {
+    for(const std::string suffix : {"", "_offsets"}) {
+      for(const std::string ext : {".bin", ".conf"}) {
+        fs::remove(base_path / (name + suffix + ext));
+      }
+    }
+  }
+
+  void load() {
+    values_mapping.unmap();
+    rows_mapping.unmap();
+    legacy_values.clear();
+    legacy_ends.clear();
+    tail_values.clear();
+    tail_ends.clear();
+    overflow_rows.clear();
+    pending_overflow.clear();
+
+    values_path = generation_path("values", 0);
+    rows_path = generation_path("rows", 0);
+    overflow_path = generation_path("overflow", 0);
+
+    if(!fs::exists(conf_path()) && fs::exists(base_path / (name + ".conf"))) {
+      read_legacy(legacy_values, legacy_ends);
+      if(write_mode) {
+        write_all(generation_path("values", 0), legacy_values.data(), legacy_values.size() * sizeof(T), 0);
+        write_all(generation_path("rows", 0), legacy_ends.data(), legacy_ends.size() * sizeof(uint64_t), 0);
+        write_conf(0, legacy_ends.size(), legacy_values.size(), 0);
+        remove_legacy();
+        legacy_values.clear();
+        legacy_ends.clear();
+      }
+      else {
+        generation = 0;
+        companion_generation = 0;
+        base_values = legacy_values.data();
+        base_ends = legacy_ends.data();
+        nb_base_rows = legacy_ends.size();
+        nb_base_values = legacy_values.size();
+        nb_overflow = 0;
+        nb_written_rows = nb_base_rows;
+        return;
+      }
+    }
+
+    if(fs::exists(conf_path())) {
+      Config conf(conf_path());
+      generation = std::stoul(conf["generation"]);
+      nb_base_rows = std::stoul(conf["nb_rows"]);
+      nb_base_values = std::stoul(conf["nb_values"]);
+      nb_overflow = std::stoul(conf["nb_overflow"]);
+      companion_generation = conf.has_key("companion_generation") ? std::stoul(conf["companion_generation"]) : 0;
+    }
+    else {
+      generation = 0;
+      companion_generation = 0;
+      nb_base_rows = 0;
+      nb_base_values = 0;
+      nb_overflow = 0;
+      if(write_mode) {
+        write_conf(0, 0, 0, 0);
+      }
+    }
+    values_path = generation_path("values", generation);
+    rows_path = generation_path("rows", generation);
+    overflow_path = generation_path("overflow", generation);
+
+    // Bytes after the ones in the configuration file (after a crash for instance) are ignored
+    map_prefix(values_mapping, values_path, nb_base_values * sizeof(T));
+    map_prefix(rows_mapping, rows_path, nb_base_rows * sizeof(uint64_t));
+    base_values = reinterpret_cast<const T*>(values_mapping.data());
+    base_ends = reinterpret_cast<const uint64_t*>(rows_mapping.data());
+    nb_written_rows = nb_base_rows;
+
+    if(nb_base_rows > 0 && base_ends[nb_base_rows - 1] != nb_base_values) {
+      Rf_error("Inconsistent column %s: %llu values in the rows, but %llu in the configuration file.\n",
+               name.c_str(), (unsigned long long) base_ends[nb_base_rows - 1], (unsigned long long) nb_base_values);
+    }
+
+    if(nb_overflow > 0) {
+      MappedFile overflow_mapping;
+      map_prefix(overflow_mapping, overflow_path, nb_overflow * sizeof(csr_overflow_record_t));
+      const csr_overflow_record_t* records = reinterpret_cast<const csr_overflow_record_t*>(overflow_mapping.data());
+      for(uint64_t i = 0; i < nb_overflow; i++) {
+        if(records[i].row >= nb_base_rows) {
+          Rf_error("Overflow of column %s refers to row %llu, but there are only %llu rows.\n",
+                   name.c_str(), (unsigned long long) records[i].row, (unsigned long long) nb_base_rows);
+        }
+        overflow_row(records[i].row).push_back(static_cast<T>(records[i].value));
+      }
+    }
+  }
+
+  // Write the first n_rows rows, transformed, in a new generation of files,
+  // which goes with the new_companion generation of the files of the user
+  template<typename F>
+  void rewrite(uint64_t n_rows, F&& transform, uint64_t new_companion) {
+    assert(write_mode);
+    if(pid != getpid()) {
+      return;
+    }
+
+    uint64_t new_generation = generation + 1;
+    fs::path new_values = generation_path("values", new_generation);
+    fs::path new_rows = generation_path("rows", new_generation);
+    fs::remove(new_values);
+    fs::remove(new_rows);
+
+    std::vector<T> values;
+    std::vector<uint64_t> ends;
+    uint64_t n_values = 0;
+    constexpr size_t batch = 1024 * 1024;
+    for(uint64_t i = 0; i < n_rows; i++) {
+      transform(i, row(i), values);
+      ends.push_back(n_values + values.size());
+      if(values.size() >= batch || ends.size() >= batch || i + 1 == n_rows) {
+        write_all(new_values, values.data(), values.size() * sizeof(T), n_values * sizeof(T));
+        write_all(new_rows, ends.data(), ends.size() * sizeof(uint64_t), (i + 1 - ends.size()) * sizeof(uint64_t));
+        n_values += values.size();
+        values.clear();
+        ends.clear();
+      }
+    }
+
+    // From now on, the new generation is the valid one
+    companion_generation = new_companion;
+    write_conf(new_generation, n_rows, n_values, 0);
+
+    values_mapping.unmap();
+    rows_mapping.unmap();
+    fs::remove(values_path);
+    fs::remove(rows_path);
+    fs::remove(overflow_path);
+
+    load();
+  }
+
+public:
+  CSRColumn() : pid(getpid()) {}
+  CSRColumn(const CSRColumn&) = delete;
+  CSRColumn& operator=(const CSRColumn&) = delete;
+
+  // legacy_dummy: in an old table, a row with only a 0 stands for an empty row
+  void open(const fs::path& base_path_, const std::string& name_, bool write, bool legacy_dummy_ = false) {
+    base_path = fs::absolute(base_path_);
+    name = name_;
+    write_mode = write;
+    legacy_dummy = legacy_dummy_;
+    load();
+  }
+
+  uint64_t nb_rows() const { return nb_base_rows + tail_ends.size(); }
+
+  uint64_t nb_overflow_values() const { return nb_overflow + pending_overflow.size(); }
+
+  // Valid until the next append
+  Span<const T> row(uint64_t i) const {
+    assert(i < nb_rows());
+    if(!overflow_rows.empty()) {
+      auto it = overflow_rows.find(i);
+      if(it != overflow_rows.end()) {
+        return Span<const T>(it->second);
+      }
+    }
+    return file_row(i);
+  }
+
+  bool contains(uint64_t i, T value) const {
+    Span<const T> values = row(i);
+    return std::find(values.begin(), values.end(), value) != values.end();
+  }
+
+  void append_row(Span<const T> values) {
+    assert(write_mode);
+    tail_values.insert(tail_values.end(), values.begin(), values.end());
+    tail_ends.push_back(nb_base_values + tail_values.size());
+  }
+
+  // The last row is not in the files yet, so values can still be appended to it in place
+  bool extendable(uint64_t i) const {
+    return i + 1 == nb_rows() && i >= nb_written_rows && overflow_rows.count(i) == 0;
+  }
+
+  // Append a value to an existing row, or to a new row if i == nb_rows()
+  void append_to_row(uint64_t i, T value) {
+    assert(write_mode);
+    if(i == nb_rows()) {
+      append_row(Span<const T>(&value, 1));
+    }
+    else if(extendable(i)) {
+      tail_values.push_back(value);
+      tail_ends.back()++;
+    }
+    else {
+      overflow_row(i).push_back(value);
+      pending_overflow.push_back({i, static_cast<uint64_t>(value)});
+    }
+  }
+
+  void flush() {
+    if(!write_mode || pid != getpid()) {
+      return;
+    }
+    uint64_t n_rows = nb_rows();
+    uint64_t n_values = nb_base_values + tail_values.size();
+    if(n_rows == nb_written_rows && pending_overflow.empty()) {
+      return;
+    }
+
+    uint64_t first_value = nb_written_rows == 0 ? 0 : end_of(nb_written_rows - 1);
+    write_all(values_path, tail_values.data() + (first_value - nb_base_values),
+              (n_values - first_value) * sizeof(T), first_value * sizeof(T));
+    write_all(rows_path, tail_ends.data() + (nb_written_rows - nb_base_rows),
+              (n_rows - nb_written_rows) * sizeof(uint64_t), nb_written_rows * sizeof(uint64_t));
+    write_all(overflow_path, pending_overflow.data(), pending_overflow.size() * sizeof(csr_overflow_record_t),
+              nb_overflow * sizeof(csr_overflow_record_t));
+
+    nb_overflow += pending_overflow.size();
+    pending_overflow.clear();
+    nb_written_rows = n_rows;
+
+    // The files are valid up to there
+    write_conf(generation, n_rows, n_values, nb_overflow);
+
+    // The written rows are now read from the files: the tail only holds the rows
+    // since the last flush
+    nb_base_rows = n_rows;
+    nb_base_values = n_values;
+    map_prefix(values_mapping, values_path, nb_base_values * sizeof(T));
+    map_prefix(rows_mapping, rows_path, nb_base_rows * sizeof(uint64_t));
+    base_values = reinterpret_cast<const T*>(values_mapping.data());
+    base_ends = reinterpret_cast<const uint64_t*>(rows_mapping.data());
+    tail_values = std::vector<T>();
+    tail_ends = std::vector<uint64_t>();
+  }
+
+  // Rewrite the rows with their overflow values in a new generation of files
+  void compact() {
+    if(nb_overflow_values() == 0) {
+      flush();
+      return;
+    }
+    compact([](uint64_t, Span<const T> in, std::vector<T>& out) {
+      out.insert(out.end(), in.begin(), in.end());
+    });
+  }
+
+  // Rewrite all the rows in a new generation of files, after transforming them:
+  // transform(i, row, out) appends the new content of row i to out.
+  template<typename F>
+  void compact(F&& transform) {
+    rewrite(nb_rows(), transform, companion_generation);
+  }
+
+  // Same, and switch to the new_companion generation of the files of the user
+  template<typename F>
+  void compact(F&& transform, uint64_t new_companion) {
+    rewrite(nb_rows(), transform, new_companion);
+  }
+
+  // Only keep the first n rows
+  void truncate(uint64_t n) {
+    assert(write_mode);
+    if(n >= nb_rows()) {
+      return;
+    }
+    rewrite(n, [](uint64_t, Span<const T> in, std::vector<T>& out) {
+      out.insert(out.end(), in.begin(), in.end());
+    }, companion_generation);
+  }
+
+  uint64_t nb_values() const { return nb_base_values + tail_values.size(); }
+
+  uint64_t get_companion_generation() const { return companion_generation; }
+
+  // All the files the column can use, including the ones of an old table
+  std::vector<fs::path> files() const {
+    std::vector<fs::path> paths = {conf_path(), values_path, rows_path, overflow_path};
+    for(const std::string suffix : {"", "_offsets"}) {
+      for(const std::string ext : {".bin", ".conf"}) {
+        paths.push_back(base_path / (name + suffix + ext));
+      }
+    }
+    return paths;
+  }
+
+  ~CSRColumn() {
+    // Rows with overflow values are kept in memory: do not let the overflow grow
+    // larger than the column
+    if(write_mode && pid == getpid() && nb_overflow_values() > nb_base_values + tail_values.size()) {
+      compact();
+    }
+    else {
+      flush();
+    }
+  }
+};
+
+#endif
@@ -4,13 +4,10 @@
 
 #include "thread_pool.h"
 
-#include "readerwritercircularbuffer.h"
-
 #include <stdexcept>
+#include <map>
 
-using namespace moodycamel;
-
-Database:: Database(const fs::path& config_, OpenMode mode_, bool quiet_) :
+Database:: Database(const fs::path& config_, OpenMode mode_, bool quiet_, bool autorepair) :
   mode(mode_), quiet(quiet_),
   pid(getpid()),
   rand_engine(std::chrono::system_clock::now().time_since_epoch().count()),
@@ -18,21 +15,31 @@ Database:: Database(const fs::path& config_, OpenMode mode_, bool quiet_) :
   ser(4096) // does it fit in the processor caches?
 {
   fs::path sexp_table_path = base_path / "sexp_table.conf";
+  sexp_table = make_blob_table("plain");
   fs::path hashes_path = base_path / "hashes_table.conf";
   fs::path runtime_meta_path = base_path / "runtime_meta.conf";
   fs::path static_meta_path = base_path / "static_meta.conf";
   fs::path debug_counters_path = base_path / "debug_counters.conf";
 
   fs::path lock_path = base_path / ".LOCK";
+  fs::path wal_path = base_path / "wal.bin";
 
   bool to_check = false;
+  bool to_replay = false;
+  wal_header_t wal_header;
+  std::vector<wal_record_t> wal_records;
 
   if(std::filesystem::exists(config_path)) {
     // Check the lock file
     if(std::filesystem::exists(lock_path) && mode == OpenMode::Write) {
-      Rprintf("Database did not exit properly. Will perform check_db in slow mode.\n");
-      Rprintf("It might also be because the database is also open in write mode from another process.\n");
-      to_check = true;
+      if(wal.read(wal_path, wal_header, wal_records)) {
+        to_replay = true;
+      }
+      else {
+        Rprintf("Database did not exit properly. Will perform check_db in slow mode.\n");
+        Rprintf("It might also be because the database is also open in write mode from another process.\n");
+        to_check = true;
+      }
     }
 
     Config config(config_path);
@@ -52,6 +59,9 @@ Database:: Database(const fs::path& config_, OpenMode mode_, bool quiet_) :
     }
 
     sexp_table_path = base_path / config["sexp_table"];
+    if(config.has_key("sexp_layout")) {
+      sexp_table = make_blob_table(config["sexp_layout"]);
+    }
     hashes_path = base_path / config["hashes_table"];
     runtime_meta_path = base_path / config["runtime_meta"];
     static_meta_path = base_path / config["static_meta"];
@@ -71,8 +81,54 @@ Database:: Database(const fs::path& config_, OpenMode mode_, bool quiet_) :
     if(!quiet) Rprintf("Loading search indexes.\n");
     search_index.set_write_mode(mode == OpenMode::Write);
     search_index.open_from_config(base_path, config);
+    if(config.has_key("prefetch_index")) {
+      prefetch_index = std::stoi(config["prefetch_index"]) != 0;
+    }
+    if(prefetch_index) {
+      search_index.prefetch();
+    }
 
     nb_total_values = std::stoul(config["nb_values"]);
+
+    if(config.has_key("max_call_ids")) {
+      max_call_ids = std::stoull(config["max_call_ids"]);
+    }
+    if(config.has_key("checkpoint_values")) {
+      checkpoint_values = std::stoull(config["checkpoint_values"]);
+    }
+    if(config.has_key("checkpoint_seconds")) {
+      checkpoint_seconds = std::stoull(config["checkpoint_seconds"]);
+    }
+    // Databases created before the high-water mark are checked from the start
+    if(config.has_key("verified_values")) {
+      verified_values = std::stoull(config["verified_values"]);
+    }
+    call_sites_from = config.has_key("call_sites_from") ? std::stoull(config["call_sites_from"]) : nb_total_values;
+
+    if(to_replay) {
+      // The tables are at the last checkpoint, whose number of values is in the configuration file,
+      // unless the process stopped during the checkpoint
+      if(!wal_records.empty() && wal_records.back().type == wal_record_type::CheckpointEnd) {
+        // Stopped after writing all the tables, but before writing the configuration file
+        nb_total_values = WalCursor(wal_records.back().payload).get<uint64_t>();
+        wal_records.clear();
+      }
+      else if(!wal_records.empty() && wal_records.back().type == wal_record_type::CheckpointBegin) {
+        Rprintf("Database stopped while writing its tables. Will perform check_db in slow mode.\n");
+        to_replay = false;
+        to_check = true;
+      }
+      else if(wal_header.base_nb_values != nb_total_values) {
+        Rprintf("The write-ahead log does not match the database. Will perform check_db in slow mode.\n");
+        to_replay = false;
+        to_check = true;
+      }
+      else {
+        Rprintf("Database did not exit properly. Replaying %llu operations from the write-ahead log.\n",
+                (unsigned long long) wal_records.size());
+        Rprintf("It might also be because the database is also open in write mode from another process.\n");
+      }
+    }
   }
   else if (mode == OpenMode::Write) {
     if(!quiet) Rprintf("Creating new database at %s.\n", base_path.string().c_str());
@@ -91,17 +147,23 @@ Database:: Database(const fs::path& config_, OpenMode mode_, bool quiet_) :
     lock_file << std::chrono::system_clock::now().time_since_epoch().count() << std::endl;
   }
 
-  size_t nb_threads = std::thread::hardware_concurrency() - 1;
+  // hardware_concurrency() can be 0 or 1
+  size_t nb_threads = std::max(2u, std::thread::hardware_concurrency()) - 1;
   thread_pool pool(nb_threads);
 
   bool write_mode = mode == OpenMode::Write;
 
   if(!quiet) Rprintf("Loading tables.\n");
-  sexp_table.open(sexp_table_path, write_mode);
+  sexp_table->open(sexp_table_path, write_mode);
+  if(write_mode) {
+    // Tracing adds many small values: batch their writes
+    sexp_table->set_buffered(true);
+  }
   hashes.open(hashes_path, write_mode);
   runtime_meta.open(runtime_meta_path, write_mode);
   static_meta.open(static_meta_path, write_mode);
   debug_counters.open(debug_counters_path, write_mode);
+  call_sites.open(base_path / "call_sites.conf", write_mode);
 
   // To catch the exceptions from other threads
   std::exception_ptr teptr_origs = nullptr;
@@ -156,25 +218,13 @@ pool.push_task([&](const fs::path& base_path, bool write_mode) {
 
     if(!quiet) Rprintf("Loading debug counters into memory.\n");
     pool.push_task([&]() {debug_counters.load_all(); } );
-
-
-    if(!quiet) Rprintf("Loading hashes into memory.\n");
-    // Load the hashes and build the hash map
-
-    if(!quiet) Rprintf("Allocating memory for the hash table.\n");
-    if(!quiet) Rprintf("Building the hash table.\n");
-    // printf inside the thread will not place nice with R locks
-    pool.push_task([&]() {
-      hashes.load_all();
-      const StableVector<sexp_hash>& hash_vec = hashes.memory_view();
-
-      sexp_index.reserve(hashes.nb_values());
-      for(uint64_t i = 0; i < hash_vec.size() ; i++) {
-        sexp_index.insert({&hash_vec[i], i});
-      }
-    });
   }
 
+  // The hash index is persisted: opening it only maps it, and it is only
+  // rebuilt if it is missing or if the database was not closed properly
+  if(!quiet) Rprintf("Opening the hash index.\n");
+  hash_index.open(base_path / "hash_index.bin", write_mode, hashes);
+
   pool.wait_for_tasks();
 
   if(teptr_origs) {
@@ -188,67 +238,70 @@ pool.push_task([&](const fs::path& base_path, bool write_mode) {
   if(teptr_call_ids) {
     std::rethrow_exception(teptr_call_ids);
   }
+  call_ids.set_max_call_ids(max_call_ids);
 
   if(teptr_dbnames) {
     std::rethrow_exception(teptr_dbnames);
   }
 
-  // Check if the number of values in tables are coherent
-  if(sexp_table.nb_values() != nb_total_values) {
-    Rf_error("Inconsistent number of values in the global configuration file and "
-               "in the sexp table: %llu vs %llu\n", (unsigned long long) nb_total_values, (unsigned long long) sexp_table.nb_values());
-  }
-
-  if(hashes.nb_values() != nb_total_values) {
-    Rf_error("Inconsistent number of values in the global configuration file and "
-               "in the hashes table: %llu vs %llu\n", (unsigned long long) nb_total_values, (unsigned long long) hashes.nb_values());
-  }
-
-  if(runtime_meta.nb_values() != nb_total_values) {
-    Rf_error("Inconsistent number of values in the global configuration file and "
-               "in the runtime_meta table: %llu vs %llu\n", (unsigned long long) nb_total_values, (unsigned long long) runtime_meta.nb_values());
-  }
-
-  if(static_meta.nb_values() != nb_total_values) {
-    Rf_error("Inconsistent number of values in the global configuration file and "
-               "in the static_meta table: %llu vs %llu\n", (unsigned long long) nb_total_values, (unsigned long long) static_meta.nb_values());
-  }
-
-  if(debug_counters.nb_values() != 0 && debug_counters.nb_values() != nb_total_values) {
-    Rf_error("Inconsistent number of values in the global configuration file and "
-               "in the debug counters tables: %llu vs %llu.\n", (unsigned long long) nb_total_values, (unsigned long long) debug_counters.nb_values());
-  }
-
-  if(origins.nb_values() > nb_total_values) {
-    Rf_error("Inconsistent number of values in the global configuration file and "
-               "in the origin tables: %llu vs %llu.\n", (unsigned long long) nb_total_values, (unsigned long long) origins.nb_values());
+  // Check if the number of values in tables are coherent.
+  // If the database was not closed properly, the check below reports them.
+  std::vector<std::string> table_errors = check_row_counts();
+  if(!to_check && !table_errors.empty()) {
+    Rf_error("%s\n", table_errors.front().c_str());
   }
 
-  if(classes.nb_values() != nb_total_values) {
-    Rf_error("Inconsistent number of values in the global configuration file and "
-               "in the class tables: %llu vs %llu.\n", (unsigned long long) nb_total_values, (unsigned long long) classes.nb_values());
-  }
+  type_signatures.open(base_path, write_mode);
 
-  if(call_ids.nb_values() != nb_total_values) {
-     Rf_error("Inconsistent number of values in the global configuration file and "
-               "in the call_id tables: %llu vs %llu.\n", (unsigned long long) nb_total_values, (unsigned long long) call_ids.nb_values());
+  bool repaired = false;
+  if(to_check) {
+    // The values of the last completed checkpoint are on disk: only the ones after it
+    // could have been partially written. If some of them are missing from the tables,
+    // the files were not only cut short by the crash, and all the values are checked.
+    uint64_t from = verified_values;
+    if(nb_values_in_all_tables() < verified_values || nb_total_values < verified_values) {
+      Rprintf("The tables do not have the %llu values of the last checkpoint.\n", (unsigned long long) verified_values);
+      from = 0;
+    }
+    Rprintf("Checking the database in slow mode, from value %llu.\n", (unsigned long long) from);
+    check_report_t report = check(true, from);
+    if(report.ok()) {
+      Rprintf("No errors found.\n");
+    }
+    else {
+      for(const auto& error : report.table_errors) {
+        Rprintf("%s\n", error.c_str());
+      }
+      if(!autorepair) {
+        Rf_error("The database is corrupted: %llu values with errors. Open it again with autorepair to truncate it to its %llu valid values.\n",
+                 (unsigned long long) report.errors.size(), (unsigned long long) report.valid_values);
+      }
+      Rprintf("The database is corrupted: %llu values with errors. Truncating it to its %llu valid values.\n",
+              (unsigned long long) report.errors.size(), (unsigned long long) report.valid_values);
+      truncate(report.valid_values);
+      repaired = true;
+    }
   }
 
-  // 0 is possible, as we only update that table when merging
-  // SO the table is empty just after tracing
-  if(dbnames.nb_values() != 0 && dbnames.nb_values() != nb_total_values) {
-     Rf_error("Inconsistent number of values in the global configuration file and "
-               "in the db names tables: %llu vs %llu.\n", (unsigned long long) nb_total_values, (unsigned long long) dbnames.nb_values());
+  if(write_mode && type_signatures.nb_values() < nb_total_values) {
+    build_type_signatures();
   }
 
-  if(to_check) {
-    Rprintf("Checking the database in slow mode.\n");
-    auto errors = check(true);
-    if(errors.size() > 0 ) {
-      Rf_error("The database is corrupted: %llu errors. Open it again with autorepair to try repairing it.\n", (unsigned long long) errors.size());
+  if(write_mode) {
+    if(to_replay) {
+      // Append to the records that were read
+      wal.open();
+      replay(wal_records);
+      checkpoint();
     }
     else {
-      Rprintf("No errors found.\n");
+      wal.create(wal_path, nb_total_values);
+    }
+    last_checkpoint_values = nb_total_values;
+    last_checkpoint_time = std::chrono::steady_clock::now();
+    // The configuration file still has the number of values before the repair
+    if(repaired) {
+      checkpoint();
     }
   }
 
@@ -273,16 +326,16 @@ Database::~Database() {
             (unsigned long long) classes.nb_classnames());
   }
 
-  if(pid == getpid()) {
-    if(mode == OpenMode::Write && (new_elements || nb_total_values == 0 || new_index)) {
-      write_configuration();
-    }
+  if(pid == getpid() && mode == OpenMode::Write) {
+    checkpoint();
 
     // Remove the LOCK to witness that the database left without problems
-    if(mode == OpenMode::Write) {
-      fs::path lock_path = base_path / ".LOCK";
-      fs::remove(lock_path);
-    }
+    fs::path lock_path = base_path / ".LOCK";
+    fs::remove(lock_path);
+
+    // The log is not needed without the LOCK
+    wal.close();
+    fs::remove(wal.get_path());
   }
 }
 
@@ -295,8 +348,15 @@ void Database::write_configuration() {
   conf["patch"] = std::to_string(version_patch);
   conf["devel"] = std::to_string(version_development);
   conf["nb_values"] = std::to_string(nb_total_values);
-
-  conf["sexp_table"] = fs::relative(sexp_table.get_path(), base_path).string();
+  conf["max_call_ids"] = std::to_string(max_call_ids);
+  conf["checkpoint_values"] = std::to_string(checkpoint_values);
+  conf["checkpoint_seconds"] = std::to_string(checkpoint_seconds);
+  conf["verified_values"] = std::to_string(verified_values);
+  conf["call_sites_from"] = std::to_string(call_sites_from);
+  conf["prefetch_index"] = std::to_string(prefetch_index);
+
+  conf["sexp_table"] = fs::relative(sexp_table->get_path(), base_path).string();
+  conf["sexp_layout"] = sexp_table->layout();
   conf["hashes_table"] = fs::relative(hashes.get_path(), base_path).string();
   conf["runtime_meta"] = fs::relative(runtime_meta.get_path(), base_path).string();
   conf["static_meta"] = fs::relative(static_meta.get_path(), base_path).string();
@@ -313,6 +373,227 @@ void Database::write_configuration() {
   config.write(config_path);
 }
 
+void Database::set_layout(const std::string& layout) {
+  if(mode != OpenMode::Write) {
+    Rf_error("Cannot change the layout of the values in read mode.\n");
+  }
+  if(layout == sexp_table->layout()) {
+    return;
+  }
+  // The new table is built from the values on disk
+  checkpoint();
+
+  // The values are copied into new files, so that the database stays
+  // valid if the conversion is interrupted
+  fs::path new_path = base_path / (layout == "plain" ? "sexp_table.bin" : "sexp_table_" + layout + ".bin");
+  auto new_table = make_blob_table(layout);
+  new_table->open(new_path, true);
+  if(new_table->nb_values() > 0) {
+    // leftovers of an interrupted conversion
+    auto leftovers = new_table->files();
+    new_table = make_blob_table(layout);
+    for(const auto& file : leftovers) {
+      fs::remove(file);
+    }
+    new_table->open(new_path, true);
+  }
+
+  sexp_table->map();
+  new_table->train(*sexp_table);
+  BlobCursor cursor;
+  for(uint64_t i = 0; i < nb_total_values; i++) {
+    new_table->append_view(sexp_table->read_view(i, cursor));
+  }
+  throw_assert(new_table->nb_values() == nb_total_values);
+  new_table.reset();// writes everything to disk
+
+  auto old_files = sexp_table->files();
+  sexp_table = make_blob_table(layout);
+  sexp_table->open(new_path, true);
+  sexp_table->set_buffered(true);
+
+  // From now on, the database uses the new table
+  write_configuration();
+
+  for(const auto& file : old_files) {
+    fs::remove(file);
+  }
+}
+
+void Database::compact() {
+  if(mode != OpenMode::Write) {
+    Rf_error("Cannot compact a database in read mode.\n");
+  }
+  checkpoint();
+  origins.compact();
+  classes.compact();
+  call_ids.compact();
+  dbnames.compact();
+  type_signatures.compact();
+  checkpoint();
+}
+
+void Database::set_max_call_ids(uint64_t n) {
+  if(mode != OpenMode::Write) {
+    Rf_error("Cannot change the maximum number of call ids of a database in read mode.\n");
+  }
+  max_call_ids = n;
+  call_ids.set_max_call_ids(n);
+  checkpoint();
+}
+
+void Database::set_checkpoint_policy(uint64_t n_values, uint64_t seconds) {
+  if(mode != OpenMode::Write) {
+    Rf_error("Cannot change the checkpoint policy of a database in read mode.\n");
+  }
+  checkpoint_values = n_values;
+  checkpoint_seconds = seconds;
+  checkpoint();
+}
+
+uint32_t Database::intern_type_signature(SEXP val, const static_meta_t& meta) {
+  type_signature_t sig;
+  sig.sexptype = meta.sexptype;
+  sig.has_na = find_na(val);
+  sig.n_dims = std::min(meta.n_dims, (uint32_t) 5);
+  sig.length_bin = SearchIndex::length_bin(meta.length);
+
+  std::string class_names;
+  SEXP klass = Rf_getAttrib(val, R_ClassSymbol);
+  for(R_xlen_t i = 0; i < Rf_xlength(klass); i++) {
+    if(i > 0) {
+      class_names += ",";
+    }
+    class_names += CHAR(STRING_ELT(klass, i));
+  }
+
+  return type_signatures.intern(sig, class_names);
+}
+
+std::pair<type_signature_t, std::string> Database::type_signature_of(uint64_t index) const {
+  if(index < type_signatures.nb_values()) {
+    const type_signature_t& sig = type_signatures.signature(type_signatures.value_signature(index));
+    return {sig, std::string(type_signatures.class_signature(sig.classes))};
+  }
+
+  const static_meta_t meta = static_meta.read(index);
+  type_signature_t sig;
+  sig.sexptype = meta.sexptype;
+  sig.has_na = find_na(Serializer::unserialize_view(sexp_table->read_view(index)));
+  sig.n_dims = std::min(meta.n_dims, (uint32_t) 5);
+  sig.length_bin = SearchIndex::length_bin(meta.length);
+
+  std::string class_names;
+  for(uint32_t class_id : classes.get_classnames(index)) {
+    if(!class_names.empty()) {
+      class_names += ",";
+    }
+    class_names += classes.class_name(class_id);
+  }
+
+  return {sig, class_names};
+}
+
+void Database::build_type_signatures() {
+  if(!quiet) Rprintf("Computing the type signatures of %llu values.\n", (unsigned long long) (nb_total_values - type_signatures.nb_values()));
+
+  for(uint64_t i = type_signatures.nb_values(); i < nb_total_values; i++) {
+    auto sig = type_signature_of(i);
+    uint32_t id = type_signatures.intern(sig.first, sig.second);
+    type_signatures.add_value(i, id);
+
+    // We do not know how many times the value was seen at each of its origins
+    for(const auto& loc : origins.get_locs(i)) {
+      type_signatures.observe(loc, id);
+    }
+  }
+  type_signatures.flush();
+}
+
+void Database::merge_type_signatures(const Database& other, const roaring::Roaring64Map& other_added) {
+  uint64_t n_values = type_signatures.nb_values();
+  for(uint64_t other_idx : other_added) {
+    auto sig = other.type_signature_of(other_idx);
+    type_signatures.add_value(n_values, type_signatures.intern(sig.first, sig.second));
+    n_values++;
+  }
+
+  // The counts of the other database, with our ids
+  robin_hood::unordered_map<uint32_t, uint32_t> signature_ids;
+  for(const auto& c : other.type_signatures.signature_counts()) {
+    const location_t& loc = c.first.loc;
+    location_t new_loc = origins.intern_location(other.origins.package_name(loc.package),
+                                                 other.origins.function_name(loc.function),
+                                                 other.origins.param_name(loc.param));
+    auto it = signature_ids.find(c.first.signature);
+    if(it == signature_ids.end()) {
+      const type_signature_t& sig = other.type_signatures.signature(c.first.signature);
+      it = signature_ids.insert({c.first.signature,
+        type_signatures.intern(sig, other.type_signatures.class_signature(sig.classes))}).first;
+    }
+    type_signatures.observe(new_loc, it->second, c.second);
+  }
+
+  // Values of a database created before the type signatures
+  for(uint64_t other_idx = other.type_signatures.nb_values(); other_idx < other.nb_values(); other_idx++) {
+    auto sig = other.type_signature_of(other_idx);
+    uint32_t id = type_signatures.intern(sig.first, sig.second);
+    for(const auto& loc : other.origins.get_locs(other_idx)) {
+      location_t new_loc = origins.intern_location(other.origins.package_name(loc.package),
+                                                   other.origins.function_name(loc.function),
+                                                   other.origins.param_name(loc.param));
+      type_signatures.observe(new_loc, id);
+    }
+  }
+}
+
+const SEXP Database::compression_stats() const {
+  struct stats_t {
+    uint64_t n = 0;
+    uint64_t raw_size = 0;
+    uint64_t stored_size = 0;
+  };
+  std::map<SEXPTYPE, stats_t> stats;
+
+  sexp_table->map();
+  for(uint64_t i = 0; i < nb_total_values; i++) {
+    stats_t& s = stats[static_meta.read(i).sexptype];
+    s.n++;
+    s.raw_size += sexp_table->value_size(i);
+    s.stored_size += sexp_table->stored_size(i);
+  }
+
+  SEXP s_type = PROTECT(Rf_allocVector(INTSXP, stats.size()));
+  SEXP s_n = PROTECT(Rf_allocVector(REALSXP, stats.size()));
+  SEXP s_raw = PROTECT(Rf_allocVector(REALSXP, stats.size()));
+  SEXP s_stored = PROTECT(Rf_allocVector(REALSXP, stats.size()));
+  SEXP s_ratio = PROTECT(Rf_allocVector(REALSXP, stats.size()));
+
+  int i = 0;
+  for(const auto& [type, s] : stats) {
+    INTEGER(s_type)[i] = type;
+    REAL(s_n)[i] = s.n;
+    REAL(s_raw)[i] = s.raw_size;
+    REAL(s_stored)[i] = s.stored_size;
+    REAL(s_ratio)[i] = s.stored_size == 0 ? 1 : double(s.raw_size) / s.stored_size;
+    i++;
+  }
+
+  std::vector<std::pair<std::string, SEXP>> columns = {
+    {"type", s_type},
+    {"n", s_n},
+    {"raw_size", s_raw},
+    {"stored_size", s_stored},
+    {"ratio", s_ratio}
+  };
+
+  SEXP df = PROTECT(create_data_frame(columns));
+
+  UNPROTECT(6);
+
+  return df;
+}
+
 std::optional<uint64_t> Database::have_seen(SEXP val) const {
   std::optional<sexp_hash> key;
   // if we are in write mode, we can bother looking into the cache of SEXP
@@ -328,14 +609,7 @@ std::optional<uint64_t> Database::have_seen(SEXP val) const {
     key = compute_hash(val);
   }
 
-  auto res = sexp_index.find(&key.value());
-
-  if(res == sexp_index.end()) {
-    return {};
-  }
-  else {
-    return res->second;
-  }
+  return hash_index.find(*key);
 }
 
 
@@ -344,19 +618,12 @@ const sexp_hash& Database::get_hash(uint64_t index) const {
 }
 
 std::optional<uint64_t> Database::get_index(const sexp_hash& h) const {
-  auto it = sexp_index.find(&h);
-
-  if(it != sexp_index.end()) {
-    return it->second;
-  }
-  else {
-    return {};
-  }
+  return hash_index.find(h);
 }
 
 const SEXP Database::get_value(uint64_t index) const {
   std::vector<std::byte> buf;
-  sexp_table.read_in(index, buf);
+  sexp_table->read_in(index, buf);
 
   SEXP res = ser.unserialize(buf);
 
@@ -379,6 +646,7 @@ const SEXP Database::get_metadata(uint64_t index) const {
     names.insert(names.end(), {"maybed_shared", "sexp_addr_optim"});
   }
   // are our indexes ready? we just check if they are empty or not
+  search_index.load(index_group::Flags);
   if(!search_index.na_index.isEmpty()) {
     names.push_back("is_na");
   }
@@ -535,6 +803,7 @@ const SEXP Database::view_metadata() const {
 
   // TODO: rewrite with async to process separately the various tables
 
+  search_index.load(index_group::Flags);
   int n_to_protect = 8;
   SEXP s_type = PROTECT(Rf_allocVector(INTSXP, nb_total_values));
   SEXP s_length = PROTECT(Rf_allocVector(INTSXP, nb_total_values));
@@ -700,6 +969,7 @@ const SEXP Database::view_metadata(Query& query) const  {
 
   // TODO: rewrite with async to process separately the various tables
 
+  search_index.load(index_group::Flags);
   int n_to_protect = 9;
   SEXP indexes = PROTECT(Rf_allocVector(INTSXP, index_size));
   SEXP s_type = PROTECT(Rf_allocVector(INTSXP, index_size));
@@ -862,7 +1132,7 @@ const SEXP Database::view_values() const {
   SEXP l = PROTECT(Rf_allocVector(VECSXP, nb_values()));
 
   for(uint64_t i = 0 ; i < nb_total_values ; i++) {
-    sexp_table.read_in(i, buf);
+    sexp_table->read_in(i, buf);
     SEXP val = ser.unserialize(buf);
     SET_VECTOR_ELT(l, i, val);
   }
@@ -885,7 +1155,7 @@ const SEXP Database::view_values(Query& query) const {
 
   uint64_t j = 0;
   for(uint64_t i : index) {
-    sexp_table.read_in(i, buf);
+    sexp_table->read_in(i, buf);
     SEXP val = ser.unserialize(buf);
     SET_VECTOR_ELT(l, j, val);
     j++;
@@ -1049,8 +1319,6 @@ const SEXP Database::view_origins(Query& query) const {
 }
 
 const SEXP Database::values_from_calls(const std::string& package, const std::string& function) {
-
-  // This will look very similar to values_from_origins
   origins.load_hashtables();
 
   auto pkg_id = origins.package_id(package);
@@ -1060,125 +1328,169 @@ const SEXP Database::values_from_calls(const std::string& package, const std::st
   }
 
   auto fun_id = origins.function_id(function);
-  if(!pkg_id.has_value()) {
+  if(!fun_id.has_value()) {
     Rf_warning("No values from function %s in the database.\n", function.c_str());
     return R_NilValue;
   }
 
-  if(search_index.packages_index.size() == 0) {
-      Rf_warning("The package index is empty. Have you built the indexes?\n");
-      return R_NilValue;
-  }
-  // Now the indexes
-  auto pkg_index = search_index.packages_index.at(pkg_id.value());
-
-  int bin_index = -1;
-  // TODO: do a dichotomic search here
-  for(int i = 0 ; i < search_index.function_index.size() ; i ++) {
-    if(search_index.function_index[i].first > fun_id.value()) {
-      bin_index = i;
-      break;
-    }
-  }
-  if(bin_index == -1) {
-    bin_index = search_index.function_index.size() - 1;
-    if(bin_index < 0) {
-      Rf_warning("The function index is empty. Have you built the indexes?\n");
-      return R_NilValue;
-    }
-  }
-  auto fun_index = search_index.search_function(*this, search_index.function_index[bin_index].second, fun_id.value());
-  
-
-  // All the values linked to that origin
-  auto origin_index = pkg_index & fun_index;
-
-  // Now that we have all the values associated to the origins, we need to find out the calls 
-  // associated to them.
-
-  // Maps call ids to value ids and db names
-  robin_hood::unordered_map<uint64_t, robin_hood::unordered_set<uint64_t>> calls_to_values;
-  for(uint64_t v : origin_index) {
-    auto ids = call_ids.get_call_ids(v);
-    //auto dbs = dbnames.get_dbs(v);
-
-    for(uint64_t cid : ids) {
-      auto it = calls_to_values.find(cid);
-
-      if(it != calls_to_values.end()) {
-        it->second.insert(v);
-      }
-      else {
-        calls_to_values.emplace(cid, std::initializer_list<uint64_t>{v});
+  // Sorted by call id and value, so that the parameters of a value in a call are consecutive
+  std::vector<call_index_record_t> records = search_index.calls_index.calls_of(fun_id.value());
+
+  // The values and call sites added since the last build of the indexes are not in the call index
+  const CallIndex& calls_index = search_index.calls_index;
+  uint64_t legacy_end = std::min(call_sites_from, nb_total_values);
+  if(calls_index.nb_values() < legacy_end || calls_index.nb_call_sites() < call_sites.nb_values()) {
+    auto new_records = SearchIndex::build_indexes_calls(*this, calls_index.nb_values(), legacy_end,
+                                                        calls_index.nb_call_sites(), call_sites.nb_values());
+    if(fun_id.value() < new_records.size()) {
+      auto& fun_records = new_records[fun_id.value()];
+      std::sort(fun_records.begin(), fun_records.end());
+      size_t middle = records.size();
+      records.insert(records.end(), fun_records.begin(), fun_records.end());
+      std::inplace_merge(records.begin(), records.begin() + middle, records.end());
+      records.erase(std::unique(records.begin(), records.end()), records.end());
+    }
+  }
+  records.erase(std::remove_if(records.begin(), records.end(),
+    [&](const call_index_record_t& rec) {return rec.package != pkg_id.value(); }), records.end());
+
+  size_t nb_rows = 0;
+  for(size_t k = 0; k < records.size(); k++) {
+    if(k == 0 || records[k].call_id != records[k - 1].call_id || records[k].value != records[k - 1].value) {
+      nb_rows++;
+    }
+  }
+
+  SEXP call_id = PROTECT(Rf_allocVector(INTSXP, nb_rows));
+  int* call_idx = INTEGER(call_id);
+  SEXP value_idx = PROTECT(Rf_allocVector(INTSXP, nb_rows));
+  int* val_idx = INTEGER(value_idx);
+  SEXP params = PROTECT(Rf_allocVector(STRSXP, nb_rows));
+
+  R_xlen_t j = 0;
+  for(size_t k = 0; k < records.size(); ) {
+    const call_index_record_t& rec = records[k];
+    call_idx[j] = rec.call_id;
+    val_idx[j] = rec.value;
+
+    // The same value can be passed to several parameters of the call:
+    // concatenate their names
+    std::string pars;
+    size_t l = k;
+    for(; l < records.size() && records[l].call_id == rec.call_id && records[l].value == rec.value; l++) {
+      if(l > k) {
+        pars += "; ";
       }
+      pars += records[l].param == return_value ? return_value_str : origins.param_name(records[l].param);
     }
-  }
+    SET_STRING_ELT(params, j, Rf_mkCharLen(pars.data(), pars.size()));
 
+    k = l;
+    j++;
+  }
 
-  // Now we just output the hashmap!
-  SEXP dfs = PROTECT(Rf_allocVector(VECSXP, calls_to_values.size()));
+  SEXP value_calls = PROTECT(create_data_frame({
+    {"call_id", call_id},
+    {"value_id", value_idx},
+    {"param", params}
+  }));
 
-  R_xlen_t i = 0;
-  for(auto p : calls_to_values) {
-    size_t nb_values = p.second.size();
+  UNPROTECT(4);
 
-    // Not nb_values here but rather nb arguments + 1 (return value?)
-    SEXP call_id = PROTECT(Rf_allocVector(INTSXP, nb_values));
-    SEXP value_idx = PROTECT(Rf_allocVector(INTSXP, nb_values));
-    int* val_idx = INTEGER(value_idx);
-    SEXP params = PROTECT(Rf_allocVector(STRSXP, nb_values));
+  return value_calls;
+}
 
-    std::fill_n(INTEGER(call_id), nb_values, p.first);
+const SEXP Database::view_type_signatures(const std::optional<std::string>& package, const std::optional<std::string>& function) {
+  origins.load_hashtables();
 
-    R_xlen_t j = 0;
-    for(auto vid : p.second) {
-      val_idx[j] = vid;
-
-      auto locs = origins.get_locs(vid);
-      robin_hood::unordered_set<std::string> parameters;
-      for(auto loc : locs) {
-        if(loc.package == pkg_id.value() && loc.function == fun_id.value()) {
-          // Might fail if the same value is used for different parameters
-          // In that case there would be a missing param name and one doubled.
-          // To fix that, we would need to track if a param has been already seen or not
-          parameters.insert(origins.param_name(loc.param));
-        }
-      }
+  if(type_signatures.nb_values() < nb_total_values) {
+    Rf_warning("%llu values do not have a type signature yet. Open the database in write mode to compute them.\n",
+               (unsigned long long) (nb_total_values - type_signatures.nb_values()));
+  }
 
-      if(parameters.size() == 0) {
-        Rf_warning("Value %llu does not correspond to a parameter of %s::%s.\n", (unsigned long long) vid, package.c_str(), function.c_str());
-        SET_STRING_ELT(params, j, NA_STRING);
-      }
-      else {
-        std::string pars = *parameters.begin();
-        for(auto it = ++parameters.begin() ; it != parameters.end() ; it++) {
-          pars +=  "; ";
-          pars += *it;
-        }
-        SET_STRING_ELT(params, j, Rf_mkChar(pars.c_str()));
-      }
-      
+  std::optional<uint64_t> pkg_id;
+  if(package.has_value()) {
+    pkg_id = origins.package_id(*package);
+    if(!pkg_id.has_value()) {
+      Rf_warning("No values from package %s in the database.\n", package->c_str());
+      return R_NilValue;
+    }
+  }
 
-      j++;
+  std::optional<uint64_t> fun_id;
+  if(function.has_value()) {
+    fun_id = origins.function_id(*function);
+    if(!fun_id.has_value()) {
+      Rf_warning("No values from function %s in the database.\n", function->c_str());
+      return R_NilValue;
     }
+  }
 
-    SEXP df = PROTECT(create_data_frame({
-      {"call_id", call_id},
-      {"value_id", value_idx},
-      {"param", params}
-    }));
+  std::vector<std::pair<signature_key_t, uint64_t>> rows;
+  for(const auto& c : type_signatures.signature_counts()) {
+    if((!pkg_id || c.first.loc.package == *pkg_id) && (!fun_id || c.first.loc.function == *fun_id)) {
+      rows.push_back({c.first, c.second});
+    }
+  }
 
-    SET_VECTOR_ELT(dfs, i, df);
+  // By parameter, and then the most frequent signatures first
+  std::sort(rows.begin(), rows.end(), [](const auto& a, const auto& b) {
+    const location_t& la = a.first.loc;
+    const location_t& lb = b.first.loc;
+    return std::tie(la.package, la.function, la.param, b.second, a.first.signature) <
+      std::tie(lb.package, lb.function, lb.param, a.second, b.first.signature);
+  });
 
-    UNPROTECT(4);
-    i++;
-  }
+  SEXP pkg_cache = PROTECT(origins.package_cache());
+  SEXP fun_cache = PROTECT(origins.function_cache());
+  SEXP param_cache = PROTECT(origins.parameter_cache());
 
-  SEXP value_calls = PROTECT(bind_rows(dfs));
+  size_t nb_rows = rows.size();
+  SEXP packages = PROTECT(Rf_allocVector(STRSXP, nb_rows));
+  SEXP functions = PROTECT(Rf_allocVector(STRSXP, nb_rows));
+  SEXP params = PROTECT(Rf_allocVector(STRSXP, nb_rows));
+  SEXP types = PROTECT(Rf_allocVector(INTSXP, nb_rows));
+  SEXP class_names = PROTECT(Rf_allocVector(STRSXP, nb_rows));
+  SEXP min_lengths = PROTECT(Rf_allocVector(REALSXP, nb_rows));
+  SEXP max_lengths = PROTECT(Rf_allocVector(REALSXP, nb_rows));
+  SEXP has_na = PROTECT(Rf_allocVector(LGLSXP, nb_rows));
+  SEXP n_dims = PROTECT(Rf_allocVector(INTSXP, nb_rows));
+  SEXP counts = PROTECT(Rf_allocVector(REALSXP, nb_rows));
+
+  for(size_t i = 0; i < nb_rows; i++) {
+    const location_t& loc = rows[i].first.loc;
+    const type_signature_t& sig = type_signatures.signature(rows[i].first.signature);
+
+    SET_STRING_ELT(packages, i, STRING_ELT(pkg_cache, loc.package));
+    SET_STRING_ELT(functions, i, STRING_ELT(fun_cache, loc.function));
+    SET_STRING_ELT(params, i, loc.param == return_value ? NA_STRING : STRING_ELT(param_cache, loc.param));
+    INTEGER(types)[i] = sig.sexptype;
+    std::string_view classes_sig = type_signatures.class_signature(sig.classes);
+    SET_STRING_ELT(class_names, i, Rf_mkCharLen(classes_sig.data(), classes_sig.size()));
+    // The bin contains the lengths in ]length_intervals[bin - 1], length_intervals[bin]]
+    REAL(min_lengths)[i] = sig.length_bin == 0 ? 0 : SearchIndex::length_intervals[sig.length_bin - 1] + 1;
+    REAL(max_lengths)[i] = sig.length_bin + 1 == SearchIndex::nb_intervals ? R_PosInf : SearchIndex::length_intervals[sig.length_bin];
+    LOGICAL(has_na)[i] = sig.has_na;
+    INTEGER(n_dims)[i] = sig.n_dims;
+    REAL(counts)[i] = rows[i].second;
+  }
+
+  SEXP df = PROTECT(create_data_frame({
+    {"pkg", packages},
+    {"fun", functions},
+    {"param", params},
+    {"type", types},
+    {"classnames", class_names},
+    {"min_length", min_lengths},
+    {"max_length", max_lengths},
+    {"has_na", has_na},
+    {"n_dims", n_dims},
+    {"count", counts}
+  }));
 
-  UNPROTECT(2);
+  UNPROTECT(14);
 
-  return value_calls;
+  return df;
 }
 
 const SEXP Database::values_from_origin(const std::string& package, const std::string& function) {
@@ -1193,11 +1505,12 @@ const SEXP Database::values_from_origin(const std::string& package, const std::s
   }
 
   auto fun_id = origins.function_id(function);
-  if(!pkg_id.has_value()) {
+  if(!fun_id.has_value()) {
     Rf_warning("No values from function %s in the database.\n", function.c_str());
     return R_NilValue;
   }
 
+  search_index.load(index_group::Packages);
   if(search_index.packages_index.size() == 0) {
       Rf_warning("The package index is empty. Have you built the indexes?\n");
       return R_NilValue;
@@ -1205,23 +1518,7 @@ const SEXP Database::values_from_origin(const std::string& package, const std::s
   // Now the indexes
   auto pkg_index = search_index.packages_index.at(pkg_id.value());
 
-  // we need to find out in which consolidated index the function lies in
-  // TODO: we could do a dichotomic search here...
-  int bin_index = -1;
-  for(int i = 0 ; i < search_index.function_index.size() ; i ++) {
-    if(search_index.function_index[i].first > fun_id.value()) {
-      bin_index = i;
-      break;
-    }
-  }
-  if(bin_index == -1) {
-    bin_index = search_index.function_index.size() - 1;
-    if(bin_index < 0) {
-      Rf_warning("The function index is empty. Have you built the indexes?\n");
-      return R_NilValue;
-    }
-  }
-  auto fun_index = search_index.search_function(*this, search_index.function_index[bin_index].second, fun_id.value());
+  auto fun_index = search_index.function_index.get(fun_id.value());
 
   // All the values linked to that origin
   auto origin_index = pkg_index & fun_index;
@@ -1286,7 +1583,7 @@ const SEXP Database::map(const SEXP function) {
   SEXP unserialized_sxpdb_value = Rf_install("unserialized_sxpdb_value");
 
   for(uint64_t i = 0 ; i < nb_total_values ; i++) {
-    sexp_table.read_in(i, buf);
+    sexp_table->read_in(i, buf);
 
     SEXP val = PROTECT(ser.unserialize(buf));// no need to protect as it is going to be bound just after
     // or not?
@@ -1334,7 +1631,7 @@ const SEXP Database::map(Query& query, const SEXP function) {
 
   uint64_t j = 0;
   for(uint64_t i : index) {
-    sexp_table.read_in(i, buf);
+    sexp_table->read_in(i, buf);
 
     SEXP val = PROTECT(ser.unserialize(buf));// no need to protect as it is going to be bound just after
     // or not?
@@ -1378,7 +1675,7 @@ const SEXP Database::filter_index(const SEXP function) {
   SEXP unserialized_sxpdb_value = Rf_install("unserialized_sxpdb_value");
 
   for(uint64_t i = 0 ; i < nb_total_values ; i++) {
-    sexp_table.read_in(i, buf);
+    sexp_table->read_in(i, buf);
 
     SEXP val = PROTECT(ser.unserialize(buf));// no need to protect as it is going to be bound just after
     // or not?
@@ -1432,7 +1729,7 @@ const SEXP Database::filter_index(Query& query, const SEXP function) {
   SEXP unserialized_sxpdb_value = Rf_install("unserialized_sxpdb_value");
 
   for(uint64_t i : index) {
-    sexp_table.read_in(i, buf);
+    sexp_table->read_in(i, buf);
 
     SEXP val = PROTECT(ser.unserialize(buf));// no need to protect as it is going to be bound just after
     // or not?
@@ -1461,7 +1758,41 @@ const SEXP Database::filter_index(Query& query, const SEXP function) {
 }
 
 void Database::add_origin(uint64_t index, const std::string& pkg_name, const std::string& func_name, const std::string& param_name) {
-  origins.add_origin(index, pkg_name, func_name, param_name);
+  if(origins.add_origin(index, pkg_name, func_name, param_name).second) {
+    search_index.value_updated(index);
+  }
+
+  if(!replaying) {
+    wal.begin(wal_record_type::Origin);
+    wal.put(index);
+    wal.put_string(pkg_name);
+    wal.put_string(func_name);
+    wal.put_string(param_name);
+    wal.end();
+  }
+}
+
+void Database::add_location(uint64_t index, const std::string& pkg_name, const std::string& func_name, const std::string& param_name, uint64_t call_id) {
+  auto [loc, new_origin] = origins.add_origin(index, pkg_name, func_name, param_name);
+  type_signatures.observe(loc, type_signatures.value_signature(index));
+
+  if(call_ids.add_call_id(index, call_id)) {
+    call_sites.append(call_site_t(index, call_id, loc));
+  }
+  // The call index is built from the call sites: only a new origin has to be indexed again
+  if(new_origin) {
+    search_index.value_updated(index);
+  }
+}
+
+void Database::merge_call_sites(const Database& other, const std::vector<uint64_t>& mapping) {
+  for(uint64_t i = 0; i < other.call_sites.nb_values(); i++) {
+    const call_site_t& site = other.call_sites.read(i);
+    location_t loc = origins.intern_location(other.origins.package_name(site.loc.package),
+                                             other.origins.function_name(site.loc.function),
+                                             other.origins.param_name(site.loc.param));
+    call_sites.append(call_site_t(mapping[site.index], site.call_id, loc));
+  }
 }
 
 std::tuple<const sexp_hash*, uint64_t, bool> Database::add_value(SEXP val) {
@@ -1497,6 +1828,7 @@ std::tuple<const sexp_hash*, uint64_t, bool> Database::add_value(SEXP val) {
     auto meta = runtime_meta.read(*idx);
     meta.n_calls++;
     runtime_meta.write(*idx, meta);
+    search_index.n_calls_changed(*idx);
 
 #ifndef NDEBUG
   auto debug_cnts = debug_counters.read(*idx);
@@ -1511,13 +1843,12 @@ std::tuple<const sexp_hash*, uint64_t, bool> Database::add_value(SEXP val) {
     // We have to add the value to the sexp table and hashes
     // and create the metadata and the debug counters
     idx = nb_total_values;//before being incremented
-    sexp_table.append(*buf);
+    sexp_table->append(*buf);
 
     // Add hash in the table of hashes
     hashes.append(*key);
-    // Add it also in the hashmap
-    auto res = sexp_index.insert({&hashes.memory_view().back(), *idx});
-    assert(res.second);// it should be a new value
+    // Add it also in the hash index
+    hash_index.insert(*key, *idx);
 
     // Static meta
     static_meta_t s_meta;
@@ -1548,6 +1879,8 @@ std::tuple<const sexp_hash*, uint64_t, bool> Database::add_value(SEXP val) {
     }
     static_meta.append(s_meta);
 
+    type_signatures.add_value(*idx, intern_type_signature(val, s_meta));
+
     // runtime meta
     runtime_meta_t r_meta;
     runtime_meta.append(r_meta);
@@ -1569,7 +1902,7 @@ std::tuple<const sexp_hash*, uint64_t, bool> Database::add_value(SEXP val) {
 
     nb_total_values++;
     new_elements= true;
-    assert(nb_total_values == sexp_table.nb_values());
+    assert(nb_total_values == sexp_table->nb_values());
     assert(nb_total_values == static_meta.nb_values());
     assert(nb_total_values == runtime_meta.nb_values());
     assert(nb_total_values == origins.nb_values());
@@ -1584,20 +1917,133 @@ std::tuple<const sexp_hash*, uint64_t, bool> Database::add_value(SEXP val) {
 }
 
 std::tuple<const sexp_hash*, uint64_t, bool> Database::add_value(SEXP val, const std::string& pkg_name, const std::string& func_name, const std::string& param_name, uint64_t call_id) {
+  uint64_t old_total_values = nb_total_values;
   auto res = add_value(val);
   if(std::get<0>(res) != nullptr) {// if it is null, it means we ignored it because it was an environment or a closure, or the db was forked
     assert(nb_total_values > 0);
     //res.1 contains the index of the value
     // if it is a new value, it is going to be nb_total_values
-    origins.add_origin(std::get<1>(res), pkg_name, func_name, param_name);
-
-    call_ids.add_call_id(std::get<1>(res), call_id);
+    uint64_t index = std::get<1>(res);
+    add_location(index, pkg_name, func_name, param_name, call_id);
+
+    if(!replaying) {
+      // New values are logged with their serialized form, to be added again when replaying
+      bool is_new = nb_total_values > old_total_values;
+      wal.begin(wal_record_type::Value);
+      wal.put(index);
+      wal.put(call_id);
+      wal.put_string(pkg_name);
+      wal.put_string(func_name);
+      wal.put_string(param_name);
+      wal.put<uint8_t>(is_new);
+      if(is_new) {
+        wal.put_bytes(sexp_table->read_view(index));
+      }
+      wal.end();
+
+      if(wal.size() >= checkpoint_bytes ||
+        (checkpoint_values > 0 && nb_total_values - last_checkpoint_values >= checkpoint_values) ||
+        (checkpoint_seconds > 0 && std::chrono::steady_clock::now() - last_checkpoint_time >= std::chrono::seconds(checkpoint_seconds))) {
+        checkpoint();
+        // The checkpoint maps the hashes it has written
+        std::get<0>(res) = &hashes.read(index);
+      }
+    }
   }
 
   return res;
 }
 
+void Database::replay(const std::vector<wal_record_t>& records) {
+  replaying = true;
+  std::vector<std::byte> buf;
+  for(const auto& record : records) {
+    WalCursor cursor(record.payload);
+    if(record.type == wal_record_type::Value) {
+      uint64_t index = cursor.get<uint64_t>();
+      uint64_t call_id = cursor.get<uint64_t>();
+      std::string pkg_name = cursor.get_string();
+      std::string func_name = cursor.get_string();
+      std::string param_name = cursor.get_string();
+      bool is_new = cursor.get<uint8_t>();
+
+      if(is_new) {
+        Span<const std::byte> bytes = cursor.get_bytes();
+        buf.assign(bytes.begin(), bytes.end());
+        SEXP val = PROTECT(ser.unserialize(buf));
+        auto res = add_value(val, pkg_name, func_name, param_name, call_id);
+        UNPROTECT(1);
+        if(std::get<0>(res) == nullptr || std::get<1>(res) != index) {
+          Rf_error("Inconsistent write-ahead log: value %llu was added at index %llu.\n",
+                   (unsigned long long) index, (unsigned long long) std::get<1>(res));
+        }
+      }
+      else {
+        if(index >= nb_total_values) {
+          Rf_error("Inconsistent write-ahead log: value %llu does not exist.\n", (unsigned long long) index);
+        }
+        auto meta = runtime_meta.read(index);
+        meta.n_calls++;
+        runtime_meta.write(index, meta);
+        search_index.n_calls_changed(index);
+        add_location(index, pkg_name, func_name, param_name, call_id);
+      }
+    }
+    else if(record.type == wal_record_type::Origin) {
+      uint64_t index = cursor.get<uint64_t>();
+      std::string pkg_name = cursor.get_string();
+      std::string func_name = cursor.get_string();
+      std::string param_name = cursor.get_string();
+      add_origin(index, pkg_name, func_name, param_name);
+    }
+  }
+  replaying = false;
+}
+
+void Database::checkpoint() {
+  if(mode != OpenMode::Write || pid != getpid()) {
+    return;
+  }
+
+  // If the process stops before the end of the checkpoint, the log cannot be replayed
+  // on the partially written tables
+  wal.begin(wal_record_type::CheckpointBegin);
+  wal.end();
+  wal.sync();
+
+  sexp_table->flush();
+  hashes.flush();
+  hash_index.checkpoint();
+  runtime_meta.flush();
+  static_meta.flush();
+  debug_counters.flush();
+  origins.flush();
+  classes.flush();
+  call_ids.checkpoint();
+  call_sites.flush();
+  dbnames.flush();
+  type_signatures.flush();
+  wal.sync_all();
+  // All the values are now on disk
+  verified_values = nb_total_values;
+
+  wal.begin(wal_record_type::CheckpointEnd);
+  wal.put(nb_total_values);
+  wal.end();
+  wal.sync();
+
+  // The configuration file says which values the search index covers
+  search_index.write();
+  write_configuration();
+  search_index.flush();
+  wal.reset(nb_total_values);
+  last_checkpoint_values = nb_total_values;
+  last_checkpoint_time = std::chrono::steady_clock::now();
+}
+
 uint64_t Database::parallel_merge_in(Database& other, uint64_t min_chunk_size) {
+  // Merges are not logged: the database goes from one checkpoint to the next one
+  checkpoint();
   uint64_t old_total_values = nb_total_values;
   uint64_t old_nb_classnames = classes.nb_classnames();
 
@@ -1612,7 +2058,7 @@ uint64_t Database::parallel_merge_in(Database& other, uint64_t min_chunk_size) {
   throw_assert(other.hashes.loaded());
 
   // Make sure the offsets are loaded into memory so that we can parallelize
-  other.sexp_table.load_all();
+  other.sexp_table->load_all();
 
   bool has_dbnames = other.dbnames.nb_values() != 0;
   std::string dbname = other.configuration_path().parent_path().filename().string();
@@ -1621,7 +2067,7 @@ uint64_t Database::parallel_merge_in(Database& other, uint64_t min_chunk_size) {
 
 
 
-  size_t nb_threads = std::thread::hardware_concurrency() - 1;
+  size_t nb_threads = std::max(2u, std::thread::hardware_concurrency()) - 1;
   thread_pool pool(nb_threads);
 
   // 1st map: indexes in the other database of the elements to add
@@ -1637,22 +2083,20 @@ uint64_t Database::parallel_merge_in(Database& other, uint64_t min_chunk_size) {
   for(size_t i = 0; i < other.nb_total_values; i += chunk_size) {
     elems_fut.push_back(pool.submit([](uint64_t start, uint64_t end,
                                   const FSizeMemoryViewTable<sexp_hash>& other_hashes,
-                                  const sexp_hash_map& sxp_index) {
+                                  const HashIndex& hash_index) {
           roaring::Roaring64Map elems_not_present;
           roaring::Roaring64Map elems_present;
-          sexp_hash key;
           for(uint64_t i = start; i < end; i++) {
-            other_hashes.read_in(i, key);
-            auto idx = sxp_index.find(&key);
-            if(idx == sxp_index.end()) {
+            auto idx = hash_index.find(other_hashes.read(i));
+            if(!idx) {
               elems_not_present.add(i);
             }
             else {
-              elems_present.add(idx->second);
+              elems_present.add(*idx);
             }
           }
           return std::pair<roaring::Roaring64Map, roaring::Roaring64Map>(elems_not_present, elems_present);
-    }, i, std::min(i + chunk_size, other.nb_total_values), std::cref(other.hashes), std::cref(sexp_index)));
+    }, i, std::min(i + chunk_size, other.nb_total_values), std::cref(other.hashes), std::cref(hash_index)));
   }
   pool.wait_for_tasks();// get should also wait anyway
 
@@ -1670,28 +2114,14 @@ uint64_t Database::parallel_merge_in(Database& other, uint64_t min_chunk_size) {
   // Now we have all the indexes of the elements to add
 
   // Values
-  // We are using a blocking queue to pipeline the reads and writes
-  // what is the optimal size here?
-  BlockingReaderWriterCircularBuffer<std::vector<std::byte>> q(1024);
-
-  // Read task
-  pool.push_task([](const roaring::Roaring64Map& index, BlockingReaderWriterCircularBuffer<std::vector<std::byte>>& queue, const VSizeTable<std::vector<std::byte>>& other_table) {
-    std::vector<std::byte> buf;
+  // The other database is open in merge mode so its sexp table is mapped:
+  // we can directly append from views into it, without an intermediate copy
+  pool.push_task([](const roaring::Roaring64Map& index, BlobTable& table, const BlobTable& other_table) {
+    BlobCursor cursor;
     for(uint64_t idx : index) {
-     other_table.read_in(idx, buf);
-      queue.wait_enqueue(buf);
+      table.append_view(other_table.read_view(idx, cursor));
     }
-  }, std::cref(elems_to_add), std::ref(q), std::cref(other.sexp_table));
-
-  // Write task
-  pool.push_task([](const roaring::Roaring64Map& index, VSizeTable<std::vector<std::byte>>& table, BlockingReaderWriterCircularBuffer<std::vector<std::byte>>& queue) {
-    std::vector<std::byte> buf;
-    uint64_t nb_values = index.cardinality();
-    for(uint64_t i = 0; i < nb_values ; i++) {
-      queue.wait_dequeue(buf);
-      table.append(buf);
-    }
-  }, std::cref(elems_to_add), std::ref(sexp_table), std::ref(q));
+  }, std::cref(elems_to_add), std::ref(*sexp_table), std::cref(*other.sexp_table));
 
 
   //// Runtime meta data
@@ -1767,18 +2197,17 @@ uint64_t Database::parallel_merge_in(Database& other, uint64_t min_chunk_size) {
   }
   #endif
 
-  // Hashes and sexp_index
+  // Hashes and hash index
   pool.push_task([](const roaring::Roaring64Map& index, FSizeMemoryViewTable<sexp_hash>& table,
-   const FSizeMemoryViewTable<sexp_hash>& other_table, sexp_hash_map& sxp_index) {
-    sexp_hash key;
+   const FSizeMemoryViewTable<sexp_hash>& other_table, HashIndex& hash_index) {
     uint64_t n_values = table.nb_values();
     for(uint64_t idx : index) {
-      other_table.read_in(idx, key);
+      const sexp_hash& key = other_table.read(idx);
       table.append(key);
-      sxp_index.insert({&table.memory_view().back(), n_values});
+      hash_index.insert(key, n_values);
       n_values++;
     }
-  }, std::cref(elems_to_add), std::ref(hashes), std::cref(other.hashes), std::ref(sexp_index));
+  }, std::cref(elems_to_add), std::ref(hashes), std::cref(other.hashes), std::ref(hash_index));
 
   // Static meta data
   pool.push_task([](const roaring::Roaring64Map& index,FSizeTable<static_meta_t>& table, const FSizeTable<static_meta_t>& other_table) {
@@ -1930,6 +2359,20 @@ uint64_t Database::parallel_merge_in(Database& other, uint64_t min_chunk_size) {
 
   pool.wait_for_tasks();
 
+  // Their origins and numbers of calls have to be indexed again
+  search_index.values_updated(elems_present);
+  search_index.n_calls_changed(elems_present);
+
+  // The hash index now has all the values of the other database
+  std::vector<uint64_t> mapping(other.call_sites.nb_values() > 0 ? other.nb_values() : 0);
+  for(uint64_t i = 0; i < mapping.size(); i++) {
+    mapping[i] = *hash_index.find(other.hashes.read(i));
+  }
+  merge_call_sites(other, mapping);
+
+  // It needs the merged origins
+  merge_type_signatures(other, elems_to_add);
+
   nb_total_values += elems_to_add.cardinality();
 
   if(nb_total_values > old_total_values) {
@@ -1937,22 +2380,25 @@ uint64_t Database::parallel_merge_in(Database& other, uint64_t min_chunk_size) {
   }
 
   throw_assert(nb_total_values >= old_total_values);
-  throw_assert(sexp_table.nb_values() == nb_total_values);
+  throw_assert(sexp_table->nb_values() == nb_total_values);
   throw_assert(classes.nb_values() == nb_total_values);
   throw_assert(hashes.nb_values() == nb_total_values);
   throw_assert(static_meta.nb_values() == nb_total_values);
   throw_assert(runtime_meta.nb_values() == nb_total_values);
   throw_assert(classes.nb_classnames() >= old_nb_classnames);
 
+  checkpoint();
 
   return nb_total_values - old_total_values;
 }
 
 uint64_t Database::merge_in(Database& other) {
+  // Merges are not logged: the database goes from one checkpoint to the next one
+  checkpoint();
   uint64_t old_total_values = nb_total_values;
   uint64_t old_nb_classnames = classes.nb_classnames();
 
-  other.sexp_table.load_all();
+  other.sexp_table->load_all();
 
   bool has_dbnames = other.dbnames.nb_values() != 0;
   std::string dbname = other.configuration_path().parent_path().filename().string();
@@ -1963,6 +2409,10 @@ uint64_t Database::merge_in(Database& other) {
 
   bool has_debug = debug_counters.nb_values() > 0 && other.debug_counters.nb_values() > 0;
 
+  // Mapping old to new indexes
+  std::vector<uint64_t> mapping(other.nb_values());
+  roaring::Roaring64Map other_added;
+
   for(uint64_t other_idx = 0; other_idx < other.nb_values(); other_idx++) {
      other.hashes.read_in(other_idx, key);
 
@@ -1971,11 +2421,11 @@ uint64_t Database::merge_in(Database& other) {
    // Assuming the lookup is O(1)
    // It should be quicker than iterating the large db each time and
    // looking up in the small db
-    auto has_hash = sexp_index.find(&key);
+    auto has_hash = hash_index.find(key);
 
     // It is not present in the target db
-    if(has_hash == sexp_index.end()) {
-      sexp_table.append(other.sexp_table.read(other_idx));
+    if(!has_hash) {
+      sexp_table->append_view(other.sexp_table->read_view(other_idx));
 
       static_meta.append(other.static_meta.read(other_idx));
 
@@ -2019,7 +2469,10 @@ uint64_t Database::merge_in(Database& other) {
 
       // Hashes
       hashes.append(key);
-      sexp_index.insert({&hashes.memory_view().back(), nb_total_values});
+      hash_index.insert(key, nb_total_values);
+      other_added.add(other_idx);
+
+      mapping[other_idx] = nb_total_values;
 
       nb_total_values++;
       new_elements = true;
@@ -2029,7 +2482,9 @@ uint64_t Database::merge_in(Database& other) {
       // It is present in the target db: we just have to update the runtime metadata
       // the debug counters,
       // and the possible new origins
-      uint64_t db_idx = has_hash->second;
+      uint64_t db_idx = *has_hash;
+
+      mapping[other_idx] = db_idx;
 
       // Runtime metadata
       runtime_meta.read_in(db_idx, meta);
@@ -2055,6 +2510,8 @@ uint64_t Database::merge_in(Database& other) {
                            other.origins.function_name(loc.function),
                            other.origins.param_name(loc.param));
       }
+      search_index.value_updated(db_idx);
+      search_index.n_calls_changed(db_idx);
 
       // DB names
       if(has_dbnames) {
@@ -2073,30 +2530,238 @@ uint64_t Database::merge_in(Database& other) {
     }
   }
 
+  merge_call_sites(other, mapping);
+
+  merge_type_signatures(other, other_added);
+
   if(nb_total_values > old_total_values) {
     new_elements = true;
   }
 
   throw_assert(nb_total_values >= old_total_values);
-  throw_assert(sexp_table.nb_values() == nb_total_values);
+  throw_assert(sexp_table->nb_values() == nb_total_values);
   throw_assert(classes.nb_classnames() >= old_nb_classnames);
 
+  checkpoint();
+
   return nb_total_values - old_total_values;
 }
 
-const std::vector<size_t> Database::check(bool slow_check) {
-  std::vector<size_t> errors;
+std::vector<std::string> Database::check_row_counts() const {
+  std::vector<std::string> errors;
+  auto inconsistent = [&](const char* table, uint64_t n) {
+    errors.push_back(std::string("Inconsistent number of values in the global configuration file and in the ") +
+                     table + ": " + std::to_string(nb_total_values) + " vs " + std::to_string(n));
+  };
+
+  if(sexp_table->nb_values() != nb_total_values) {
+    inconsistent("sexp table", sexp_table->nb_values());
+  }
+  if(hashes.nb_values() != nb_total_values) {
+    inconsistent("hashes table", hashes.nb_values());
+  }
+  if(runtime_meta.nb_values() != nb_total_values) {
+    inconsistent("runtime_meta table", runtime_meta.nb_values());
+  }
+  if(static_meta.nb_values() != nb_total_values) {
+    inconsistent("static_meta table", static_meta.nb_values());
+  }
+  if(debug_counters.nb_values() != 0 && debug_counters.nb_values() != nb_total_values) {
+    inconsistent("debug counters tables", debug_counters.nb_values());
+  }
+  if(origins.nb_values() > nb_total_values) {
+    inconsistent("origin tables", origins.nb_values());
+  }
+  if(classes.nb_values() != nb_total_values) {
+    inconsistent("class tables", classes.nb_values());
+  }
+  if(call_ids.nb_values() != nb_total_values) {
+    inconsistent("call_id tables", call_ids.nb_values());
+  }
+  // 0 is possible, as we only update that table when merging
+  // SO the table is empty just after tracing
+  if(dbnames.nb_values() != 0 && dbnames.nb_values() != nb_total_values) {
+    inconsistent("db names tables", dbnames.nb_values());
+  }
 
-  //TODO!
   return errors;
 }
 
+uint64_t Database::nb_values_in_all_tables() const {
+  uint64_t n = std::min({sexp_table->nb_values(), hashes.nb_values(), runtime_meta.nb_values(),
+                         static_meta.nb_values(), classes.nb_values(), call_ids.nb_values()});
+  if(debug_counters.nb_values() != 0) {
+    n = std::min(n, debug_counters.nb_values());
+  }
+  if(dbnames.nb_values() != 0) {
+    n = std::min(n, dbnames.nb_values());
+  }
+  return n;
+}
+
+check_report_t Database::check(bool slow_check, uint64_t from) {
+  check_report_t report;
+  report.nb_values = nb_total_values;
+  report.table_errors = check_row_counts();
+
+  // Only the values present in all the tables can be checked
+  uint64_t n = nb_values_in_all_tables();
+  report.nb_checked = n;
+  from = std::min(from, n);
+  report.first_checked = from;
+
+  // The threads read views into the mapped table
+  sexp_table->map();
+  // In read mode, the hash index is built at the first lookup: not in the threads
+  if(from < n) {
+    hash_index.find(hashes.read(from));
+  }
+
+  thread_pool pool(std::max(2u, std::thread::hardware_concurrency()) - 1);
+
+  // Per value: 0 if it is valid, otherwise 1 + its check_error_kind
+  std::vector<uint8_t> status;
+  std::vector<uint64_t> sizes;
+  std::vector<std::byte> buf;
+  BlobCursor cursor;
+  Span<const std::byte> view;
+
+  constexpr uint64_t chunk_size = 65536;
+  for(uint64_t start = from; start < n; start += chunk_size) {
+    uint64_t end = std::min(n, start + chunk_size);
+
+    // The static metadata is not necessarily loaded, and cannot be read concurrently then
+    sizes.resize(end - start);
+    for(uint64_t i = start; i < end; i++) {
+      sizes[i - start] = static_meta.read(i).size;
+    }
+    status.assign(end - start, 0);
+
+    pool.parallelize_loop(start, end, [&](uint64_t first, uint64_t last) {
+      BlobCursor thread_cursor;
+      Span<const std::byte> value;
+      for(uint64_t i = first; i < last; i++) {
+        check_error_kind kind;
+        if(!sexp_table->read_checked(i, thread_cursor, value)) {
+          kind = check_error_kind::Location;
+        }
+        else if(value.size() != sizes[i - start]) {
+          kind = check_error_kind::Size;
+        }
+        else if(!(XXH3_128bits(value.data(), value.size()) == hashes.read(i))) {
+          kind = check_error_kind::Hash;
+        }
+        else {
+          std::optional<uint64_t> idx = hash_index.find(hashes.read(i));
+          if(!idx || *idx != i) {
+            kind = check_error_kind::HashIndex;
+          }
+          else if(!call_ids.valid(i)) {
+            kind = check_error_kind::CallIds;
+          }
+          else {
+            continue;
+          }
+        }
+        status[i - start] = static_cast<uint8_t>(kind) + 1;
+      }
+    });
+
+    // Unserializing calls R, so it happens here, only for the values with the right hash
+    if(slow_check) {
+      for(uint64_t i = start; i < end; i++) {
+        if(status[i - start] != 0) {
+          continue;
+        }
+        sexp_table->read_checked(i, cursor, view);
+        buf.assign(view.begin(), view.end());
+        SEXP val = PROTECT(ser.unserialize(buf));
+        const static_meta_t& meta = static_meta.read(i);
+        if(static_cast<SEXPTYPE>(TYPEOF(val)) != meta.sexptype || static_cast<uint64_t>(Rf_xlength(val)) != meta.length) {
+          status[i - start] = static_cast<uint8_t>(check_error_kind::Metadata) + 1;
+        }
+        UNPROTECT(1);
+      }
+      Rprintf("\rChecked %llu/%llu values", (unsigned long long) end, (unsigned long long) n);
+    }
+
+    for(uint64_t i = start; i < end; i++) {
+      if(status[i - start] != 0) {
+        report.errors.push_back({i, static_cast<check_error_kind>(status[i - start] - 1)});
+      }
+    }
+  }
+  if(slow_check && from < n) {
+    Rprintf("\n");
+  }
+
+  report.valid_values = report.errors.empty() ? n : report.errors.front().index;
+  // Recorded at the next checkpoint
+  if(report.ok()) {
+    verified_values = std::max(verified_values, report.valid_values);
+  }
+  return report;
+}
+
+void Database::truncate(uint64_t n) {
+  sexp_table->truncate(n);
+  hashes.truncate(n);
+  runtime_meta.truncate(n);
+  static_meta.truncate(n);
+  debug_counters.truncate(n);
+  origins.truncate(n);
+  classes.truncate(n);
+  call_ids.truncate(n);
+  // The call sites are in the order of the trace: the ones of the removed values are
+  // mixed with the ones of the values that are kept after the first of them
+  uint64_t first_removed = 0;
+  while(first_removed < call_sites.nb_values() && call_sites.read(first_removed).index < n) {
+    first_removed++;
+  }
+  std::vector<call_site_t> kept_sites;
+  for(uint64_t i = first_removed; i < call_sites.nb_values(); i++) {
+    const call_site_t& site = call_sites.read(i);
+    if(site.index < n) {
+      kept_sites.push_back(site);
+    }
+  }
+  call_sites.truncate(first_removed);
+  call_sites.append(kept_sites);
+  call_sites_from = std::min(call_sites_from, n);
+  dbnames.truncate(n);
+  type_signatures.truncate(n);
+
+  // The indexes refer to the removed values
+  hash_index.rebuild();
+  if(search_index.last_computed > n) {
+    search_index.reset();
+  }
+  sexp_addresses.clear();
+
+  nb_total_values = n;
+  verified_values = std::min(verified_values, n);
+  new_elements = true;
+}
+
+void Database::repair(const check_report_t& report) {
+  if(mode != OpenMode::Write) {
+    Rf_error("Cannot repair a database that is not open in write mode.\n");
+  }
+  if(report.ok()) {
+    return;
+  }
+  truncate(report.valid_values);
+  checkpoint();
+}
+
 
 std::vector<uint64_t> Database::merge_into(Database& other) {
+  // Merges are not logged: the database goes from one checkpoint to the next one
+  checkpoint();
   uint64_t old_total_values = nb_total_values;
   uint64_t old_nb_classnames = classes.nb_classnames();
 
-  other.sexp_table.load_all();
+  other.sexp_table->load_all();
 
   bool has_dbnames = other.dbnames.nb_values() != 0;
   std::string dbname = other.configuration_path().parent_path().filename().string();
@@ -2114,6 +2779,7 @@ std::vector<uint64_t> Database::merge_into(Database& other) {
 
   // Mapping old to new indexes
   std::vector<uint64_t> mapping(other.nb_values());
+  roaring::Roaring64Map other_added;
 
   for(uint64_t other_idx = 0; other_idx < other.nb_values(); other_idx++) {
      other.hashes.read_in(other_idx, key);
@@ -2123,11 +2789,11 @@ std::vector<uint64_t> Database::merge_into(Database& other) {
    // Assuming the lookup is O(1)
    // It should be quicker than iterating the large db each time and
    // looking up in the small db
-    auto has_hash = sexp_index.find(&key);
+    auto has_hash = hash_index.find(key);
 
     // It is not present in the target db
-    if(has_hash == sexp_index.end()) {
-      sexp_table.append(other.sexp_table.read(other_idx));
+    if(!has_hash) {
+      sexp_table->append_view(other.sexp_table->read_view(other_idx));
 
       static_meta.append(other.static_meta.read(other_idx));
 
@@ -2171,7 +2837,8 @@ std::vector<uint64_t> Database::merge_into(Database& other) {
 
       // Hashes
       hashes.append(key);
-      sexp_index.insert({&hashes.memory_view().back(), nb_total_values});
+      hash_index.insert(key, nb_total_values);
+      other_added.add(other_idx);
 
       // Update the mapping
       mapping[other_idx] = nb_total_values;
@@ -2184,7 +2851,7 @@ std::vector<uint64_t> Database::merge_into(Database& other) {
       // It is present in the target db: we just have to update the runtime metadata
       // the debug counters,
       // and the possible new origins
-      uint64_t db_idx = has_hash->second;
+      uint64_t db_idx = *has_hash;
 
       // Update mapping
       mapping[other_idx] = db_idx;
@@ -2213,6 +2880,8 @@ std::vector<uint64_t> Database::merge_into(Database& other) {
                            other.origins.function_name(loc.function),
                            other.origins.param_name(loc.param));
       }
+      search_index.value_updated(db_idx);
+      search_index.n_calls_changed(db_idx);
 
       // DB names
       if(has_dbnames) {
@@ -2231,13 +2900,19 @@ std::vector<uint64_t> Database::merge_into(Database& other) {
     }
   }
 
+  merge_call_sites(other, mapping);
+
+  merge_type_signatures(other, other_added);
+
   if(nb_total_values > old_total_values) {
     new_elements = true;
   }
 
   throw_assert(nb_total_values >= old_total_values);
-  throw_assert(sexp_table.nb_values() == nb_total_values);
+  throw_assert(sexp_table->nb_values() == nb_total_values);
   throw_assert(classes.nb_classnames() >= old_nb_classnames);
 
+  checkpoint();
+
   return mapping;
 }
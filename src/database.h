@@ -25,6 +25,10 @@
 #include "serialization.h"
 #include "call_ids.h"
 #include "dbnames.h"
+#include "type_signatures.h"
+#include "blob_table.h"
+#include "hash_index.h"
+#include "wal.h"
 
 #include "robin_hood.h"
 #include "xxhash.h"
@@ -52,6 +56,32 @@ struct debug_counters_t {
   uint64_t n_sexp_address_opt = 0;// how many times we have been able to use the SEXP address optimization
 };
 
+// What is wrong with a value, found by Database::check
+enum class check_error_kind {
+  Location,// its location in the sexp table is not valid, or it cannot be decompressed
+  Size,// its size is not the one in the static metadata
+  Hash,// the hash of its bytes is not the one in the hashes table
+  HashIndex,// the hash index does not lead to it
+  Metadata,// it cannot be unserialized, or does not match its static metadata (slow check)
+  CallIds// its call ids cannot be decoded
+};
+
+struct check_error_t {
+  uint64_t index;
+  check_error_kind kind;
+};
+
+struct check_report_t {
+  uint64_t nb_values = 0;// in the configuration file
+  uint64_t first_checked = 0;// the values before it were not checked
+  uint64_t nb_checked = 0;// values present in all the tables
+  uint64_t valid_values = 0;// the values before that index, and in all the tables, have no errors
+  std::vector<check_error_t> errors;// sorted by index
+  std::vector<std::string> table_errors;// inconsistent numbers of values in the tables
+
+  bool ok() const { return errors.empty() && table_errors.empty(); }
+};
+
 class Database {
 public:
   static const int version_major = stoi(PKG_V_MAJOR);
@@ -62,12 +92,27 @@ public:
   friend class SearchIndex;
   friend class Query;
 
-  typedef std::unordered_map<const sexp_hash*, uint64_t, xxh128_pointer_hasher, xxh128_pointer_equal> sexp_hash_map;
-
   enum class OpenMode {Read, Write, Merge};
 private:
   uint64_t nb_total_values = 0;
+  uint64_t max_call_ids = 0;// per value, 0 for no limit
+  uint64_t checkpoint_bytes = 64 * 1024 * 1024;// size of the write-ahead log that triggers a checkpoint
+  // Checkpoint policy: after that many new values, or that many seconds (0 to disable either)
+  uint64_t checkpoint_values = 100000;
+  uint64_t checkpoint_seconds = 300;
+  uint64_t last_checkpoint_values = 0;
+  std::chrono::steady_clock::time_point last_checkpoint_time;
+  // The values before it were written to disk by a completed checkpoint, or checked:
+  // recovering from a crash only checks the values after it
+  uint64_t verified_values = 0;
+  // The values before it were traced before the call sites were recorded: the call index
+  // pairs all their locations with all their calls
+  uint64_t call_sites_from = 0;
+  // Read the search index in the background as soon as the database is opened,
+  // rather than when a query first needs it
+  bool prefetch_index = false;
   bool new_elements = false;
+  bool replaying = false;
   bool new_index = false;
   OpenMode mode;
   bool quiet;
@@ -81,9 +126,9 @@ private:
   // search indexes and origin tables
   // **********************************
   FSizeMemoryViewTable<sexp_hash> hashes;
-  sexp_hash_map sexp_index;
+  HashIndex hash_index;// hash -> index of the value
 
-  VSizeTable<std::vector<std::byte>> sexp_table;
+  std::unique_ptr<BlobTable> sexp_table;
   FSizeTable<runtime_meta_t> runtime_meta;//Data that change at runtime
   FSizeTable<static_meta_t> static_meta;//Data that will never change after being written once
   FSizeTable<debug_counters_t> debug_counters;// will be loaded into in debug mode only
@@ -91,7 +136,12 @@ private:
   Origins origins;
   ClassNames classes;
   CallIds call_ids;
+  FSizeTable<call_site_t> call_sites;
   DBNames dbnames;
+  TypeSignatures type_signatures;
+
+  // Operations since the last checkpoint, in write mode
+  WriteAheadLog wal;
 
   // Handling of SEXP serialization,
   // SEXP caching and so on
@@ -106,12 +156,38 @@ private:
   const sexp_hash compute_hash(SEXP val) const;
   const sexp_hash compute_hash(SEXP val, const std::vector<std::byte>& buf) const;
 
+  // Type signatures
+  uint32_t intern_type_signature(SEXP val, const static_meta_t& meta);
+  // Signature and class names of a value, computed from the tables if it has no signature yet
+  std::pair<type_signature_t, std::string> type_signature_of(uint64_t index) const;
+  // For databases created before the type signatures
+  void build_type_signatures();
+  // other_added are the indexes in other of the values that were appended to the database by the merge
+  void merge_type_signatures(const Database& other, const roaring::Roaring64Map& other_added);
+
+  // Call sites of the other database, with the indexes of its values in this one in mapping
+  void merge_call_sites(const Database& other, const std::vector<uint64_t>& mapping);
+
+  // Origin, type signature and call id of a value passed to a function
+  void add_location(uint64_t index, const std::string& pkg_name, const std::string& func_name, const std::string& param_name, uint64_t call_id);
+  // Apply the operations of the write-ahead log, after a crash
+  void replay(const std::vector<wal_record_t>& records);
+
 
   void write_configuration();
+
+  // Inconsistencies between the number of values in the configuration file and in the tables
+  std::vector<std::string> check_row_counts() const;
+  // Number of values present in all the tables
+  uint64_t nb_values_in_all_tables() const;
+  // Remove the values from index n in all the tables
+  void truncate(uint64_t n);
 public:
   // write_mode entails loading more data structures in memory
   // So choosing to read only should be much quicker if the goal is just to sample from the database
-  Database(const fs::path& config_, OpenMode mode, bool quiet_ = true);
+  // If autorepair, a database that was not closed properly and fails the check is truncated
+  // to its longest valid prefix of values, instead of failing to open.
+  Database(const fs::path& config_, OpenMode mode, bool quiet_ = true, bool autorepair = false);
 
   // Merge two databases
   // returns the number of new values
@@ -121,6 +197,8 @@ public:
   std::vector<uint64_t> merge_into(Database& db);
 
   // Adding R values/origins
+  // The hash points into the hash table, which a checkpoint remaps: it is only valid until the next checkpoint.
+  // add_value with an origin can checkpoint, and then returns the hash in the remapped table.
   std::tuple<const sexp_hash*, uint64_t, bool> add_value(SEXP val);//TODO this should add dummy origins
   std::tuple<const sexp_hash*, uint64_t, bool> add_value(SEXP val, const std::string& pkg_name, const std::string& func_name, const std::string& arg_name, uint64_t call_id);
   void add_origin(uint64_t index, const std::string& pkg_name, const std::string& func_name, const std::string& param_name);
@@ -159,6 +237,8 @@ public:
 
   const SEXP values_from_origin(const std::string& package, const std::string& function);
   const SEXP values_from_calls(const std::string& package, const std::string& function);
+  // Aggregated type signatures of the parameters of all the functions, or only of package and/or function
+  const SEXP view_type_signatures(const std::optional<std::string>& package, const std::optional<std::string>& function);
 
   // Map on all the elements and return an R value
   const SEXP map(const SEXP function);
@@ -193,7 +273,31 @@ public:
   void update_query(Query& query) const;
 
   // Utilities
-  const std::vector<size_t> check(bool slow_check);
+  // Check the row counts of the tables, and, in parallel, that the bytes of every value can be read,
+  // have the size of its metadata and the hash of the hashes table, and can be found with the hash index.
+  // The slow check also unserializes the values and compares them to their metadata.
+  // Only the values from index from are checked; the row counts are always checked.
+  check_report_t check(bool slow_check, uint64_t from = 0);
+  // Truncate the database to the valid values of the report
+  void repair(const check_report_t& report);
+
+  // Rewrite the values with another storage layout ("plain", "block", "dict" or "inline")
+  void set_layout(const std::string& layout);
+  const char* layout() const { return sexp_table->layout(); }
+  // Per type: number of values, serialized and stored sizes
+  const SEXP compression_stats() const;
+  // Fold the logs of metadata added to existing values into their tables
+  void compact();
+  // Write all the tables to disk and start a new write-ahead log.
+  // It is done automatically when the log gets large, according to the checkpoint policy,
+  // and when closing. Only the rows added or modified since the last checkpoint are written.
+  void checkpoint();
+  // Checkpoint after n_values new values or after seconds seconds, 0 to disable either
+  void set_checkpoint_policy(uint64_t n_values, uint64_t seconds);
+  std::pair<uint64_t, uint64_t> get_checkpoint_policy() const { return {checkpoint_values, checkpoint_seconds}; }
+  // Keep at most n call ids per value (the smallest ones), 0 for no limit
+  void set_max_call_ids(uint64_t n);
+  uint64_t get_max_call_ids() const { return max_call_ids; }
   const fs::path& configuration_path() const {return config_path; }
 
   uint64_t nb_values() const { return nb_total_values; }
@@ -0,0 +1,145 @@
+#ifndef SXPDB_DICTIONARY_BUILDER_H
+#define SXPDB_DICTIONARY_BUILDER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+
+#include "span.h"
+
+// Builds a compression dictionary from sample values, for LZ4Codec::set_dictionary.
+//
+// This follows the idea of the COVER algorithm of zstd: the samples are split into epochs,
+// and in each epoch, we pick the segment whose d-mers (substrings of d bytes) appear in the
+// largest number of samples. The d-mers of a picked segment then do not count anymore,
+// so that the dictionary does not repeat itself.
+// The best segments are put at the end of the dictionary, where they are the closest to the
+// compressed value.
+class DictionaryBuilder {
+private:
+  static constexpr size_t d = 8;
+  size_t segment_size = 64;
+
+  std::vector<std::byte> data;// concatenation of the samples
+  std::vector<size_t> ends;// end of each sample in data
+
+  static uint64_t dmer(const std::byte* p) {
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+  }
+
+public:
+  DictionaryBuilder(size_t segment = 64) : segment_size(segment) {}
+
+  void add_sample(Span<const std::byte> sample) {
+    data.insert(data.end(), sample.begin(), sample.end());
+    ends.push_back(data.size());
+  }
+
+  size_t samples_size() const { return data.size(); }
+
+  std::vector<std::byte> build(size_t dict_size) const {
+    std::vector<std::byte> dict;
+    if(data.size() < d || dict_size < segment_size) {
+      return dict;
+    }
+
+    // Number of samples each d-mer appears in
+    std::unordered_map<uint64_t, uint32_t> freqs;
+    std::unordered_set<uint64_t> seen;
+    size_t start = 0;
+    for(size_t end : ends) {
+      seen.clear();
+      for(size_t i = start; i + d <= end; i++) {
+        uint64_t m = dmer(data.data() + i);
+        if(seen.insert(m).second) {
+          freqs[m]++;
+        }
+      }
+      start = end;
+    }
+    // A d-mer that appears in only one sample does not help compressing the other ones
+    for(auto& freq : freqs) {
+      freq.second--;
+    }
+
+    struct segment_t {
+      size_t begin;
+      size_t end;
+      uint64_t score;
+    };
+    std::vector<segment_t> segments;
+
+    size_t nb_epochs = std::max<size_t>(1, dict_size / segment_size);
+    size_t epoch_size = std::max(segment_size, data.size() / nb_epochs);
+
+    size_t sample = 0;
+    size_t dict_used = 0;
+    for(size_t epoch = 0; epoch < data.size() && dict_used < dict_size; epoch += epoch_size) {
+      size_t epoch_end = std::min(data.size(), epoch + epoch_size);
+      segment_t best = {0, 0, 0};
+
+      // Slide a window of segment_size bytes, which does not cross samples
+      while(sample < ends.size() && ends[sample] <= epoch) {
+        sample++;
+      }
+      size_t s = sample;
+      size_t pos = epoch;
+      while(pos < epoch_end && s < ends.size()) {
+        size_t sample_end = ends[s];
+        size_t window_end = std::min(pos + segment_size, sample_end);
+        uint64_t score = 0;
+        for(size_t i = pos; i + d <= window_end; i++) {
+          auto it = freqs.find(dmer(data.data() + i));
+          score += it->second;
+        }
+        while(true) {
+          if(score > best.score && window_end - pos >= d) {
+            best = {pos, window_end, score};
+          }
+          if(window_end >= sample_end || pos + 1 >= epoch_end) {
+            break;
+          }
+          // slide by one byte
+          if(window_end - pos >= d) {
+            score -= freqs.find(dmer(data.data() + pos))->second;
+          }
+          pos++;
+          window_end++;
+          score += freqs.find(dmer(data.data() + window_end - d))->second;
+        }
+        pos = sample_end;
+        s++;
+      }
+
+      if(best.score == 0 || best.end - best.begin > dict_size - dict_used) {
+        continue;
+      }
+
+      // Only count a d-mer once
+      for(size_t i = best.begin; i + d <= best.end; i++) {
+        freqs[dmer(data.data() + i)] = 0;
+      }
+      segments.push_back(best);
+      dict_used += best.end - best.begin;
+    }
+
+    std::stable_sort(segments.begin(), segments.end(), [](const segment_t& a, const segment_t& b) {
+      return a.score < b.score;
+    });
+
+    dict.reserve(dict_used);
+    for(const auto& segment : segments) {
+      dict.insert(dict.end(), data.begin() + segment.begin, data.begin() + segment.end);
+    }
+
+    return dict;
+  }
+};
+
+#endif
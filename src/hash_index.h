@@ -0,0 +1,410 @@
+#ifndef SXPDB_HASH_INDEX_H
+#define SXPDB_HASH_INDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <optional>
+#include <filesystem>
+#include <fstream>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "posix_compat.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#include "table.h"
+#include "hasher.h"
+#include "robin_hood.h"
+
+namespace fs = std::filesystem;
+
+struct hash_index_header_t {
+  uint64_t magic = 0;
+  uint32_t version = 0;
+  uint32_t clean = 0;// 0 while the file is being modified, 1 when it is consistent
+  uint64_t capacity = 0;// number of slots, a power of 2
+  uint64_t nb_values = 0;// the values 0..nb_values - 1 of the database are in the index
+  uint64_t reserved[4] = {};
+};
+
+// We only keep 64 bits of the 128-bit hash in the table: this halves its size
+// and the full hash is compared, in the hashes table, only if the fingerprints match.
+struct hash_slot_t {
+  uint64_t fingerprint;// low 64 bits of the hash
+  uint64_t index;// 1 + index of the value, 0 if the slot is empty
+};
+
+// Persistent index from the hashes of the values to their index in the database.
+// It is an open-addressing hash table with linear probing in a memory mapped file
+// (hash_index.bin), so that opening the database does not need to read all
+// the hashes. A slot takes 16 bytes, and the slot of a value is given by the high
+// 64 bits of its hash.
+//
+// In write mode, the file is only modified at checkpoints: the values added since the last
+// checkpoint are kept in a small in-memory table, and inserted into the file by checkpoint().
+// After a crash, the file is then still valid for the values of the last checkpoint.
+// If the process was stopped during a checkpoint, or the index does not match
+// the hashes table, it is rebuilt from the hashes when opening in write mode.
+// In read and merge modes, it is never written to: if it cannot be used as is,
+// it is rebuilt in memory at the first lookup.
+//
+// On Windows, where we do not have mmap, the whole index is read into memory
+// and written back when it is closed.
+class HashIndex {
+private:
+  static constexpr uint64_t magic = 0x5844495048445853;// "SXPDHPIX"
+  static constexpr uint32_t version = 2;
+  static constexpr uint64_t min_capacity = 1024;
+
+  fs::path path;
+  bool write_mode = false;
+  pid_t pid;
+
+  std::byte* base = nullptr;
+  size_t length = 0;
+  bool file_backed = false;// otherwise, in memory
+  std::vector<std::byte> buffer;// in memory storage
+
+  const FSizeMemoryViewTable<sexp_hash>* hashes = nullptr;
+  mutable bool ready = false;
+
+  // Values inserted since the last checkpoint, in write mode
+  robin_hood::unordered_map<sexp_hash, uint64_t, xxh128_hasher> recent;
+
+  hash_index_header_t* header() const {
+    return reinterpret_cast<hash_index_header_t*>(base);
+  }
+
+  hash_slot_t* slots() const {
+    return reinterpret_cast<hash_slot_t*>(base + sizeof(hash_index_header_t));
+  }
+
+  static size_t file_size(uint64_t capacity) {
+    return sizeof(hash_index_header_t) + capacity * sizeof(hash_slot_t);
+  }
+
+  static uint64_t capacity_for(uint64_t nb_values) {
+    uint64_t capacity = min_capacity;
+    // at most half full after a rebuild
+    while(capacity < 2 * nb_values) {
+      capacity *= 2;
+    }
+    return capacity;
+  }
+
+  void unmap() {
+#ifndef _WIN32
+    if(file_backed && base != nullptr) {
+      munmap(base, length);
+    }
+#endif
+    buffer.clear();
+    buffer.shrink_to_fit();
+    base = nullptr;
+    length = 0;
+  }
+
+  // Map (or read, on Windows) the file at p, with the given size.
+  // The file is extended with zeros if needed.
+  void map_file(const fs::path& p, size_t size, bool writable) {
+    int fd = ::open(p.string().c_str(), (writable ? O_CREAT | O_RDWR : O_RDONLY) | O_BINARY, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if(fd == -1) {
+      Rf_error("Impossible to open the hash index at %s: %s\n", p.string().c_str(), strerror(errno));
+    }
+#ifdef _WIN32
+    buffer.assign(size, std::byte(0));
+    size_t done = 0;
+    while(done < size) {
+      ssize_t res = pread(fd, buffer.data() + done, size - done, done);
+      if(res <= 0) {
+        break;// the rest stays zero
+      }
+      done += res;
+    }
+    base = buffer.data();
+#else
+    if(writable && ftruncate(fd, size) != 0) {
+      ::close(fd);
+      Rf_error("Impossible to resize the hash index at %s: %s\n", p.string().c_str(), strerror(errno));
+    }
+    void* addr = mmap(nullptr, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if(addr == MAP_FAILED) {
+      ::close(fd);
+      Rf_error("Impossible to map the hash index at %s: %s\n", p.string().c_str(), strerror(errno));
+    }
+    base = static_cast<std::byte*>(addr);
+#endif
+    ::close(fd);
+    length = size;
+    file_backed = true;
+  }
+
+  void create_in_memory(uint64_t capacity) {
+    unmap();
+    buffer.assign(file_size(capacity), std::byte(0));
+    base = buffer.data();
+    length = buffer.size();
+    file_backed = false;
+    init_header(capacity);
+  }
+
+  void init_header(uint64_t capacity) {
+    hash_index_header_t h;
+    h.magic = magic;
+    h.version = version;
+    h.capacity = capacity;
+    *header() = h;
+  }
+
+  // Check that the file at path can be used for the hashes
+  bool valid_file(uint64_t nb_values) const {
+    if(!fs::exists(path) || fs::file_size(path) < sizeof(hash_index_header_t)) {
+      return false;
+    }
+    hash_index_header_t h;
+    std::ifstream file(path, std::fstream::binary);
+    file.read(reinterpret_cast<char*>(&h), sizeof(h));
+    return file && h.magic == magic && h.version == version && h.clean == 1 &&
+      h.nb_values <= nb_values && fs::file_size(path) == file_size(h.capacity);
+  }
+
+  void insert_slot(hash_slot_t* table, uint64_t capacity, uint64_t position, uint64_t fingerprint, uint64_t index) {
+    uint64_t mask = capacity - 1;
+    for(uint64_t pos = position & mask ; ; pos = (pos + 1) & mask) {
+      if(table[pos].index == 0) {
+        table[pos].fingerprint = fingerprint;
+        table[pos].index = index + 1;
+        return;
+      }
+    }
+  }
+
+  // Double the capacity
+  void grow() {
+    uint64_t old_capacity = header()->capacity;
+    uint64_t new_capacity = 2 * old_capacity;
+    uint64_t nb_values = header()->nb_values;
+
+    std::vector<hash_slot_t> old_slots(slots(), slots() + old_capacity);
+
+    if(file_backed) {
+      // Build the new index next to the old one, and replace it
+      fs::path tmp_path = path;
+      tmp_path += ".tmp";
+      fs::remove(tmp_path);
+      unmap();
+      map_file(tmp_path, file_size(new_capacity), true);
+      init_header(new_capacity);
+      fill(old_slots, nb_values);
+      fs::rename(tmp_path, path);
+    }
+    else {
+      create_in_memory(new_capacity);
+      fill(old_slots, nb_values);
+    }
+  }
+
+  void fill(const std::vector<hash_slot_t>& old_slots, uint64_t nb_values) {
+    uint64_t capacity = header()->capacity;
+    for(const auto& slot : old_slots) {
+      if(slot.index != 0) {
+        // The position is not in the slot
+        insert_slot(slots(), capacity, hashes->read(slot.index - 1).high64, slot.fingerprint, slot.index - 1);
+      }
+    }
+    header()->nb_values = nb_values;
+  }
+
+  // Insert into the slots
+  void insert_slots(const sexp_hash& hash, uint64_t index) {
+    throw_assert(index == header()->nb_values);
+    // at most 3/4 full
+    if(4 * (header()->nb_values + 1) > 3 * header()->capacity) {
+      grow();
+    }
+    insert_slot(slots(), header()->capacity, hash.high64, hash.low64, index);
+    header()->nb_values++;
+  }
+
+  // Add the hashes that are not yet in the index
+  void catch_up() {
+    uint64_t n = hashes->nb_values();
+    for(uint64_t i = header()->nb_values; i < n; i++) {
+      insert_slots(hashes->read(i), i);
+    }
+  }
+
+  // Write the mapped index to disk, or the in-memory copy on Windows
+  void write_back() {
+#ifdef _WIN32
+    int fd = ::open(path.string().c_str(), O_CREAT | O_RDWR | O_BINARY, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    size_t written = 0;
+    while(fd != -1 && written < length) {
+      ssize_t res = pwrite(fd, base + written, length - written, written);
+      if(res <= 0) break;
+      written += res;
+    }
+    if(fd != -1) ::close(fd);
+#else
+    msync(base, length, MS_SYNC);
+#endif
+  }
+
+  void set_clean(bool clean) {
+    header()->clean = clean;
+#ifndef _WIN32
+    // The header is written before (or after) all the slots
+    msync(base, sizeof(hash_index_header_t), MS_SYNC);
+#endif
+  }
+
+  void ensure_ready() const {
+    if(!ready) {
+      // Only in read and merge modes, where the index is never modified otherwise
+      HashIndex* self = const_cast<HashIndex*>(this);
+      self->create_in_memory(capacity_for(hashes->nb_values()));
+      self->catch_up();
+      ready = true;
+    }
+  }
+
+public:
+  HashIndex() : pid(getpid()) {}
+  HashIndex(const HashIndex&) = delete;
+  HashIndex& operator=(const HashIndex&) = delete;
+
+  // hashes must stay alive as long as the index
+  void open(const fs::path& p, bool write, const FSizeMemoryViewTable<sexp_hash>& hash_table) {
+    path = p;
+    write_mode = write;
+    hashes = &hash_table;
+    uint64_t nb_values = hashes->nb_values();
+
+    bool valid = valid_file(nb_values);
+
+    if(write_mode) {
+      if(valid) {
+        hash_index_header_t h;
+        std::ifstream file(path, std::fstream::binary);
+        file.read(reinterpret_cast<char*>(&h), sizeof(h));
+        map_file(path, file_size(h.capacity), true);
+      }
+      else {
+        fs::remove(path);
+        map_file(path, file_size(capacity_for(nb_values)), true);
+        init_header(capacity_for(nb_values));
+      }
+      if(header()->nb_values < nb_values) {
+        set_clean(false);
+        catch_up();
+        write_back();
+      }
+      set_clean(true);
+      ready = true;
+    }
+    else if(valid) {
+      hash_index_header_t h;
+      std::ifstream file(path, std::fstream::binary);
+      file.read(reinterpret_cast<char*>(&h), sizeof(h));
+      if(h.nb_values == nb_values) {
+        map_file(path, file_size(h.capacity), false);
+        ready = true;
+      }
+    }
+  }
+
+  std::optional<uint64_t> find(const sexp_hash& hash) const {
+    ensure_ready();
+    uint64_t mask = header()->capacity - 1;
+    const hash_slot_t* table = slots();
+    for(uint64_t pos = hash.high64 & mask ; table[pos].index != 0 ; pos = (pos + 1) & mask) {
+      if(table[pos].fingerprint == hash.low64 && hashes->read(table[pos].index - 1) == hash) {
+        return table[pos].index - 1;
+      }
+    }
+    if(!recent.empty()) {
+      auto it = recent.find(hash);
+      if(it != recent.end()) {
+        return it->second;
+      }
+    }
+    return {};
+  }
+
+  // Values must be inserted in order, with new hashes
+  void insert(const sexp_hash& hash, uint64_t index) {
+    throw_assert(index == nb_values());
+    if(write_mode && file_backed) {
+      recent.emplace(hash, index);
+    }
+    else {
+      insert_slots(hash, index);
+    }
+  }
+
+  uint64_t nb_values() const {
+    return ready ? header()->nb_values + recent.size() : 0;
+  }
+
+  // Insert the values added since the last checkpoint into the file, and write it to disk.
+  // If the process crashes in the middle of it, the index is rebuilt at the next opening.
+  void checkpoint() {
+    if(base == nullptr || !write_mode || !file_backed || pid != getpid() || recent.empty()) {
+      return;
+    }
+    uint64_t first = header()->nb_values;
+    std::vector<const sexp_hash*> new_hashes(recent.size());
+    for(const auto& it : recent) {
+      new_hashes[it.second - first] = &it.first;
+    }
+
+    set_clean(false);
+    for(uint64_t i = 0; i < new_hashes.size(); i++) {
+      insert_slots(*new_hashes[i], first + i);
+    }
+    recent.clear();
+    write_back();
+    set_clean(true);
+  }
+
+  // Build the index again from the hashes table, for instance after it was truncated
+  void rebuild() {
+    if(hashes == nullptr || pid != getpid()) {
+      return;
+    }
+    unmap();
+    recent.clear();
+    ready = false;
+    if(write_mode) {
+      fs::remove(path);
+    }
+    open(path, write_mode, *hashes);
+  }
+
+  // Mark the index as closed properly and unmap it
+  void close() {
+    if(base == nullptr) {
+      return;
+    }
+    if(write_mode && file_backed && pid == getpid()) {
+      checkpoint();
+      header()->clean = 1;
+      write_back();
+    }
+    unmap();
+    recent.clear();
+    ready = false;
+  }
+
+  ~HashIndex() {
+    close();
+  }
+};
+
+#endif
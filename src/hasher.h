@@ -39,22 +39,6 @@ struct xxh128_hasher {
   }
 };
 
-struct xxh128_pointer_hasher {
-  std::size_t operator()(const sexp_hash* c) const
-  {
-    std::size_t result = 0;
-    hash_combine(result, c->low64);
-    hash_combine(result, c->high64);
-    return result;
-  }
-};
-
-struct xxh128_pointer_equal{
-  std::size_t operator()(const sexp_hash* h1, const sexp_hash* h2) const {
-    return XXH128_isEqual(*h1, *h2);;
-  }
-};
-
 
 struct string_pointer_hasher {
   std::size_t operator()(const std::string*  s) const {
@@ -13,7 +13,7 @@ extern SEXP run_testthat_tests(SEXP use_xml_sxp); // required for catch2, becaus
 static const R_CallMethodDef callMethods[] = {
 	/* name						casted ptr to function			# of args */
 	// Generic record related
-	{"open_db",			(DL_FUNC) &open_db,			3},
+	{"open_db",			(DL_FUNC) &open_db,			4},
 	{"close_db",		(DL_FUNC) &close_db,		1},
 	{"add_val",			(DL_FUNC) &add_val,			2},
 	{"add_val_origin",  (DL_FUNC) &add_val_origin,	6},
@@ -31,7 +31,7 @@ static const R_CallMethodDef callMethods[] = {
 	{"get_origins",    (DL_FUNC) &get_origins,      2},
 	{"get_origins_idx", (DL_FUNC) &get_origins_idx, 2},
 	{"path_db",         (DL_FUNC) &path_db,         1},
-	{"check_db",        (DL_FUNC) &check_db,        2},
+	{"check_db",        (DL_FUNC) &check_db,        3},
 	{"map_db",          (DL_FUNC) &map_db,          3},
 	{"filter_index_db",   (DL_FUNC) &filter_index_db, 3},
 	{"view_db",         (DL_FUNC) &view_db,         2},
@@ -43,6 +43,11 @@ static const R_CallMethodDef callMethods[] = {
 	{"build_indexes",  (DL_FUNC) &build_indexes,    1},
 	{"has_search_index",  (DL_FUNC) &has_search_index,  1},
 	{"write_mode",     (DL_FUNC) &write_mode,       1},
+	{"set_layout_db",  (DL_FUNC) &set_layout_db,    2},
+	{"compression_stats_db", (DL_FUNC) &compression_stats_db, 1},
+	{"compact_db", (DL_FUNC) &compact_db, 1},
+	{"set_max_call_ids_db", (DL_FUNC) &set_max_call_ids_db, 2},
+	{"set_checkpoint_db", (DL_FUNC) &set_checkpoint_db, 3},
 	{"query_from_value", (DL_FUNC) &query_from_value, 1},
 	{"query_from_plan", (DL_FUNC) &query_from_plan, 1},
 	{"close_query", (DL_FUNC) &close_query,         1},
@@ -53,6 +58,7 @@ static const R_CallMethodDef callMethods[] = {
 	{"merge_all_dbs", (DL_FUNC) &merge_all_dbs,     3},
 	{"values_from_origins", (DL_FUNC) &values_from_origins, 3},
 	{"values_from_calls", (DL_FUNC) &values_from_calls, 3},
+	{"type_signatures_db", (DL_FUNC) &type_signatures_db, 3},
 	{"run_testthat_tests", (DL_FUNC) &run_testthat_tests, 1},
 
 
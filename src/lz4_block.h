@@ -0,0 +1,267 @@
+#ifndef SXPDB_LZ4_BLOCK_H
+#define SXPDB_LZ4_BLOCK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <cassert>
+
+// Compressor and decompressor for the LZ4 block format
+// (https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md).
+// We only need raw blocks, not frames or streaming, so this is a compact, self-contained
+// implementation rather than the full liblz4.
+// The compressor is a greedy single-probe matcher, similar to LZ4 fast level 1.
+//
+// It optionally supports an external dictionary: matches can then refer to the end of
+// the dictionary, as if it was just before the input (as LZ4_compress_usingDict).
+// The same dictionary must be passed to decompress.
+class LZ4Codec {
+private:
+  static constexpr int hash_log = 12;
+  static constexpr size_t hash_size = 1 << hash_log;
+  static constexpr size_t min_match = 4;
+  static constexpr size_t last_literals = 5;// the last 5 bytes are always literals
+  static constexpr size_t mf_limit = 12;// the last match must start at least 12 bytes before the end
+  static constexpr size_t max_distance = 65535;
+
+  // Positions are stored as 1 + the position in the virtual stream of all the inputs
+  // compressed with this codec, so that the table never needs to be cleared:
+  // an entry is only valid if it points inside the current input.
+  std::vector<uint64_t> table;
+  uint64_t stream_pos = 0;
+
+  const std::byte* dict = nullptr;
+  size_t dict_size = 0;
+  std::vector<uint32_t> dict_table;// 1 + position in the dictionary, 0 if empty
+
+  static uint32_t read32(const std::byte* p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+  }
+
+  static uint32_t hash(uint32_t sequence) {
+    return (sequence * 2654435761U) >> (32 - hash_log);
+  }
+
+  static std::byte* write_length(std::byte* op, size_t length) {
+    while(length >= 255) {
+      *op++ = std::byte(255);
+      length -= 255;
+    }
+    *op++ = std::byte(length);
+    return op;
+  }
+
+  static std::byte* write_literals(std::byte* op, const std::byte* literals, size_t length, std::byte*& token) {
+    token = op++;
+    if(length >= 15) {
+      *token = std::byte(15 << 4);
+      op = write_length(op, length - 15);
+    }
+    else {
+      *token = std::byte(length << 4);
+    }
+    if(length > 0) {
+      std::memcpy(op, literals, length);
+    }
+    return op + length;
+  }
+
+public:
+  LZ4Codec() : table(hash_size, 0) {}
+
+  // Worst case size of the compressed output
+  static size_t compress_bound(size_t size) {
+    return size + size / 255 + 16;
+  }
+
+  // The dictionary is not copied and must outlive the codec.
+  // Only its last 64 KiB can be referenced.
+  void set_dictionary(const std::byte* d, size_t size) {
+    if(size > max_distance) {
+      d += size - max_distance;
+      size = max_distance;
+    }
+    dict = d;
+    dict_size = size;
+    dict_table.assign(hash_size, 0);
+    for(size_t i = 0; i + min_match <= dict_size ; i++) {
+      dict_table[hash(read32(dict + i))] = i + 1;
+    }
+  }
+
+  // dst must have room for compress_bound(size) bytes
+  // Returns the size of the compressed data.
+  size_t compress(const std::byte* src, size_t size, std::byte* dst) {
+    std::byte* op = dst;
+    std::byte* token = nullptr;
+    size_t anchor = 0;
+
+    if(size >= mf_limit + 1) {
+      const size_t match_start_limit = size - mf_limit;
+      const size_t match_end_limit = size - last_literals;
+      size_t ip = 0;
+
+      while(ip < match_start_limit) {
+        uint32_t sequence = read32(src + ip);
+        uint32_t h = hash(sequence);
+
+        uint64_t candidate = table[h];
+        table[h] = stream_pos + ip + 1;
+
+        size_t match_length = 0;
+        size_t offset = 0;
+
+        if(candidate > stream_pos && ip - (candidate - 1 - stream_pos) <= max_distance &&
+           read32(src + (candidate - 1 - stream_pos)) == sequence) {
+          size_t ref = candidate - 1 - stream_pos;
+          match_length = min_match;
+          while(ip + match_length < match_end_limit && src[ref + match_length] == src[ip + match_length]) {
+            match_length++;
+          }
+          // Extend backwards
+          while(ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+            ip--;
+            ref--;
+            match_length++;
+          }
+          offset = ip - ref;
+        }
+        else if(dict_size > 0 && dict_table[h] != 0) {
+          size_t ref = dict_table[h] - 1;
+          if(ip + dict_size - ref <= max_distance && read32(dict + ref) == sequence) {
+            match_length = min_match;
+            while(ref + match_length < dict_size && ip + match_length < match_end_limit &&
+                  dict[ref + match_length] == src[ip + match_length]) {
+              match_length++;
+            }
+            offset = ip + dict_size - ref;
+          }
+        }
+
+        if(match_length == 0) {
+          // skip faster on incompressible data
+          ip += 1 + ((ip - anchor) >> 6);
+          continue;
+        }
+
+        // Sequence: literals, then the match
+        op = write_literals(op, src + anchor, ip - anchor, token);
+        *op++ = std::byte(offset & 0xFF);
+        *op++ = std::byte(offset >> 8);
+        size_t ml = match_length - min_match;
+        if(ml >= 15) {
+          *token |= std::byte(15);
+          op = write_length(op, ml - 15);
+        }
+        else {
+          *token |= std::byte(ml);
+        }
+
+        ip += match_length;
+        anchor = ip;
+
+        // Fill the table for a position inside the match to find more matches
+        if(ip - 2 < match_start_limit) {
+          table[hash(read32(src + ip - 2))] = stream_pos + ip - 2 + 1;
+        }
+      }
+    }
+
+    // last literals
+    op = write_literals(op, src + anchor, size - anchor, token);
+
+    stream_pos += size + max_distance + 1;// make sure no entry from this input is valid for the next one
+
+    return op - dst;
+  }
+
+  // Decompress exactly size bytes into dst.
+  // Returns false if the compressed data is malformed.
+  static bool decompress(const std::byte* src, size_t src_size, std::byte* dst, size_t size,
+                         const std::byte* dict = nullptr, size_t dict_size = 0) {
+    size_t ip = 0;
+    size_t op = 0;
+
+    while(ip < src_size) {
+      uint8_t token = uint8_t(src[ip++]);
+
+      size_t literal_length = token >> 4;
+      if(literal_length == 15) {
+        uint8_t b;
+        do {
+          if(ip >= src_size) return false;
+          b = uint8_t(src[ip++]);
+          literal_length += b;
+        } while(b == 255);
+      }
+      if(ip + literal_length > src_size || op + literal_length > size) {
+        return false;
+      }
+      if(literal_length > 0) {
+        std::memcpy(dst + op, src + ip, literal_length);
+      }
+      ip += literal_length;
+      op += literal_length;
+
+      if(ip == src_size) {
+        break;// last sequence only has literals
+      }
+
+      if(ip + 2 > src_size) return false;
+      size_t offset = uint8_t(src[ip]) | (size_t(uint8_t(src[ip + 1])) << 8);
+      ip += 2;
+      if(offset == 0) return false;
+
+      size_t match_length = token & 15;
+      if(match_length == 15) {
+        uint8_t b;
+        do {
+          if(ip >= src_size) return false;
+          b = uint8_t(src[ip++]);
+          match_length += b;
+        } while(b == 255);
+      }
+      match_length += min_match;
+
+      if(op + match_length > size) {
+        return false;
+      }
+
+      if(offset > op) {
+        // The match starts in the dictionary
+        size_t in_dict = offset - op;
+        if(in_dict > dict_size) return false;
+        const std::byte* ref = dict + dict_size - in_dict;
+        size_t from_dict = std::min(in_dict, match_length);
+        std::memcpy(dst + op, ref, from_dict);
+        op += from_dict;
+        match_length -= from_dict;
+        // the rest of the match is at the beginning of the output
+        for(size_t i = 0; i < match_length; i++, op++) {
+          dst[op] = dst[i];
+        }
+      }
+      else {
+        const std::byte* ref = dst + op - offset;
+        if(offset >= match_length) {
+          std::memcpy(dst + op, ref, match_length);
+          op += match_length;
+        }
+        else {
+          // overlapping copy
+          for(size_t i = 0; i < match_length; i++, op++) {
+            dst[op] = ref[i];
+          }
+        }
+      }
+    }
+
+    return op == size;
+  }
+};
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef SXPDB_MAPPED_FILE_H
+#define SXPDB_MAPPED_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <filesystem>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "posix_compat.h" // O_BINARY, pread on Windows
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+namespace fs = std::filesystem;
+
+// Read-only memory mapping of (a prefix of) a table file.
+// Reads then become pointer arithmetic and the page cache is shared
+// between all the processes that open the same database.
+//
+// Windows does not have mmap; there, we fall back to reading the mapped range
+// into a heap buffer, which keeps the same interface (and the same semantics
+// as long as the file is not modified through the mapping, which we never do).
+class MappedFile {
+private:
+  const std::byte* ptr = nullptr;
+  size_t length = 0;
+#ifdef _WIN32
+  std::vector<std::byte> buffer;
+#endif
+public:
+  MappedFile() {}
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  // Map the first size bytes of the file open with fd.
+  // The file descriptor can be closed after the call.
+  // Returns false if the mapping failed (errno is set).
+  bool map(int fd, size_t size) {
+    unmap();
+    if(size == 0) {
+      // mmap does not accept 0-length mappings
+      return true;
+    }
+#ifdef _WIN32
+    buffer.resize(size);
+    size_t done = 0;
+    while(done < size) {
+      ssize_t res = pread(fd, buffer.data() + done, size - done, done);
+      if(res <= 0) {
+        buffer.clear();
+        return false;
+      }
+      done += res;
+    }
+    ptr = buffer.data();
+#else
+    void* addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if(addr == MAP_FAILED) {
+      return false;
+    }
+    ptr = static_cast<const std::byte*>(addr);
+#endif
+    length = size;
+    return true;
+  }
+
+  bool map(const fs::path& path) {
+    int fd = ::open(path.string().c_str(), O_RDONLY | O_BINARY);
+    if(fd == -1) {
+      return false;
+    }
+    bool res = map(fd, fs::file_size(path));
+    ::close(fd);
+    return res;
+  }
+
+  // Hint that the mapping will be read sequentially (merges, index building)
+  void advise_sequential() const {
+#if !defined(_WIN32) && defined(MADV_SEQUENTIAL)
+    if(length > 0) {
+      madvise(const_cast<std::byte*>(ptr), length, MADV_SEQUENTIAL);
+    }
+#endif
+  }
+
+  void unmap() {
+#ifdef _WIN32
+    buffer.clear();
+    buffer.shrink_to_fit();
+#else
+    if(ptr != nullptr) {
+      munmap(const_cast<std::byte*>(ptr), length);
+    }
+#endif
+    ptr = nullptr;
+    length = 0;
+  }
+
+  const std::byte* data() const { return ptr; }
+  size_t size() const { return length; }
+
+  ~MappedFile() {
+    unmap();
+  }
+};
+
+#endif
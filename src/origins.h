@@ -19,6 +19,8 @@
 #include <fstream>
 #include <tuple>
 #include <optional>
+#include <memory>
+#include <algorithm>
 #include <unistd.h>
 
 #include "table.h"
@@ -57,30 +59,228 @@ namespace std
   };
 }
 
+// A record of the origin log: a new origin for a value that was already in the base table
+struct origin_record_t {
+  uint64_t index = 0;
+  location_t loc;
+  uint32_t reserved = 0;// explicit padding, to write deterministic bytes
+
+  origin_record_t() {}
+  origin_record_t(uint64_t idx, const location_t& l) : index(idx), loc(l) {}
+
+  bool operator== (const origin_record_t& rec) const {
+    return index == rec.index && loc == rec.loc;
+  }
+};
+
+// A value passed to a parameter in a call: the origins and the call ids of a value
+// do not say at which location it was seen in each call.
+// The call index is built from these records (call_sites.bin).
+struct call_site_t {
+  uint64_t index = 0;
+  uint64_t call_id = 0;
+  location_t loc;
+  uint32_t reserved = 0;// explicit padding, to write deterministic bytes
+
+  call_site_t() {}
+  call_site_t(uint64_t idx, uint64_t id, const location_t& l) : index(idx), call_id(id), loc(l) {}
+};
+
+// Set of the locations of a value.
+// Most values have only 1 to 3 locations: they are stored inline, without any allocation.
+// Larger sets go to the heap, and get a hash set to detect duplicates only when they are
+// large enough for a linear search to be slow.
+class LocationSet {
+private:
+  static constexpr uint32_t inline_capacity = 3;
+  static constexpr size_t index_threshold = 32;
+
+  struct heavy_t {
+    std::vector<location_t> locs;
+    robin_hood::unordered_set<location_t> index;// empty under index_threshold
+  };
+
+  uint32_t nb_inline = 0;
+  location_t inline_locs[inline_capacity];
+  std::unique_ptr<heavy_t> heavy;
+
+public:
+  LocationSet() {}
+
+  LocationSet(Span<const location_t> locs) {
+    for(const auto& loc : locs) {
+      insert(loc);
+    }
+  }
+
+  // Returns false if the location was already there
+  bool insert(const location_t& loc) {
+    if(heavy) {
+      if(!heavy->index.empty()) {
+        if(!heavy->index.insert(loc).second) {
+          return false;
+        }
+      }
+      else if(std::find(heavy->locs.begin(), heavy->locs.end(), loc) != heavy->locs.end()) {
+        return false;
+      }
+      heavy->locs.push_back(loc);
+      if(heavy->index.empty() && heavy->locs.size() > index_threshold) {
+        heavy->index.insert(heavy->locs.begin(), heavy->locs.end());
+      }
+      return true;
+    }
+
+    if(std::find(inline_locs, inline_locs + nb_inline, loc) != inline_locs + nb_inline) {
+      return false;
+    }
+    if(nb_inline < inline_capacity) {
+      inline_locs[nb_inline++] = loc;
+    }
+    else {
+      heavy = std::make_unique<heavy_t>();
+      heavy->locs.reserve(2 * inline_capacity);
+      heavy->locs.insert(heavy->locs.end(), inline_locs, inline_locs + nb_inline);
+      heavy->locs.push_back(loc);
+      nb_inline = 0;
+    }
+    return true;
+  }
+
+  // Valid until the next insertion
+  Span<const location_t> view() const {
+    return heavy ? Span<const location_t>(heavy->locs) : Span<const location_t>(inline_locs, nb_inline);
+  }
+
+  bool empty() const { return !heavy && nb_inline == 0; }
+};
+
+// The origins of the values are stored in a base table (origins.bin), with the set of locations
+// of each value, and in an append-only log (origins_log.bin) of (value index, location) records,
+// for the origins of values of the base table that were added afterwards.
+// Closing the database then only appends the locations of the new values to the base table,
+// and the records to the log, instead of rewriting all the locations.
+// The log is merged when reading, and folded into the base table by compact().
+//
+// compact() and truncate() write a new generation of the base table (origins_<n>.bin), with an
+// empty log (origins_log_<n>.bin), and then switch to it by replacing origins_generation.conf.
+// After a crash, the database has either the old table and its log, or the new ones.
+//
+// Only the values that get new origins (or are new) are kept in memory.
 class Origins {
 private:
   pid_t pid;
 
-  std::vector<robin_hood::unordered_set<location_t>> locations;
+  std::unique_ptr<VSizeTable<std::vector<location_t>>> location_table;
+  std::unique_ptr<FSizeTable<origin_record_t>> origin_log;
+  uint64_t nb_base_values = 0;
+  uint64_t generation = 0;
+
+  // Locations, including the ones of the base table, of the values of the base table
+  // with records in the log
+  robin_hood::unordered_map<uint64_t, LocationSet> merged_locations;
+  // Locations of the values added since opening
+  std::vector<LocationSet> new_locations;
 
-  robin_hood::unordered_set<location_t> dummy_loc;
-  robin_hood::unordered_set<location_t> empty_loc;
-  mutable std::vector<location_t> current_loc;
+  location_t dummy_loc = location_t(0, 0, 0);
 
   UniqTextTable package_names;
   UniqTextTable function_names;
   UniqTextTable param_names;
 
-  std::unique_ptr<VSizeTable<std::vector<location_t>>> location_table;
-
-  bool new_origins;
   bool write_mode = false;
 
   fs::path base_path = "";
+
+  bool is_empty(Span<const location_t> locs) const {
+    return locs.empty() || (locs.size() == 1 && locs[0] == dummy_loc);
+  }
+
+  fs::path generation_conf_path() const {
+    return base_path / "origins_generation.conf";
+  }
+
+  fs::path generation_path(const std::string& name, uint64_t gen) const {
+    return base_path / (name + (gen == 0 ? "" : "_" + std::to_string(gen)) + ".bin");
+  }
+
+  // The base table, its offsets and the log of a generation
+  void remove_generation(uint64_t gen) const {
+    std::error_code ec;
+    fs::path table = generation_path("origins", gen);
+    fs::path offsets = table.parent_path() / (table.stem().string() + "_offsets.bin");
+    for(fs::path path : {table, offsets, generation_path("origins_log", gen)}) {
+      fs::remove(path, ec);
+      fs::remove(path.replace_extension(".conf"), ec);
+    }
+  }
+
+  void open_locations() {
+    // The tables close their file descriptors when they are destroyed
+    location_table.reset();
+    origin_log.reset();
+
+    generation = 0;
+    if(fs::exists(generation_conf_path())) {
+      Config conf(generation_conf_path());
+      generation = std::stoul(conf["generation"]);
+    }
+    if(write_mode && generation > 0) {
+      // Left by a crash after the switch
+      remove_generation(generation - 1);
+    }
+
+    location_table = std::make_unique<VSizeTable<std::vector<location_t>>>(generation_path("origins", generation), write_mode);
+    origin_log = std::make_unique<FSizeTable<origin_record_t>>(generation_path("origins_log", generation), write_mode);
+    nb_base_values = location_table->nb_values();
+
+    merged_locations.clear();
+    new_locations.clear();
+
+    for(uint64_t i = 0; i < origin_log->nb_values(); i++) {
+      const origin_record_t& rec = origin_log->read(i);
+      if(rec.index >= nb_base_values) {
+        Rf_error("Origin log refers to value %llu, but there are only %llu values in the origin table.\n",
+                 (unsigned long long) rec.index, (unsigned long long) nb_base_values);
+      }
+      add_merged_location(rec.index, rec.loc);
+    }
+  }
+
+  // Start tracking the locations of a value of the base table
+  LocationSet& merged_locs(uint64_t index) {
+    auto it = merged_locations.find(index);
+    if(it == merged_locations.end()) {
+      Span<const location_t> locs = location_table->read_view(index);
+      it = merged_locations.emplace(index, is_empty(locs) ? Span<const location_t>() : locs).first;
+    }
+    return it->second;
+  }
+
+  bool add_merged_location(uint64_t index, const location_t& loc) {
+    return merged_locs(index).insert(loc);
+  }
+
+  // Append the locations of the new values to the base table
+  void write_new_locations() {
+    std::vector<location_t> buf;
+    for(const auto& locs : new_locations) {
+      buf.clear();
+      if(locs.empty()) {
+        buf.push_back(dummy_loc);
+      } else {
+        buf.insert(buf.end(), locs.view().begin(), locs.view().end());
+      }
+      location_table->append(buf);
+    }
+    nb_base_values += new_locations.size();
+    new_locations.clear();
+  }
+
 public:
-  Origins() : pid(getpid()), dummy_loc({location_t(0, 0, 0)}) {}
+  Origins() : pid(getpid()) {}
 
-  Origins(const fs::path& base_path_, bool write = true) : pid(getpid()), dummy_loc({location_t(0, 0, 0)}) {
+  Origins(const fs::path& base_path_, bool write = true) : pid(getpid()) {
     open(base_path, write);
   }
 
@@ -88,36 +288,12 @@ public:
     write_mode = write;
     base_path = fs::absolute(base_path_);
 
-    location_table = std::make_unique<VSizeTable<std::vector<location_t>>>(base_path / "origins.bin", write_mode);
     package_names.open(base_path / "packages.bin", write_mode);
     function_names.open(base_path/ "functions.bin", write_mode);
     param_names.open(base_path/ "params.bin", write_mode);
 
-    if(write_mode) {
-      // Now populate the locations
-      locations.clear();
-      locations.resize(location_table->nb_values());
-      for(uint64_t i = 0; i < location_table->nb_values() ; i++) {
-        const std::vector<location_t>& locs = location_table->read(i);
-        locations[i].reserve(locs.size());
-        if(locs.size() > 1 || (locs.size() == 1 && !(locs[0] == location_t(0, 0, 0)))) {
-          locations[i].insert(locs.begin(), locs.end());
-#ifndef NDEBUG
-          for(const auto& loc : locs) {
-            assert(loc.package < package_names.nb_values());
-            assert(loc.function < function_names.nb_values());
-            assert(loc.param< param_names.nb_values());
-          }
-#endif
-        }
-        else {
-          assert(locations[i].empty());
-        }
-      }
-      // destroy the location table
-      // We will build it again in the destructor
-      location_table.reset();
-    }
+    open_locations();
+
     // inject empty strings in each table, at positions 0
     // it will be used for the empty origins
     if(package_names.nb_values() == 0) {
@@ -131,63 +307,73 @@ public:
     }
   }
 
-  void add_origin(uint64_t index, const std::string& package_name, const std::string& function_name, const std::string& param_name) {
+  // Ids of the names, which are added if they are new
+  location_t intern_location(const std::string& package_name, const std::string& function_name, const std::string& param_name) {
+    assert(write_mode);
+    return location_t(package_names.append_index(package_name),
+                      function_names.append_index(function_name),
+                      param_names.append_index(param_name));
+  }
+
+  // The location, and whether it is a new one for the value
+  std::pair<location_t, bool> add_origin(uint64_t index, const std::string& package_name, const std::string& function_name, const std::string& param_name) {
       assert(write_mode);
       assert(pid == getpid());
-      if(index > locations.size()) {
+      if(index > nb_values()) {
         Rf_error("Cannot add an origin for a value that was not recorded in the main table."
                    " Last index is %llu, but the index of that new origin is %llu.\n",
-                   (unsigned long long) locations.size(), (unsigned long long) index);
+                   (unsigned long long) nb_values(), (unsigned long long) index);
       }
 
-      location_t loc(package_names.append_index(package_name),
-                     function_names.append_index(function_name),
-                     param_names.append_index(param_name));
+      location_t loc = intern_location(package_name, function_name, param_name);
 
       // either the index is a value already seen, or it is a new one, and in that case, the index must size(), i.e.
       // just one past the last valid index
-      if(index < locations.size()) {
-          auto res = locations[index].insert(loc);
-        if(res.second) {
-          new_origins = true;
+      bool added;
+      if(index < nb_base_values) {
+        added = add_merged_location(index, loc);
+        if(added) {
+          origin_log->append(origin_record_t(index, loc));
         }
       }
-      else if(index == locations.size()) {
-          robin_hood::unordered_set<location_t> locs{loc};
-          locations.push_back(locs);
-          new_origins = true;
+      else {
+        if(index == nb_values()) {
+          new_locations.emplace_back();
+        }
+        added = new_locations[index - nb_base_values].insert(loc);
       }
+
+      return {loc, added};
   }
 
   void append_empty_origin() {
     assert(write_mode);
-    locations.push_back(empty_loc);
+    new_locations.emplace_back();
   }
 
-  const std::vector<location_t>& get_locs(uint64_t index) const {
-    if(write_mode) { // we read from memory
-      if(index < locations.size()) {
-        current_loc.clear();
-        auto locs_set = locations[index];
-        current_loc.insert(current_loc.end(), locs_set.begin(), locs_set.end());
-
-        return current_loc;
-      }
-      else {
-        current_loc.clear();
-        return current_loc;
-      }
+  // Does not copy anything: the view is valid until the next origin is added
+  Span<const location_t> get_locs(uint64_t index) const {
+    if(index >= nb_values()) {
+      return Span<const location_t>();
+    }
+    else if(index >= nb_base_values) {
+      return new_locations[index - nb_base_values].view();
     }
-    else {
-      auto& locs = location_table->read(index);
 
-      if(locs.size() > 1 || (locs.size() == 1 && !(locs[0] == location_t(0, 0, 0)))) {
-        return locs;
-      }
-      else {
-        return current_loc;// it should be empty by default as we are in read mode
+    if(!merged_locations.empty()) {
+      auto it = merged_locations.find(index);
+      if(it != merged_locations.end()) {
+        return it->second.view();
       }
     }
+
+    Span<const location_t> locs = location_table->read_view(index);
+    return is_empty(locs) ? Span<const location_t>() : locs;
+  }
+
+  // Map the base table: get_locs can then be called concurrently, as long as no origin is added
+  void map() const {
+    location_table->map();
   }
 
   const std::string& package_name(uint32_t i) const {return package_names.read(i); }
@@ -226,40 +412,96 @@ public:
   uint64_t nb_functions() const { return function_names.nb_values() - 1; }
   uint64_t nb_parameters() const { return param_names.nb_values() - 1; }
 
+  uint64_t nb_log_records() const { return origin_log->nb_values(); }
+
   const SEXP package_cache() const {return package_names.to_sexp(); }
   const SEXP function_cache() const {return function_names.to_sexp(); }
   const SEXP parameter_cache() const {return param_names.to_sexp();}
 
-  virtual ~Origins() {
-    if(write_mode && pid == getpid() && new_origins) {
-      {
-        fs::rename(base_path / "origins.bin", base_path / "origins-old.bin");
-        fs::rename(base_path / "origins.conf", base_path / "origins-old.conf");
-        fs::rename(base_path / "origins_offsets.bin", base_path / "origins_offsets-old.bin");
-        fs::rename(base_path / "origins_offsets.conf", base_path / "origins_offsets-old.conf");
-        //create a new table
-        VSizeTable<std::vector<location_t>> location_table(base_path / "origins.bin");
-        std::vector<location_t> buf;
-        for(const auto& loc : locations) {
-          buf.clear();
-          if(loc.empty()) {
-            buf.push_back(*dummy_loc.begin());
-          } else {
-            buf.insert(buf.end(), loc.begin(), loc.end());
-          }
-
-          location_table.append(buf);
-        }
-        location_table.flush(); // Should not be needed as we leave scope
+  // Fold the log into the base table, by rewriting it
+  void compact() {
+    throw_assert(write_mode);
+    // The log records refer to them
+    package_names.flush();
+    function_names.flush();
+    param_names.flush();
+
+    if(origin_log->nb_values() == 0) {
+      write_new_locations();
+      location_table->flush();
+      open_locations();
+      return;
+    }
+
+    rewrite(nb_values());
+  }
+
+  // Only keep the origins of the first n values.
+  // The log, which can refer to the removed values, is dropped in the same switch
+  // as the new base table: a crash cannot leave records past the end of the table.
+  void truncate(uint64_t n) {
+    throw_assert(write_mode);
+    if(n >= nb_values()) {
+      return;
+    }
+    package_names.flush();
+    function_names.flush();
+    param_names.flush();
+    rewrite(n);
+  }
 
-        fs::remove(base_path / "origins-old.bin");
-        fs::remove(base_path / "origins-old.conf");
-        fs::remove(base_path / "origins_offsets-old.bin");
-        fs::remove(base_path / "origins_offsets-old.conf");
+  // Write the locations of the first n values, with their log records, in a new generation
+  // of the base table, and start a new log
+  void rewrite(uint64_t n) {
+    uint64_t new_generation = generation + 1;
+    // Left by a crash before the switch
+    remove_generation(new_generation);
+    {
+      VSizeTable<std::vector<location_t>> new_table(generation_path("origins", new_generation));
+      std::vector<location_t> buf;
+      for(uint64_t i = 0; i < n; i++) {
+        Span<const location_t> locs = get_locs(i);
+        buf.clear();
+        if(locs.empty()) {
+          buf.push_back(dummy_loc);
+        } else {
+          buf.insert(buf.end(), locs.begin(), locs.end());
+        }
+        new_table.append(buf);
       }
+      new_table.flush();
+    }
+
+    // From now on, the new generation, with an empty log, is the valid one
+    Config conf({{"generation", std::to_string(new_generation)}});
+    conf.write(generation_conf_path());
+
+    location_table.reset();
+    origin_log.reset();
+    remove_generation(generation);
+
+    open_locations();
+  }
+
+  // Write the names, the log and the locations of the new values to disk.
+  // The new values are then part of the base table.
+  void flush() {
+    if(write_mode && pid == getpid()) {
+      // The log and the base table refer to the names
+      package_names.flush();
+      function_names.flush();
+      param_names.flush();
+
+      origin_log->flush();
+      write_new_locations();
+      location_table->flush();
     }
   }
 
+  virtual ~Origins() {
+    flush();
+  }
+
   void load_hashtables() {
     package_names.load_unique();
     function_names.load_unique();
@@ -271,12 +513,7 @@ public:
   }
 
   uint64_t nb_values() const {
-    if(write_mode) {
-      return locations.size();
-    }
-    else {
-      return location_table->nb_values();
-    }
+    return nb_base_values + new_locations.size();
   }
 };
 
@@ -0,0 +1,286 @@
+#ifndef SXPDB_PACKED_INDEX_H
+#define SXPDB_PACKED_INDEX_H
+
+#define R_NO_REMAP
+#include <R.h>
+#include <Rinternals.h>
+
+#include <vector>
+#include <filesystem>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <system_error>
+
+#include "roaring++.h"
+#include "mapped_file.h"
+#include "span.h"
+
+namespace fs = std::filesystem;
+
+// Families of bitmaps of the search index
+enum class index_family : uint32_t {
+  Types = 1,// key: the SEXPTYPE
+  Na = 2,
+  Class = 3,
+  Vector = 4,
+  Attributes = 5,
+  Ndims = 7,
+  Classnames = 8,// key: the class name id
+  Packages = 9,// key: the package id
+  Functions = 10,// key: the function id
+  // Bit-sliced indexes (key: the bit, or BitSlicedIndex::existence_key), in the order of range_column
+  RangeLength = 11,
+  RangeSize = 12,
+  RangeCalls = 13,
+  RangeRows = 14,
+  RangeAttributes = 15
+};
+
+struct packed_index_header_t {
+  uint64_t magic = 0;
+  uint32_t version = 0;
+  uint32_t reserved = 0;
+  uint64_t nb_entries = 0;
+  uint64_t directory_offset = 0;
+};
+
+struct packed_index_entry_t {
+  index_family family;
+  uint32_t reserved = 0;
+  uint64_t key = 0;
+  uint64_t offset = 0;// of the serialized bitmap in the file
+  uint64_t size = 0;
+
+  bool operator<(const packed_index_entry_t& other) const {
+    return family != other.family ? family < other.family : key < other.key;
+  }
+};
+
+// All the bitmaps of the search index in one file (search_index/index.pack):
+// a header, the bitmaps in the portable Roaring format, and a directory of the bitmaps,
+// sorted by family and key. The bitmaps and the directory start at multiples of 8 bytes.
+//
+// The file is memory mapped: opening it only reads the header and the directory, and
+// a bitmap is deserialized directly from the mapping when it is requested.
+// It is written as a whole to a temporary file, which then replaces the previous one.
+class PackedIndex {
+public:
+  static constexpr uint64_t magic = 0x4b41504244505853;// "SXPDBPAK"
+  static constexpr uint32_t version = 4;
+  static constexpr uint64_t alignment = 8;
+
+private:
+  fs::path path;
+  MappedFile mapping;
+  packed_index_header_t header;
+  const packed_index_entry_t* directory = nullptr;
+
+  const packed_index_entry_t* find(index_family family, uint64_t key) const {
+    packed_index_entry_t probe;
+    probe.family = family;
+    probe.key = key;
+    const packed_index_entry_t* end = directory + header.nb_entries;
+    const packed_index_entry_t* it = std::lower_bound(directory, end, probe);
+    return it != end && it->family == family && it->key == key ? it : nullptr;
+  }
+
+public:
+  PackedIndex() {}
+  PackedIndex(const PackedIndex&) = delete;
+  PackedIndex& operator=(const PackedIndex&) = delete;
+
+  // Returns false if the file does not exist or is not a valid packed index
+  bool open(const fs::path& p) {
+    close();
+    path = p;
+    if(!fs::exists(path) || fs::file_size(path) < sizeof(packed_index_header_t) || !mapping.map(path)) {
+      return false;
+    }
+    std::memcpy(&header, mapping.data(), sizeof(header));
+    uint64_t size = mapping.size();
+    if(header.magic != magic || header.version != version || header.directory_offset > size ||
+       header.directory_offset % alignment != 0 ||
+       header.nb_entries > (size - header.directory_offset) / sizeof(packed_index_entry_t)) {
+      close();
+      return false;
+    }
+    directory = reinterpret_cast<const packed_index_entry_t*>(mapping.data() + header.directory_offset);
+    for(uint64_t i = 0; i < header.nb_entries; i++) {
+      const packed_index_entry_t& entry = directory[i];
+      if(entry.offset > header.directory_offset || entry.size > header.directory_offset - entry.offset ||
+         entry.size < sizeof(uint64_t) || entry.offset % alignment != 0 || (i > 0 && !(directory[i - 1] < entry))) {
+        close();
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool is_open() const { return directory != nullptr; }
+
+  bool contains(index_family family, uint64_t key) const {
+    return is_open() && find(family, key) != nullptr;
+  }
+
+  // Empty if there is no such bitmap
+  roaring::Roaring64Map read(index_family family, uint64_t key) const {
+    const packed_index_entry_t* entry = is_open() ? find(family, key) : nullptr;
+    if(entry == nullptr) {
+      return roaring::Roaring64Map();
+    }
+    return roaring::Roaring64Map::readSafe(reinterpret_cast<const char*>(mapping.data() + entry->offset), entry->size);
+  }
+
+  // The serialized bitmap, valid until the file is closed. Empty if there is no such bitmap
+  Span<const std::byte> raw(index_family family, uint64_t key) const {
+    const packed_index_entry_t* entry = is_open() ? find(family, key) : nullptr;
+    if(entry == nullptr) {
+      return Span<const std::byte>();
+    }
+    return Span<const std::byte>(mapping.data() + entry->offset, entry->size);
+  }
+
+  // Keys of the bitmaps of a family, in increasing order
+  std::vector<uint64_t> keys(index_family family) const {
+    std::vector<uint64_t> res;
+    if(!is_open()) {
+      return res;
+    }
+    packed_index_entry_t probe;
+    probe.family = family;
+    const packed_index_entry_t* end = directory + header.nb_entries;
+    for(const packed_index_entry_t* it = std::lower_bound(directory, end, probe); it != end && it->family == family; it++) {
+      res.push_back(it->key);
+    }
+    return res;
+  }
+
+  const fs::path& get_path() const { return path; }
+
+  void close() {
+    mapping.unmap();
+    directory = nullptr;
+    header = packed_index_header_t();
+  }
+};
+
+// Writes a packed index. Bitmaps can be added in any order.
+// It does not raise R errors, as it also writes when the database is closed:
+// finish() says whether everything went well, and error() what went wrong otherwise.
+class PackedIndexWriter {
+private:
+  fs::path path;
+  fs::path tmp_path;
+  std::ofstream out;
+  std::vector<packed_index_entry_t> entries;
+  uint64_t pos = 0;
+  std::vector<char> buf;
+  std::string error_message;
+
+  void pad() {
+    static const char zeros[PackedIndex::alignment] = {};
+    uint64_t padding = (PackedIndex::alignment - pos % PackedIndex::alignment) % PackedIndex::alignment;
+    out.write(zeros, padding);
+    pos += padding;
+  }
+
+  void fail(const std::string& message) {
+    if(error_message.empty()) {
+      error_message = message;
+    }
+  }
+
+public:
+  PackedIndexWriter(const fs::path& p) : path(p), tmp_path(p) {
+    tmp_path += ".tmp";
+    out.open(tmp_path, std::fstream::binary | std::fstream::trunc);
+    if(!out) {
+      fail("Cannot create index file " + tmp_path.string() + ": " + strerror(errno) + ".\n");
+      return;
+    }
+    // The header is written at the end
+    packed_index_header_t header;
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    pos = sizeof(header);
+  }
+
+  void add(index_family family, uint64_t key, const roaring::Roaring64Map& index) {
+    if(!error_message.empty()) {
+      return;
+    }
+    size_t size = index.getSizeInBytes();
+    buf.resize(size);
+    size_t written = index.write(buf.data(), true);
+    if(size != written) {
+      fail("Incorrect number of bytes written for index " + path.string() + ": expected = " +
+           std::to_string(size) + " vs actual = " + std::to_string(written) + ".\n");
+      return;
+    }
+    add_raw(family, key, Span<const std::byte>(reinterpret_cast<const std::byte*>(buf.data()), size));
+  }
+
+  // A bitmap that is already serialized, for instance from another packed index
+  void add_raw(index_family family, uint64_t key, Span<const std::byte> bitmap) {
+    if(!error_message.empty()) {
+      return;
+    }
+    packed_index_entry_t entry;
+    entry.family = family;
+    entry.key = key;
+    entry.offset = pos;
+    entry.size = bitmap.size();
+    entries.push_back(entry);
+    out.write(reinterpret_cast<const char*>(bitmap.data()), bitmap.size());
+    pos += bitmap.size();
+    pad();
+  }
+
+  // Write the directory and the header, and replace the previous file.
+  // The new file is synced before the rename: after a crash, the path has either
+  // the previous index or the complete new one.
+  bool finish() {
+    if(error_message.empty()) {
+      std::sort(entries.begin(), entries.end());
+      packed_index_header_t header;
+      header.magic = PackedIndex::magic;
+      header.version = PackedIndex::version;
+      header.nb_entries = entries.size();
+      header.directory_offset = pos;
+      out.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(packed_index_entry_t));
+      out.seekp(0);
+      out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+      out.close();
+      if(!out) {
+        fail("Cannot write index file " + tmp_path.string() + ".\n");
+      }
+    }
+    if(error_message.empty()) {
+      int fd = ::open(tmp_path.string().c_str(), O_RDWR | O_BINARY);
+      if(fd == -1 || fdatasync(fd) != 0) {
+        fail("Cannot sync index file " + tmp_path.string() + ": " + strerror(errno) + ".\n");
+      }
+      if(fd != -1) {
+        ::close(fd);
+      }
+    }
+    std::error_code ec;
+    if(error_message.empty()) {
+      fs::rename(tmp_path, path, ec);
+      if(ec) {
+        fail("Cannot replace index file " + path.string() + ": " + ec.message() + ".\n");
+      }
+    }
+    if(!error_message.empty()) {
+      fs::remove(tmp_path, ec);
+      return false;
+    }
+    return true;
+  }
+
+  const std::string& error() const { return error_message; }
+};
+
+#endif
@@ -52,4 +52,12 @@ ssize_t pwrite(int fd, const void* buf, size_t count, uint64_t offset) {
   return static_cast<ssize_t>(put);
 }
 
+int fdatasync(int fd) {
+  return _commit(fd);
+}
+
+int sync_filesystem(int fd) {
+  return _commit(fd);
+}
+
 #endif // _WIN32
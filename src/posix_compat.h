@@ -23,6 +23,28 @@
 #define O_BINARY 0
 #endif
 
+// --- fdatasync / file system sync --------------------------------------------
+// The write-ahead log syncs its records with fdatasync, and checkpoints sync the
+// whole file system of the database with sync_filesystem (syncfs on Linux, sync
+// elsewhere). macOS has the fdatasync system call but does not declare it.
+#ifdef __APPLE__
+#define fdatasync fsync
+#endif
+
+#ifndef _WIN32
+#include <unistd.h>
+
+inline int sync_filesystem(int fd) {
+#ifdef __linux__
+  return syncfs(fd);
+#else
+  (void) fd;
+  sync();
+  return 0;
+#endif
+}
+#endif
+
 #ifdef _WIN32
 
 #include <sys/types.h> // ssize_t
@@ -64,6 +86,12 @@ long sysconf(int name);
 ssize_t pread(int fd, void* buf, size_t count, uint64_t offset);
 ssize_t pwrite(int fd, const void* buf, size_t count, uint64_t offset);
 
+// --- fdatasync / sync_filesystem --------------------------------------------
+// fdatasync is _commit. There is no equivalent of syncfs: sync_filesystem only
+// commits the given file.
+int fdatasync(int fd);
+int sync_filesystem(int fd);
+
 #endif // _WIN32
 
 #endif // SXPDB_POSIX_COMPAT_H
@@ -0,0 +1,72 @@
+#ifndef SXPDB_POSTING_INDEX_H
+#define SXPDB_POSTING_INDEX_H
+
+#include <vector>
+#include <algorithm>
+
+#include "roaring++.h"
+#include "robin_hood.h"
+
+#include "packed_index.h"
+
+// One exact bitmap per id (class name, function...) of a family of the packed index:
+// the values with that id. Looking up an id is a binary search in the directory of
+// the packed index, and reading only that bitmap.
+//
+// The bitmaps that get new values are kept in memory; the other ones stay in the packed
+// index, and are copied without being deserialized when writing a new one.
+class PostingIndex {
+private:
+  const PackedIndex& pack;
+  index_family family;
+
+  // Bitmaps that have changed since the packed index was written
+  robin_hood::unordered_map<uint64_t, roaring::Roaring64Map> postings;
+
+public:
+  PostingIndex(const PackedIndex& pack_, index_family family_) : pack(pack_), family(family_) {}
+
+  // Empty if there is no value with that id
+  roaring::Roaring64Map get(uint64_t id) const {
+    auto it = postings.find(id);
+    return it != postings.end() ? it->second : pack.read(family, id);
+  }
+
+  void add(uint64_t id, const roaring::Roaring64Map& values) {
+    auto it = postings.find(id);
+    if(it == postings.end()) {
+      it = postings.emplace(id, pack.read(family, id)).first;
+    }
+    it->second |= values;
+  }
+
+  // Add the values of each id, given by their position in the vector
+  void add(const std::vector<roaring::Roaring64Map>& values) {
+    for(uint64_t id = 0; id < values.size(); id++) {
+      if(!values[id].isEmpty()) {
+        add(id, values[id]);
+      }
+    }
+  }
+
+  // Write all the bitmaps, before the packed index they come from is replaced
+  void write(PackedIndexWriter& writer) {
+    for(auto& posting : postings) {
+      posting.second.runOptimize();
+      posting.second.shrinkToFit();
+      writer.add(family, posting.first, posting.second);
+    }
+    for(uint64_t id : pack.keys(family)) {
+      if(postings.find(id) == postings.end()) {
+        writer.add_raw(family, id, pack.raw(family, id));
+      }
+    }
+  }
+
+  // Forget the changes. With a closed packed index, it is then empty
+  void clear() {
+    postings.clear();
+  }
+};
+
+#endif
@@ -16,6 +16,8 @@ void Query::update(const Database& db) {
     Rprintf("Updating the search index for the query.\n");
   }
 
+  // Only the bitmaps used by the query are read from the index
+  search_index.load(index_group::Types);
   if(type != UNIONTYPE) {
     // type == ANYSXP, it should give an index that is the full database
     index_cache |= search_index.types_index[type];
@@ -28,6 +30,10 @@ void Query::update(const Database& db) {
   }
 
 
+  if(has_class || has_attributes || is_vector || has_na) {
+    search_index.load(index_group::Flags);
+  }
+
   if(has_class && has_class.value()) {
     index_cache &= search_index.class_index;
   }
@@ -76,30 +82,23 @@ void Query::update(const Database& db) {
     index_cache &= nonna;
   }
 
+  bool has_ranges = std::any_of(ranges.begin(), ranges.end(), [](const auto& range) {return range.has_value(); });
+  if(length || has_ranges) {
+    search_index.load(index_group::Ranges);
+  }
+
   if(length) {
-    auto low_bound = std::lower_bound(search_index.length_intervals.begin(), search_index.length_intervals.end(), length.value());
-    if(low_bound == search_index.length_intervals.end()) {
-     // Then it is in the last bin. Use an end-relative iterator rather than
-     // &back(): a raw pointer only converts to the container's iterator on
-     // libstdc++ (where they coincide), not on libc++ (wasm/webR, macOS),
-     // where the iterator is a wrapper type.
-     low_bound = search_index.length_intervals.end() - 1;
-    }
-    int length_idx = std::distance(SearchIndex::length_intervals.begin(), low_bound);
-    // Check if the index_cache in that slot represents one length or several ones
-    // Either it is the last slot or the length difference is > 1
-    if( length_idx == SearchIndex::nb_intervals - 1 || SearchIndex::length_intervals.at(length_idx + 1) - SearchIndex::length_intervals.at(length_idx) > 1) {
-      // we manually build an index_cache for the given length
-      // it will perform a linear search but there should not be more than 10^2 elements in those slots anyway
-      roaring::Roaring64Map precise_length_index = search_index.search_length(db, search_index.lengths_index[length_idx], length.value());
-      index_cache &= precise_length_index;
-    }
-    else {
-      index_cache &= search_index.lengths_index[length_idx];
+    index_cache &= search_index.range_indexes[static_cast<int>(range_column::Length)].equal(length.value());
+  }
+
+  for(int i = 0; i < SearchIndex::nb_range_columns; i++) {
+    if(ranges[i]) {
+      index_cache &= search_index.range_indexes[i].range(ranges[i]->min, ranges[i]->max);
     }
   }
 
   if(ndims) {
+    search_index.load(index_group::Ndims);
     int n_dims = ndims.value();
     if(n_dims > 4) {
       roaring::Roaring64Map precise_ndims_index = search_index.search_ndims(db, search_index.ndims_index[5], n_dims);
@@ -115,14 +114,7 @@ void Query::update(const Database& db) {
     std::optional<uint32_t> class_id = db.classes.get_class_id(class_name);
 
     if(class_id.has_value()) {
-      auto res = search_index.classnames_index.get_index(*class_id);
-      if(res.second) {
-        index_cache &= res.first;
-      }
-      else {// we need to refine and search inside the bin
-        auto precise_classname_index = search_index.search_classname(db, res.first, *class_id);
-        index_cache &= precise_classname_index;
-      }
+      index_cache &= search_index.classnames_index.get(*class_id);
     }
   }
   
@@ -130,6 +122,9 @@ void Query::update(const Database& db) {
   assert((packages.size() == 0 && functions.size() == 0) || db.origins.is_loaded());
 
 
+  if(!packages.empty()) {
+    search_index.load(index_group::Packages);
+  }
   for(const std::string& package_name : packages) {
     auto pkg_id = db.origins.package_id(package_name);
 
@@ -143,21 +138,7 @@ void Query::update(const Database& db) {
     auto fun_id = db.origins.function_id(function_name);
 
     if(fun_id.has_value()) {
-      int bin_index = -1;
-      for(int i = 0 ; i < search_index.function_index.size() ; i ++) {
-        if(search_index.function_index[i].first > fun_id.value()) {
-          bin_index = i;
-          break;
-        }
-      }
-      if(bin_index == -1) {
-        bin_index = search_index.function_index.size() - 1;
-      }
-
-      if(bin_index >= 0) { // function index not empty
-          auto fun_index = search_index.search_function(db, search_index.function_index[bin_index].second, fun_id.value());
-          index_cache &= fun_index;
-      }
+      index_cache &= search_index.function_index.get(fun_id.value());
     }
   }
 
@@ -14,6 +14,9 @@
 #include <string>
 #include <algorithm>
 #include <random>
+#include <array>
+#include <limits>
+#include <cmath>
 
 #ifdef SXPDB_PARALLEL_STD
 #include <execution>
@@ -38,6 +41,16 @@ struct std::iterator_traits<roaring::Roaring64MapSetBitForwardIterator> {
   typedef roaring::Roaring64MapSetBitForwardIterator type_of_iterator;
 };
 
+// Bounds included
+struct value_range_t {
+  uint64_t min = 0;
+  uint64_t max = std::numeric_limits<uint64_t>::max();
+
+  bool operator==(const value_range_t& other) const {
+    return min == other.min && max == other.max;
+  }
+};
+
 /**
  * Description of a value (aka type...)
  *
@@ -58,6 +71,7 @@ public:
   std::optional<bool> has_class;
   std::optional<uint64_t> length;
   std::optional<int> ndims; // 2 = matrix, 0 = nothing, otherwise = array
+  std::array<std::optional<value_range_t>, SearchIndex::nb_range_columns> ranges;// by range_column
   std::vector<std::string> class_names;
   std::vector<std::string> packages;
   std::vector<std::string> functions;
@@ -111,7 +125,13 @@ public:
 
   void relax_na() {has_na.reset();}
   void relax_vector() {is_vector.reset();}
-  void relax_length() {length.reset();}
+  void relax_length() {length.reset(); relax_range(range_column::Length);}
+  void relax_range(range_column column) {ranges[static_cast<int>(column)].reset(); }
+  void relax_ranges() {
+    for(auto& range : ranges) {
+      range.reset();
+    }
+  }
   void relax_attributes() {has_attributes.reset(); }
   void relax_ndims() {ndims.reset(); }
   void relax_class() {has_class.reset(); class_names.clear();}
@@ -152,6 +172,33 @@ public:
     return d;
   }
 
+  // An exact value, or c(min, max), with bounds included. Inf is no upper bound.
+  inline static value_range_t range_from_plan(const std::string& name, SEXP bounds) {
+    R_xlen_t n = Rf_xlength(bounds);
+    if(!Rf_isNumeric(bounds) || (n != 1 && n != 2)) {
+      Rf_error("Expecting a number or a vector c(min, max) for %s.\n", name.c_str());
+    }
+    SEXP bounds_real = PROTECT(Rf_coerceVector(bounds, REALSXP));
+    double min = REAL(bounds_real)[0];
+    double max = REAL(bounds_real)[n - 1];
+    UNPROTECT(1);
+    if(ISNAN(min) || ISNAN(max)) {
+      Rf_error("The bounds for %s cannot be NA.\n", name.c_str());
+    }
+
+    value_range_t range;
+    if(max < 0 || min > max) {
+      // Nothing matches
+      range.min = 1;
+      range.max = 0;
+      return range;
+    }
+    range.min = min <= 0 ? 0 : static_cast<uint64_t>(std::ceil(min));
+    // 2^64 is the first double that does not fit
+    range.max = max >= 18446744073709551616.0 ? std::numeric_limits<uint64_t>::max() : static_cast<uint64_t>(std::floor(max));
+    return range;
+  }
+
   // Creates a query from a query plan (a plain R list)
   inline static const Query from_plan(SEXP plan, bool quiet = true) {
     if(!Rf_isVectorList(plan)) {
@@ -174,7 +221,24 @@ public:
         d.is_vector = Rf_asLogical(cur_sexp);
       }
       else if (cur_name == "length") {
-        d.length = Rf_asInteger(cur_sexp);
+        if(Rf_xlength(cur_sexp) == 2) {
+          d.ranges[static_cast<int>(range_column::Length)] = range_from_plan(cur_name, cur_sexp);
+        }
+        else {
+          d.length = Rf_asInteger(cur_sexp);
+        }
+      }
+      else if(cur_name == "size") {
+        d.ranges[static_cast<int>(range_column::Size)] = range_from_plan(cur_name, cur_sexp);
+      }
+      else if(cur_name == "n_calls") {
+        d.ranges[static_cast<int>(range_column::Calls)] = range_from_plan(cur_name, cur_sexp);
+      }
+      else if(cur_name == "n_rows") {
+        d.ranges[static_cast<int>(range_column::Rows)] = range_from_plan(cur_name, cur_sexp);
+      }
+      else if(cur_name == "n_attributes") {
+        d.ranges[static_cast<int>(range_column::Attributes)] = range_from_plan(cur_name, cur_sexp);
       }
       else if(cur_name == "classname") {
         d.has_class = true;
@@ -238,6 +302,11 @@ public:
     if(d1.ndims && d2.ndims && *d1.ndims == *d1.ndims) {
       d.ndims = d1.ndims;
     }
+    for(int i = 0; i < SearchIndex::nb_range_columns; i++) {
+      if(d1.ranges[i] && d2.ranges[i] && *d1.ranges[i] == *d2.ranges[i]) {
+        d.ranges[i] = d1.ranges[i];
+      }
+    }
 
     // We do not deduplicate descriptions here
     if(d1.type == UNIONTYPE) {
@@ -7,9 +7,31 @@
 #include <future>
 #include <thread>
 #include <chrono>
+#include <algorithm>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
 using namespace std::chrono_literals;
 
+// The indexes with a running prefetch thread.
+// A thread that is inside call_once for a group when the process forks leaves its flag
+// locked forever in the child: the threads are joined before forking.
+static std::mutex prefetching_mutex;
+static std::vector<SearchIndex*> prefetching;
+
+void SearchIndex::join_prefetch_threads() {
+  std::lock_guard<std::mutex> lock(prefetching_mutex);
+  for(SearchIndex* index : prefetching) {
+    index->prefetch_thread.join();
+  }
+  prefetching.clear();
+}
+
 void SearchIndex::open_from_config(const fs::path& base_path, const Config& config) {
+  // Where the indexes are written once they are built
+  packed_index_path = base_path / "search_index" / "index.pack";
+  calls_index_path = base_path / "search_index" / "calls_index.bin";
+
   last_computed = std::stoul(config["index_last_computed"]);
   index_generated = std::stoi(config["index_generated"]) != 0;
 
@@ -17,17 +39,137 @@ void SearchIndex::open_from_config(const fs::path& base_path, const Config& conf
     return;
   }
 
+  // Databases with indexes built before the call index do not have it yet
+  if(config.has_key("calls_index")) {
+    calls_index_path = base_path / config["calls_index"];
+    calls_index.open(calls_index_path);
+  }
+
+  if(!config.has_key("search_index")) {
+    open_legacy(base_path, config);
+    return;
+  }
+
+  packed_index_path = base_path / config["search_index"];
+  if(!packed_index.open(packed_index_path)) {
+    Rf_warning("Invalid search index at %s. It will be rebuilt at the next build of the indexes.\n", packed_index_path.string().c_str());
+    last_computed = 0;
+    index_generated = false;
+    return;
+  }
+  // The bitmaps are read when they are first needed
+  new_elements = true;
+
+  if(fs::exists(updated_values_path())) {
+    updated_values = read_index(updated_values_path());
+  }
+  if(fs::exists(n_calls_updated_path())) {
+    n_calls_updated = read_index(n_calls_updated_path());
+  }
+}
+
+void SearchIndex::read_group(index_group group) {
+  switch(group) {
+  case index_group::Types:
+    for(int i = 0; i < nb_sexptypes; i++) {
+      types_index[i] = packed_index.read(index_family::Types, i);
+    }
+    break;
+  case index_group::Flags:
+    na_index = packed_index.read(index_family::Na, 0);
+    class_index = packed_index.read(index_family::Class, 0);
+    vector_index = packed_index.read(index_family::Vector, 0);
+    attributes_index = packed_index.read(index_family::Attributes, 0);
+    break;
+  case index_group::Ndims:
+    for(int i = 0; i < nb_ndims; i++) {
+      ndims_index[i] = packed_index.read(index_family::Ndims, i);
+    }
+    break;
+  case index_group::Packages: {
+    std::vector<uint64_t> packages = packed_index.keys(index_family::Packages);
+    packages_index.clear();
+    packages_index.resize(packages.empty() ? 0 : packages.back() + 1);
+    for(uint64_t pkg : packages) {
+      packages_index[pkg] = packed_index.read(index_family::Packages, pkg);
+    }
+    break;
+  }
+  case index_group::Ranges:
+    for(int i = 0; i < nb_range_columns; i++) {
+      range_indexes[i].read(packed_index, range_family(static_cast<range_column>(i)));
+    }
+    break;
+  }
+}
+
+void SearchIndex::load_all() const {
+  for(int i = 0; i < nb_groups; i++) {
+    load(static_cast<index_group>(i));
+  }
+}
+
+void SearchIndex::mark_loaded() {
+  for(auto& flag : loaded) {
+    std::call_once(flag, [] {});
+  }
+}
+
+void SearchIndex::prefetch() {
+  if(!packed_index.is_open() || prefetch_thread.joinable()) {
+    return;
+  }
+#ifndef _WIN32
+  static std::once_flag atfork_registered;
+  std::call_once(atfork_registered, [] {
+    pthread_atfork(&SearchIndex::join_prefetch_threads, nullptr, nullptr);
+  });
+#endif
+  std::lock_guard<std::mutex> lock(prefetching_mutex);
+  prefetch_thread = std::thread([this] {
+    // A group that fails to be read will be read again, and report the error,
+    // when it is needed in the main thread
+    try {
+      load_all();
+    }
+    catch(...) {}
+  });
+  prefetching.push_back(this);
+}
+
+void SearchIndex::stop_prefetch() {
+  {
+    std::lock_guard<std::mutex> lock(prefetching_mutex);
+    prefetching.erase(std::remove(prefetching.begin(), prefetching.end(), this), prefetching.end());
+  }
+  if(prefetch_thread.joinable()) {
+    // The thread does not exist anymore in a forked process
+    if(pid == getpid()) {
+      prefetch_thread.join();
+    }
+    else {
+      prefetch_thread.detach();
+    }
+  }
+}
 
-  types_index_path = base_path / config["types_index"];
-  na_index_path = base_path / config["na_index"];
-  class_index_path = base_path / config["class_index"];
-  vector_index_path = base_path / config["vector_index"];
-  attributes_index_path = base_path / config["vector_index"];
-  lengths_index_path = base_path / config["lengths_index"];
-  ndims_index_path = base_path / config["ndims_index"];
-  classnames_index_path = base_path / config["classnames_index"];
-  packages_index_path = base_path / config["packages_index"];
-  functions_index_path = base_path / config["functions_index"];
+void SearchIndex::open_legacy(const fs::path& base_path, const Config& config) {
+  // All the bitmaps are read now, and converted to a packed index when closing
+  legacy_files = true;
+  dirty = true;
+  mark_loaded();
+  // The lengths, class names and functions were in bins, with values of several of them: they are not read,
+  // and the next build goes through all the values again. It only adds what is missing
+  // to the other bitmaps.
+  last_computed = 0;
+
+  fs::path types_index_path = base_path / config["types_index"];
+  fs::path na_index_path = base_path / config["na_index"];
+  fs::path class_index_path = base_path / config["class_index"];
+  fs::path vector_index_path = base_path / config["vector_index"];
+  fs::path attributes_index_path = config.has_key("attributes_index") ? base_path / config["attributes_index"] : fs::path();
+  fs::path ndims_index_path = base_path / config["ndims_index"];
+  fs::path packages_index_path = base_path / config["packages_index"];
 
 
   if(!types_index_path.empty()) {
@@ -57,13 +199,6 @@ void SearchIndex::open_from_config(const fs::path& base_path, const Config& conf
     new_elements = true;
   }
 
-  if(!lengths_index_path.empty()) {
-    for(int i = 0; i < nb_intervals; i++) {
-      lengths_index[i] = read_index(lengths_index_path.parent_path() / (lengths_index_path.stem().string() + "_" + std::to_string(i) + ".ror"));
-      new_elements = true;
-    }
-  }
-
   if(!ndims_index_path.empty()) {
     for(int i = 0; i < nb_ndims; i++) {
       ndims_index[i] = read_index(ndims_index_path.parent_path() / (ndims_index_path.stem().string() + "_" + std::to_string(i) + ".ror"));
@@ -71,10 +206,6 @@ void SearchIndex::open_from_config(const fs::path& base_path, const Config& conf
     }
   }
 
-  if(!classnames_index_path.empty()) {
-    classnames_index.open(classnames_index_path);
-    new_elements = true;
-  }
 
   if(!packages_index_path.empty()) {
     int nb_packages = 0;
@@ -98,30 +229,11 @@ void SearchIndex::open_from_config(const fs::path& base_path, const Config& conf
     }
   }
 
-   if(!functions_index_path.empty()) {
-    for(auto dir : fs::directory_iterator(functions_index_path.parent_path())) {
-      if(dir.is_regular_file()) {
-        auto path = dir.path();
-        if(path.extension() == ".ror") {
-          std::string name = path.stem().string();
-          // Check if it is a function index
-          if(name.rfind("functions_index", 0) == 0) {
-            // Extract the max index of the function from the bin
-            uint64_t nim_fun = std::stoul(name.substr(name.rfind('_') + 1));
-            //TODO: we should actually replace the index instead of adding it (suggests to use a hashtable...)
-            function_index.push_back({nim_fun, read_index(path)});
-            new_elements = true;
-          }
-        }
-      }
-    }
-  }
-
 }
 
 
 const std::vector<std::pair<std::string, roaring::Roaring64Map>> SearchIndex::build_indexes_static_meta(const Database& db, uint64_t start, uint64_t end) {
-  std::vector<std::pair<std::string,  roaring::Roaring64Map>> results(SearchIndex::nb_sexptypes + 2 + SearchIndex::nb_intervals + SearchIndex::nb_ndims);
+  std::vector<std::pair<std::string,  roaring::Roaring64Map>> results(SearchIndex::nb_sexptypes + 2 + SearchIndex::nb_ndims);
   int k = 0;
   for(k =0 ; k < SearchIndex::nb_sexptypes ; k++) {
     results[k].first = "type_index";
@@ -131,10 +243,6 @@ const std::vector<std::pair<std::string, roaring::Roaring64Map>> SearchIndex::bu
   results[k].first = "attributes_index";
   k++;
   int beg = k;
-  for(;k < beg + SearchIndex::nb_intervals; k++) {
-    results[k].first = "length_index";
-  }
-  beg = k;
   for(;k < beg + SearchIndex::nb_ndims; k++) {
     results[k].first = "ndims_index";
   }
@@ -151,16 +259,8 @@ const std::vector<std::pair<std::string, roaring::Roaring64Map>> SearchIndex::bu
       results[SearchIndex::nb_sexptypes + 1].second.add(i);
     }
 
-    auto it = std::lower_bound(SearchIndex::length_intervals.begin(), SearchIndex::length_intervals.end(), meta.length);
-    int length_idx = SearchIndex::length_intervals.size() - 1;
-    if(it != SearchIndex::length_intervals.end()) {
-      length_idx = it - SearchIndex::length_intervals.begin();
-    }
-
-    results[SearchIndex::nb_sexptypes + 2  + length_idx].second.add(i);
-
     int ndims_idx = std::min(meta.n_dims, (uint32_t) 5);// values with dim > 4 are grouped into the same bin. They should not be common
-    results[SearchIndex::nb_sexptypes + 2  + SearchIndex::nb_intervals + ndims_idx].second.add(i);
+    results[SearchIndex::nb_sexptypes + 2  + ndims_idx].second.add(i);
 
   }
 
@@ -173,44 +273,37 @@ const std::vector<std::pair<std::string, roaring::Roaring64Map>> SearchIndex::bu
 }
 
 
-const std::vector<std::pair<std::string, roaring::Roaring64Map>> SearchIndex::build_indexes_values(const Database& db, uint64_t start, uint64_t end) {
-  std::vector<std::pair<std::string, roaring::Roaring64Map>> results;
-  results.push_back({"na_index",roaring::Roaring64Map()});
-
-
-
-  for(uint64_t i = start; i < end ; i++) {
-    const std::vector<std::byte>& buf = db.sexp_table.read(i);
-
-    const sexp_view_t sexp_view = Serializer::unserialize_view(buf);
-
-    if(find_na(sexp_view)) {
-      results[0].second.add(i);
-    }
-
-  }
+std::array<BitSlicedIndex, SearchIndex::nb_range_columns> SearchIndex::build_indexes_ranges(const Database& db, uint64_t start, uint64_t end) {
+  std::array<BitSlicedIndex, nb_range_columns> results;
 
-  for(auto& result : results) {
-    result.second.runOptimize();
-    result.second.shrinkToFit();
+  for(uint64_t i = start; i < end; i++) {
+    const auto& meta = db.static_meta.read(i);
+    results[static_cast<int>(range_column::Length)].add(i, meta.length);
+    results[static_cast<int>(range_column::Size)].add(i, meta.size);
+    results[static_cast<int>(range_column::Calls)].add(i, db.runtime_meta.read(i).n_calls);
+    results[static_cast<int>(range_column::Rows)].add(i, meta.n_rows);
+    results[static_cast<int>(range_column::Attributes)].add(i, meta.n_attributes);
   }
 
   return results;
 }
 
-const std::vector<std::pair<std::string, roaring::Roaring64Map>> SearchIndex::build_values(const std::vector<std::vector<std::byte>>& bufs, uint64_t start) {
+
+const std::vector<std::pair<std::string, roaring::Roaring64Map>> SearchIndex::build_indexes_values(const Database& db, uint64_t start, uint64_t end) {
   std::vector<std::pair<std::string, roaring::Roaring64Map>> results;
   results.push_back({"na_index",roaring::Roaring64Map()});
 
-  uint64_t i = start;
-  for(const auto& buf : bufs) {
-    const sexp_view_t sexp_view = Serializer::unserialize_view(buf);
+
+
+  // The sexp table must have been mapped beforehand
+  BlobCursor cursor;
+  for(uint64_t i = start; i < end ; i++) {
+    const sexp_view_t sexp_view = Serializer::unserialize_view(db.sexp_table->read_view(i, cursor));
 
     if(find_na(sexp_view)) {
       results[0].second.add(i);
     }
 
-    i++;
   }
 
   for(auto& result : results) {
@@ -221,25 +314,25 @@ const std::vector<std::pair<std::string, roaring::Roaring64Map>> SearchIndex::bu
   return results;
 }
 
-const std::vector<std::pair<std::string, roaring::Roaring64Map>> SearchIndex::build_indexes_classnames(const Database& db, ReverseIndex& classnames_index, uint64_t start, uint64_t end) {
-  std::vector<std::pair<std::string, roaring::Roaring64Map>> results;
-  results.push_back({"class_index",roaring::Roaring64Map()});
-
+const std::vector<std::pair<std::string, roaring::Roaring64Map>> SearchIndex::build_indexes_classnames(const Database& db, uint64_t start, uint64_t end) {
+  std::vector<std::pair<std::string, roaring::Roaring64Map>> results(db.classes.nb_classnames() + 2);
+  results[0].first = "class_index";
+  // Then one per class name id
+  for(uint64_t k = 1; k < results.size(); k++) {
+    results[k].first = "classnames_index";
+  }
 
-  // Class names
- classnames_index.prepare_indexes(db.classes.nb_classnames() + 1);
   for(uint64_t i = start; i < end; i++) {
-    const std::vector<uint32_t>& class_ids =  db.classes.get_classnames(i);
+    Span<const uint32_t> class_ids = db.classes.get_classnames(i);
 
     for(uint32_t class_id : class_ids) {
-      classnames_index.add_property(i, class_id);
+      results[class_id + 1].second.add(i);
     }
 
     if(class_ids.size() > 0) {
       results[0].second.add(i);
     }
   }
-  classnames_index.finalize_indexes();
 
   for(auto& result : results) {
     result.second.runOptimize();
@@ -249,81 +342,121 @@ const std::vector<std::pair<std::string, roaring::Roaring64Map>> SearchIndex::bu
   return results;
 }
 
-const  std::vector<std::pair<std::string, std::vector<std::pair<uint32_t, roaring::Roaring64Map>>>>  SearchIndex::build_indexes_origins(const Database& db, uint64_t start, uint64_t end) {
+const  std::vector<std::pair<std::string, std::vector<std::pair<uint32_t, roaring::Roaring64Map>>>>  SearchIndex::build_indexes_origins(const Database& db, uint64_t start, uint64_t end, const roaring::Roaring64Map& updated) {
     uint32_t nb_packages = db.origins.nb_packages() + 1;// we want to count the empty one
     uint32_t nb_functions = db.origins.nb_functions() + 1;
     std::vector<std::pair<std::string, std::vector<std::pair<uint32_t, roaring::Roaring64Map>>>> results;
     results.push_back({"packages_index", std::vector<std::pair<uint32_t, roaring::Roaring64Map>>(nb_packages)});
-    results.push_back({"functions_index", std::vector<std::pair<uint32_t, roaring::Roaring64Map>>()});
-
-    std::vector<roaring::Roaring64Map> funcs(nb_functions);
+    results.push_back({"functions_index", std::vector<std::pair<uint32_t, roaring::Roaring64Map>>(nb_functions)});
 
-    for(uint64_t i = start; i < end ; i++) {
-      auto locs = db.origins.get_locs(i);
+    auto add_locs = [&results](uint64_t i, Span<const location_t> locs) {
       for(auto loc : locs) {
         results[0].second[loc.package].second.add(i);//packages
-        funcs[loc.function].add(i);
+        results[1].second[loc.function].second.add(i);
       }
+    };
+
+    // Values already indexed, with new origins
+    for(uint64_t i : updated) {
+      add_locs(i, db.origins.get_locs(i));
     }
 
-    // Merge the function indexes into intervals
-    // No more than 100 000 values per slot? Or 10 000?
-    // for 400 packages, we had about 36 000 functions
-    // and 39e6 unique values. So in average 1 000 unique values per
-    // function, probably with outliers
-    uint32_t j = 0;
-    roaring::Roaring64Map current_index;
-    for(const auto& fun : funcs) {
-      if(current_index.cardinality() > 10000) {
-        results[1].second.push_back({j, current_index});
-        current_index.clear();
-      }
-      current_index |= fun;
-      j++;
+    for(uint64_t i = start; i < end ; i++) {
+      add_locs(i, db.origins.get_locs(i));
+    }
+
+    for(uint32_t j = 0; j < nb_packages; j++) {
+      results[0].second[j].first = j;
     }
-    if(!current_index.isEmpty()) {
-      results[1].second.push_back({j, current_index});
+    for(uint32_t j = 0; j < nb_functions; j++) {
+      results[1].second[j].first = j;
     }
 
     return results;
 }
 
+std::vector<std::vector<call_index_record_t>> SearchIndex::build_indexes_calls(const Database& db, uint64_t start, uint64_t end, uint64_t start_sites, uint64_t end_sites) {
+  std::vector<std::vector<call_index_record_t>> results(db.origins.nb_functions() + 1);
 
+  // The locations of these values cannot be told apart between their calls
+  std::vector<uint64_t> value_calls;
+  for(uint64_t i = start; i < end; i++) {
+    auto locs = db.origins.get_locs(i);
+    if(locs.size() == 0) {
+      continue;
+    }
+    // get_call_ids returns a view that the next call invalidates
+    Span<const uint64_t> ids = db.call_ids.get_call_ids(i);
+    value_calls.assign(ids.begin(), ids.end());
+
+    for(const auto& loc : locs) {
+      auto& records = results[loc.function];
+      for(uint64_t call_id : value_calls) {
+        records.push_back({call_id, i, loc.package, loc.param});
+      }
+    }
+  }
 
+  for(uint64_t k = start_sites; k < end_sites; k++) {
+    const call_site_t& site = db.call_sites.read(k);
+    results[site.loc.function].push_back({site.call_id, site.index, site.loc.package, site.loc.param});
+  }
+
+  for(auto& records : results) {
+    std::sort(records.begin(), records.end());
+  }
+
+  return results;
+}
 
 
 void SearchIndex::build_indexes(const Database& db) {
   // We dot no clear the indexes: indeed, we cannot remove values from the database
+  // The new values are added to the existing bitmaps
+  load_all();
+
+  // Only the values added or updated since the last build are indexed
+  uint64_t legacy_end = std::min(db.call_sites_from, db.nb_values());
+  if(index_generated && last_computed == db.nb_values() && updated_values.isEmpty() && n_calls_updated.isEmpty() &&
+     calls_index.nb_values() >= legacy_end && calls_index.nb_call_sites() >= db.call_sites.nb_values()) {
+    return;
+  }
+
+  thread_pool pool(std::max(2u, std::thread::hardware_concurrency()) - 1);
 
-  thread_pool pool(std::thread::hardware_concurrency() - 1);
+  // The origin and call tasks both read the locations
+  db.origins.map();
 
   auto results_meta_fut = pool.submit(build_indexes_static_meta, std::cref(db), last_computed, db.nb_values());
-  auto results_classnames_fut = pool.submit(build_indexes_classnames, std::cref(db), std::ref(classnames_index), last_computed, db.nb_values());
-  auto results_origins_fut = pool.submit(build_indexes_origins, std::cref(db), last_computed, db.nb_values());
+  auto results_classnames_fut = pool.submit(build_indexes_classnames, std::cref(db), last_computed, db.nb_values());
+  auto results_origins_fut = pool.submit(build_indexes_origins, std::cref(db), last_computed, db.nb_values(), std::cref(updated_values));
+  // The call index can lag behind the other ones if it was added to an existing database
+  auto results_calls_fut = pool.submit(build_indexes_calls, std::cref(db), calls_index.nb_values(), legacy_end,
+                                       calls_index.nb_call_sites(), db.call_sites.nb_values());
   std::future<const std::vector<std::pair<std::string, roaring::Roaring64Map>>> results_value_fut;
 
   // Values
   std::vector<std::future<const std::vector<std::pair<std::string, roaring::Roaring64Map>>>> results_values_fut;
 
-  const uint64_t chunk_size = fs::file_size(db.sexp_table.get_path()) / (std::thread::hardware_concurrency() - 1);
-  const uint64_t elements_per_chunk = db.nb_values() / (std::thread::hardware_concurrency() - 1); // a rough estimate...
-  if(elements_per_chunk == 0) {// it means that there are more cores than values in the db!
-    elements_per_chunk - db.nb_values();
+  // The tasks read views into the mapped table, without copying the values
+  db.sexp_table->map();
+
+  // The chunks split the serialized sizes of the new values: the size of the file
+  // also counts the values already indexed, and is compressed in some layouts
+  uint64_t total_size = 0;
+  for(uint64_t i = last_computed; i < db.nb_values(); i++) {
+    total_size += db.sexp_table->value_size(i);
   }
+  const uint64_t chunk_size = total_size / pool.get_thread_count();
 
-  // TODO: we can now parallelize the read operation!
-  std::vector<std::vector<std::byte>> bufs;
-  bufs.reserve(elements_per_chunk);
   uint64_t size = 0;
   uint64_t start = last_computed;
   for(uint64_t i = start; i < db.nb_values() ; i++) {
-    const std::vector<std::byte>& buf = db.sexp_table.read(i);
-    size += buf.size();
-    bufs.push_back(buf);
+    size += db.sexp_table->value_size(i);
     if(size >= chunk_size || i == db.nb_values() - 1) {
-      results_values_fut.push_back(pool.submit(build_values, std::move(bufs), start));
+      results_values_fut.push_back(pool.submit(build_indexes_values, std::cref(db), start, i + 1));
       start = i + 1;
-      bufs.clear();
+      size = 0;
     }
   }
 
@@ -348,7 +481,7 @@ void SearchIndex::build_indexes(const Database& db) {
         if (!db.is_quiet()) Rprintf("Computations on classnames have finished in %lld ms.\n", (long long) dur.count());
       }
     }
-    if(value_status != std::future_status::ready) {
+    if(value_status != std::future_status::ready && !results_values_fut.empty()) {
       // that last task could actually finish before another one in the vector....
       value_status = results_values_fut[results_values_fut.size() - 1].wait_for(333ms);
       if(value_status == std::future_status::ready) {
@@ -369,13 +502,18 @@ void SearchIndex::build_indexes(const Database& db) {
   
 
   // Class names
-  // classnames_index should be passed with std::ref if used with std::async
   auto results_classnames = results_classnames_fut.get();
+  assert(results_classnames[0].first == "class_index");
   class_index |= results_classnames[0].second;
+  for(uint64_t k = 1; k < results_classnames.size(); k++) {
+    if(!results_classnames[k].second.isEmpty()) {
+      classnames_index.add(k - 1, results_classnames[k].second);
+    }
+  }
 
   auto results_meta = results_meta_fut.get();
 
-  assert(results_meta.size() == types_index.size() + 2 + lengths_index.size() + ndims_index.size());
+  assert(results_meta.size() == types_index.size() + 2 + ndims_index.size());
   int i = 0;
   for(; i < types_index.size() ; i ++) {
     assert(results_meta[i].first == "type_index");
@@ -387,51 +525,89 @@ void SearchIndex::build_indexes(const Database& db) {
   assert(results_meta[i].first == "attributes_index");
   attributes_index |= results_meta[i].second;
   i++;
-  for(int j = 0; j < lengths_index.size() ; j++) {
-    assert(results_meta[j + i].first == "length_index");
-    lengths_index[j] |= results_meta[j + i].second;
-  }
-  i += lengths_index.size();
   for(int j = 0; j < ndims_index.size() ; j++) {
     assert(results_meta[j + i].first == "ndims_index");
     ndims_index[j] |= results_meta[j + i].second;
   }
 
 
+  // Ranges
+  // When it is not in memory, the static metadata table is read through a single stream:
+  // they are built once build_indexes_static_meta is done with it
+  auto results_ranges = build_indexes_ranges(db, last_computed, db.nb_values());
+  for(int j = 0; j < nb_range_columns; j++) {
+    range_indexes[j].merge(results_ranges[j]);
+  }
+  // The number of calls of the values seen again has changed
+  for(uint64_t j : n_calls_updated) {
+    range_indexes[static_cast<int>(range_column::Calls)].set(j, db.runtime_meta.read(j).n_calls);
+  }
+
+
   // Origins
   auto results_origins = results_origins_fut.get();
   // get package index
   assert(results_origins[0].first == "packages_index");
-  packages_index.resize(results_origins[0].second.size());
+  packages_index.resize(std::max(packages_index.size(), results_origins[0].second.size()));
   for(int i = 0; i < results_origins[0].second.size(); i++) {
-      packages_index[i] = results_origins[0].second[i].second;
+      packages_index[i] |= results_origins[0].second[i].second;
   }
   // get function index
   assert(results_origins[1].first == "functions_index");
-  function_index.resize(results_origins[1].second.size());
-  for(int i = 0; i < results_origins[1].second.size(); i++) {
-      function_index[i] = results_origins[1].second[i];
+  for(const auto& fun : results_origins[1].second) {
+    if(!fun.second.isEmpty()) {
+      function_index.add(fun.first, fun.second);
+    }
   }
 
 
+  // Calls
+  auto results_calls = results_calls_fut.get();
+  calls_index.add(results_calls, legacy_end, db.call_sites.nb_values());
+
   types_index[ANYSXP].addRange(0, db.nb_values()); // [a, b[
 
+  updated_values.clear();
+  n_calls_updated.clear();
+  updated_dirty = true;
   index_generated = true;
+  dirty = true;
   last_computed = db.nb_values();
 }
 
-roaring::Roaring64Map SearchIndex::search_length(const Database& db, const roaring::Roaring64Map& bin_index, uint64_t precise_length) const {
-  roaring::Roaring64Map precise_index;
-
-  for(uint64_t i : bin_index) {
-    const auto& meta = db.static_meta.read(i);
-
-    if(meta.length == precise_length) {
-      precise_index.add(i);
-    }
-  }
-
-  return precise_index;
+void SearchIndex::reset() {
+  stop_prefetch();
+  mark_loaded();
+  for(auto& index : types_index) {
+    index = roaring::Roaring64Map();
+  }
+  na_index = roaring::Roaring64Map();
+  class_index = roaring::Roaring64Map();
+  vector_index = roaring::Roaring64Map();
+  attributes_index = roaring::Roaring64Map();
+  for(auto& index : ndims_index) {
+    index = roaring::Roaring64Map();
+  }
+  packages_index.clear();
+  function_index.clear();
+  classnames_index.clear();
+  for(auto& index : range_indexes) {
+    index.clear();
+  }
+
+  packed_index.close();
+  if(write_mode && pid == getpid() && !packed_index_path.empty()) {
+    fs::remove_all(base_path());
+  }
+  // The file does not exist anymore: this starts an empty call index
+  calls_index.open(calls_index_path);
+
+  last_computed = 0;
+  index_generated = false;
+  new_elements = false;
+  updated_values.clear();
+  n_calls_updated.clear();
+  updated_dirty = false;
 }
 
 roaring::Roaring64Map SearchIndex::search_ndims(const Database& db, const roaring::Roaring64Map& bin_index, uint64_t precise_ndims) const {
@@ -449,66 +625,114 @@ roaring::Roaring64Map SearchIndex::search_ndims(const Database& db, const roarin
 }
 
 
-roaring::Roaring64Map SearchIndex::search_classname(const Database& db, const roaring::Roaring64Map& bin_index, uint32_t precise_classname) const {
-  roaring::Roaring64Map precise_index;
+SearchIndex::~SearchIndex() {
+  stop_prefetch();
+  closing = true;
+  write();
+  flush();
+}
 
-  for(uint64_t i : bin_index) {
-    const std::vector<uint32_t> class_ids = db.classes.get_classnames(i);
+void SearchIndex::write_failed(const std::string& message) const {
+  if(closing) {
+    Rf_warning("%s", message.c_str());
+  }
+  else {
+    Rf_error("%s", message.c_str());
+  }
+}
 
-    if(std::find(class_ids.begin(), class_ids.end(), precise_classname) != class_ids.end()) {
-      precise_index.add(i);
-    }
+void SearchIndex::write() {
+  // Write all the indexes, if they have changed
+  if(pid != getpid() || !write_mode || !index_generated || !dirty || packed_index_path.empty()) {
+    return;
+  }
+  // The prefetch thread reads the packed index that is replaced
+  stop_prefetch();
+  if(!fs::exists(base_path())) {
+    fs::create_directory(base_path());
   }
 
-  return precise_index;
-}
+  PackedIndexWriter pack(packed_index_path);
+  for(int i = 0 ; i < types_index.size() ; i++) {
+    pack.add(index_family::Types, i, types_index[i]);
+  }
 
-roaring::Roaring64Map SearchIndex::search_function(const Database& db, const roaring::Roaring64Map& fun_index, uint32_t precise_fun) const {
-  roaring::Roaring64Map precise_index;
+  pack.add(index_family::Na, 0, na_index);
+  pack.add(index_family::Class, 0, class_index);
+  pack.add(index_family::Vector, 0, vector_index);
+  pack.add(index_family::Attributes, 0, attributes_index);
 
-  for(uint64_t i : fun_index) {
-    auto locs = db.origins.get_locs(i);
-    for(auto loc : locs) {
-      if(loc.function == precise_fun) {
-        precise_index.add(i);
-        break;
-      }
-    }
+  for(int i = 0; i < ndims_index.size() ; i++) {
+    pack.add(index_family::Ndims, i, ndims_index[i]);
   }
-  return precise_index;
-}
 
-SearchIndex::~SearchIndex() {
-  // Write all the indexes
-  if(pid == getpid() && write_mode && index_generated) {
-    for(int i = 0 ; i < types_index.size() ; i++) {
-      write_index(types_index_path.parent_path() / (types_index_path.stem().string()  + "_" + std::to_string(i) + ".ror"), types_index[i]);
-    }
+  classnames_index.write(pack);
 
-    write_index(na_index_path, na_index);
-    write_index(class_index_path, class_index);
-    write_index(vector_index_path, vector_index);
-    write_index(attributes_index_path, attributes_index);
+  for(int i = 0; i < packages_index.size() ; i++) {
+    pack.add(index_family::Packages, i, packages_index[i]);
+  }
 
-    for(int i = 0; i < lengths_index.size() ; i++) {
-      write_index(lengths_index_path.parent_path() / (lengths_index_path.stem().string() + "_" + std::to_string(i) + ".ror"), lengths_index[i]);
-    }
+  function_index.write(pack);
 
-    for(int i = 0; i < ndims_index.size() ; i++) {
-      write_index(ndims_index_path.parent_path() / (ndims_index_path.stem().string() + "_" + std::to_string(i) + ".ror"), ndims_index[i]);
-    }
+  for(int i = 0; i < nb_range_columns; i++) {
+    range_indexes[i].write(pack, range_family(static_cast<range_column>(i)));
+  }
 
+  if(!pack.finish()) {
+    // The previous packed index, if any, is still there
+    write_failed(pack.error());
+    return;
+  }
 
-    classnames_index.write(classnames_index_path);
+  // The bitmaps that are not in memory are now read from the new file
+  if(!packed_index.open(packed_index_path)) {
+    write_failed("Cannot open the search index that was just written at " + packed_index_path.string() + ".\n");
+    return;
+  }
+  classnames_index.clear();
+  function_index.clear();
 
-    for(int i = 0; i < packages_index.size() ; i++) {
-      write_index(packages_index_path.parent_path() / (packages_index_path.stem().string() + "_" + std::to_string(i) + ".ror"), packages_index[i]);
+  // The bitmaps are now all in the packed index
+  if(legacy_files) {
+    for(const auto& entry : fs::directory_iterator(base_path())) {
+      if(entry.path().extension() == ".ror" || entry.path().filename() == "classnames_index.conf") {
+        fs::remove(entry.path());
+      }
     }
+    legacy_files = false;
+  }
+
+  if(!calls_index.write(calls_index_path)) {
+    write_failed(calls_index.error());
+    return;
+  }
+  dirty = false;
+}
 
-    for(int i = 0; i < function_index.size() ; i++) {
-      write_index(functions_index_path.parent_path() / (functions_index_path.stem().string() + "_" + std::to_string(function_index[i].first) + ".ror"), function_index[i].second);
+void SearchIndex::flush() {
+  if(pid != getpid() || !write_mode || !updated_dirty || packed_index_path.empty()) {
+    return;
+  }
+  auto write_updated = [](const fs::path& path, const roaring::Roaring64Map& values) {
+    std::error_code ec;
+    if(values.isEmpty()) {
+      fs::remove(path, ec);
+      return !ec;
     }
+    fs::path tmp_path = path;
+    tmp_path += ".tmp";
+    if(!write_index(tmp_path, values)) {
+      return false;
+    }
+    fs::rename(tmp_path, path, ec);
+    return !ec;
+  };
+  if(!write_updated(updated_values_path(), updated_values) ||
+     !write_updated(n_calls_updated_path(), n_calls_updated)) {
+    write_failed("Cannot write the values to index again in " + base_path().string() + ".\n");
+    return;
   }
+  updated_dirty = false;
 }
 
 
@@ -532,11 +756,11 @@ roaring::Roaring64Map read_index(const fs::path& path) {
   return roaring::Roaring64Map::read(buf.data(), true);
 }
 
-void write_index(const fs::path& path, const roaring::Roaring64Map& index) {
+bool write_index(const fs::path& path, const roaring::Roaring64Map& index) {
   std::ofstream index_file(path, std::fstream::binary | std::fstream::trunc);
 
   if(!index_file) {
-    Rf_error("Cannot create index file %s: %s.\n", path.string().c_str(), strerror(errno));
+    return false;
   }
 
   size_t size = index.getSizeInBytes();
@@ -544,8 +768,10 @@ void write_index(const fs::path& path, const roaring::Roaring64Map& index) {
   size_t written = index.write(buf.data(), true);
 
   if(size != written) {
-    Rf_error("Incorrect number of bytes written for index %s: expected = %llu vs actual =%llu.\n", path.string().c_str(), (unsigned long long) size, (unsigned long long) written);
+    return false;
   }
 
   index_file.write(buf.data(), buf.size());
+  index_file.close();
+  return !index_file.fail();
 }
@@ -11,6 +11,9 @@
 #include <unistd.h>
 #include <vector>
 #include <string>
+#include <array>
+#include <mutex>
+#include <thread>
 
 #ifdef SXPDB_PARALLEL_STD
 #include <execution>
@@ -20,7 +23,10 @@
 #include "robin_hood.h"
 #include "config.h"
 
-#include "reverse_index.h"
+#include "packed_index.h"
+#include "posting_index.h"
+#include "bitsliced_index.h"
+#include "call_index.h"
 #include "serialization.h"
 
 class Database;
@@ -29,7 +35,8 @@ class Database;
 namespace fs = std::filesystem;
 
 roaring::Roaring64Map read_index(const fs::path& path) ;
-void write_index(const fs::path& path, const roaring::Roaring64Map& index);
+// False if it could not write the file
+bool write_index(const fs::path& path, const roaring::Roaring64Map& index);
 
 
 template <typename T>
@@ -156,26 +163,50 @@ inline bool find_na(const sexp_view_t& sexp_view) {
     return false;
 }
 
+// Groups of bitmaps of the search index that are read together from the packed index
+enum class index_group {
+  Types,
+  Flags,// na, class, vector and attributes
+  Ndims,
+  Packages,
+  Ranges
+};
+
+// Numeric metadata of the values that can be queried with ranges
+enum class range_column {
+  Length,
+  Size,
+  Calls,// as of the last build of the indexes
+  Rows,
+  Attributes
+};
+
 class SearchIndex {
   friend class Query;
 public:
   inline static const int nb_sexptypes = 26;
   inline static const int nb_intervals= 200;
   inline static const int nb_ndims = 6;// 0, 1, 2, 3, 4, [5, +inf[]
+  inline static const int nb_groups = 5;
+  inline static const int nb_range_columns = 5;
   inline static std::array<uint64_t, nb_intervals> length_intervals{0};
 private:
   pid_t pid;
   // Paths
-  fs::path types_index_path = "";
-  fs::path na_index_path = "";
-  fs::path class_index_path = "";
-  fs::path vector_index_path = "";
-  fs::path attributes_index_path = "";
-  fs::path lengths_index_path = "";
-  fs::path classnames_index_path = "";
-  fs::path ndims_index_path = "";
-  fs::path packages_index_path = "";
-  fs::path functions_index_path = "";
+  fs::path packed_index_path = "";
+  fs::path calls_index_path = "";
+
+  // The bitmaps, in one memory mapped file
+  PackedIndex packed_index;
+  // The index was read from the files of the previous format, with one file per bitmap
+  bool legacy_files = false;
+  // The bitmaps have changed since they were read and must be written when closing
+  bool dirty = false;
+
+  // Each group is only read from the packed index the first time it is needed.
+  // The groups can also be read in the background by prefetch().
+  mutable std::array<std::once_flag, nb_groups> loaded;
+  std::thread prefetch_thread;
 
   // Actual indexes
   std::vector<roaring::Roaring64Map> types_index;//the index in the vector is the type (from TYPEOF())
@@ -183,33 +214,59 @@ private:
   roaring::Roaring64Map class_index;//has a class a attribute
   roaring::Roaring64Map vector_index;//vector (but not scalar)
   roaring::Roaring64Map attributes_index;
-  std::vector<roaring::Roaring64Map> lengths_index;
   std::vector<roaring::Roaring64Map> ndims_index;
   std::vector<roaring::Roaring64Map> packages_index;
-  std::vector<std::pair<uint32_t, roaring::Roaring64Map>> function_index;
+  // They are not loaded with the other groups: each bitmap is read when it is looked up
+  PostingIndex function_index;
+  PostingIndex classnames_index;
+  // One per range_column
+  std::array<BitSlicedIndex, nb_range_columns> range_indexes;
 
-  ReverseIndex classnames_index;
+  CallIndex calls_index;
 
 
+  // Values already indexed that got new origins since: the next build indexes them again.
+  // It is written at each checkpoint of the database.
+  roaring::Roaring64Map updated_values;
+  // Values already indexed that were seen again: only their number of calls has to be indexed again
+  roaring::Roaring64Map n_calls_updated;
+  bool updated_dirty = false;
+
   bool index_generated = false;
   bool new_elements = false;
 
   uint64_t last_computed = 0;
 
   bool write_mode = false;
+  // In the destructor, which cannot raise R errors
+  bool closing = false;
 
   friend class Database;
 
 
   static const std::vector<std::pair<std::string, roaring::Roaring64Map>> build_indexes_static_meta(const Database& db, uint64_t start, uint64_t end);
+  static std::array<BitSlicedIndex, nb_range_columns> build_indexes_ranges(const Database& db, uint64_t start, uint64_t end);
   static const std::vector<std::pair<std::string, roaring::Roaring64Map>> build_indexes_values(const Database& db, uint64_t start, uint64_t end);
-  static const std::vector<std::pair<std::string, roaring::Roaring64Map>> build_indexes_classnames(const Database& db, ReverseIndex& index, uint64_t start, uint64_t end);
-  static const std::vector<std::pair<std::string, roaring::Roaring64Map>> build_values(const std::vector<std::vector<std::byte>>& bufs, uint64_t start);
-  static const std::vector<std::pair<std::string, std::vector<std::pair<uint32_t, roaring::Roaring64Map>>>> build_indexes_origins(const Database& db,  uint64_t start, uint64_t end);
+  static const std::vector<std::pair<std::string, roaring::Roaring64Map>> build_indexes_classnames(const Database& db, uint64_t start, uint64_t end);
+  static const std::vector<std::pair<std::string, std::vector<std::pair<uint32_t, roaring::Roaring64Map>>>> build_indexes_origins(const Database& db,  uint64_t start, uint64_t end, const roaring::Roaring64Map& updated);
+  // Values start..end - 1 traced before the call sites, and call sites start_sites..end_sites - 1
+  static std::vector<std::vector<call_index_record_t>> build_indexes_calls(const Database& db, uint64_t start, uint64_t end, uint64_t start_sites, uint64_t end_sites);
+
+  void read_group(index_group group);
+  void load_all() const;
+  // After reset or when reading the legacy files: there is nothing to read in the packed index
+  void mark_loaded();
+  void stop_prefetch();
+  // Before a fork
+  static void join_prefetch_threads();
+  // One .ror file per bitmap, in databases created before the packed index
+  void open_legacy(const fs::path& base_path, const Config& config);
+  // An R error, or a warning when closing
+  void write_failed(const std::string& message) const;
 
 
 public:
-   SearchIndex() : pid(getpid()), classnames_index(200) {
+   SearchIndex() : pid(getpid()), function_index(packed_index, index_family::Functions), classnames_index(packed_index, index_family::Classnames) {
     // We populate the length intervals in any cases
     // init intervals
     for(int i = 0; i < 101; i++) {
@@ -228,10 +285,19 @@ public:
 
 
     types_index.resize(nb_sexptypes);
-    lengths_index.resize(nb_intervals);
     ndims_index.resize(nb_ndims);
   }
 
+  // Bin of the length in length_intervals
+  static int length_bin(uint64_t length) {
+    auto it = std::lower_bound(length_intervals.begin(), length_intervals.end(), length);
+    return it == length_intervals.end() ? length_intervals.size() - 1 : it - length_intervals.begin();
+  }
+
+  static index_family range_family(range_column column) {
+    return static_cast<index_family>(static_cast<uint32_t>(index_family::RangeLength) + static_cast<uint32_t>(column));
+  }
+
   void set_write_mode(bool write) { write_mode = write; }
 
   bool is_initialized() const {return index_generated; }
@@ -248,50 +314,15 @@ public:
         fs::create_directory(base_path);
       }
 
-      if(types_index_path.empty()) {
-        types_index_path = base_path / "types_index";
-      }
-      conf["types_index"] = fs::relative(types_index_path, base_path_).string();
-      if(na_index_path.empty()) {
-        na_index_path = base_path / "na_index.ror";
+      if(packed_index_path.empty()) {
+        packed_index_path = base_path / "index.pack";
       }
-      conf["na_index"] = fs::relative(na_index_path, base_path_).string();
-      if(class_index_path.empty()) {
-        class_index_path = base_path / "class_index.ror";
-      }
-      conf["class_index"] = fs::relative(class_index_path, base_path_).string();
-      if(vector_index_path.empty()) {
-        vector_index_path = base_path / "vector_index.ror";
-      }
-      conf["vector_index"] = fs::relative(vector_index_path, base_path_).string();
-      if(attributes_index_path.empty()) {
-        attributes_index_path = base_path / "attributes_index.ror";
-      }
-      conf["attributes_index"] = fs::relative(attributes_index_path, base_path_).string();
-      if(lengths_index_path.empty()) {
-        lengths_index_path = base_path / "lengths_index";
-      }
-      conf["lengths_index"] = fs::relative(lengths_index_path, base_path_).string();
-      
-       if(ndims_index_path.empty()) {
-        ndims_index_path = base_path / "ndims_index";
-      }
-      conf["ndims_index"] = fs::relative(ndims_index_path, base_path_).string();
+      conf["search_index"] = fs::relative(packed_index_path, base_path_).string();
 
-      if(classnames_index_path.empty()) {
-        classnames_index_path = base_path / "classnames_index.conf";
+      if(calls_index_path.empty()) {
+        calls_index_path = base_path / "calls_index.bin";
       }
-      conf["classnames_index"] = fs::relative(classnames_index_path, base_path_).string();
-
-      if(packages_index_path.empty()) {
-        packages_index_path = base_path / "packages_index";
-      }
-      conf["packages_index"] = fs::relative(packages_index_path, base_path_).string();
-
-      if(functions_index_path.empty()) {
-        functions_index_path = base_path / "functions_index";
-      }
-      conf["functions_index"] = fs::relative(functions_index_path, base_path_).string();
+      conf["calls_index"] = fs::relative(calls_index_path, base_path_).string();
 
       conf["index_last_computed"] = std::to_string(last_computed);
 
@@ -305,21 +336,81 @@ public:
   }
 
   fs::path base_path() const {
-    return types_index_path.parent_path();
+    return packed_index_path.parent_path();
   }
 
-  roaring::Roaring64Map search_ndims(const Database& db, const roaring::Roaring64Map& bin_index, uint64_t precise_length) const;
+  fs::path updated_values_path() const {
+    return base_path() / "updated_values.bin";
+  }
 
-  roaring::Roaring64Map search_length(const Database& db, const roaring::Roaring64Map& bin_index, uint64_t precise_length) const;
+  fs::path n_calls_updated_path() const {
+    return base_path() / "n_calls_updated.bin";
+  }
+
+  // The origins of a value have changed
+  void value_updated(uint64_t index) {
+    if(index < last_computed) {
+      updated_values.add(index);
+      updated_dirty = true;
+    }
+  }
+
+  void values_updated(const roaring::Roaring64Map& values) {
+    for(uint64_t index : values) {
+      if(index >= last_computed) {
+        break;
+      }
+      updated_values.add(index);
+      updated_dirty = true;
+    }
+  }
+
+  // The number of calls of a value has changed
+  void n_calls_changed(uint64_t index) {
+    if(index < last_computed) {
+      n_calls_updated.add(index);
+      updated_dirty = true;
+    }
+  }
+
+  void n_calls_changed(const roaring::Roaring64Map& values) {
+    for(uint64_t index : values) {
+      if(index >= last_computed) {
+        break;
+      }
+      n_calls_updated.add(index);
+      updated_dirty = true;
+    }
+  }
+
+  // Write the bitmaps and the call index, if they have changed since they were read.
+  // It must happen before the configuration file records the values they cover.
+  void write();
+
+  // Write the values to index again
+  void flush();
+
+  // Read the bitmaps of the group if they have not been read yet.
+  // It must be called before using them. Loading does not change the content of the index.
+  void load(index_group group) const {
+    std::call_once(loaded[static_cast<int>(group)], &SearchIndex::read_group, const_cast<SearchIndex*>(this), group);
+  }
+
+  // Start reading all the groups in a background thread
+  void prefetch();
+
+  roaring::Roaring64Map search_ndims(const Database& db, const roaring::Roaring64Map& bin_index, uint64_t precise_length) const;
 
-  roaring::Roaring64Map search_classname(const Database& db, const roaring::Roaring64Map& bin_index, uint32_t precise_classname) const;
 
-  roaring::Roaring64Map search_function(const Database& db, const roaring::Roaring64Map& fun_index, uint32_t precise_fun) const;
 
   virtual ~SearchIndex();
 
   void build_indexes(const Database& db);
 
+  // Drop all the indexes, for instance after values were removed from the database.
+  // They will be built from scratch by the next build_indexes.
+  void reset();
+
 };
 
 #endif
@@ -131,7 +131,7 @@ const char* read_length(const char* buf, size_t& size) {
   return buf;
 }
 
-const sexp_view_t Serializer::unserialize_view(const std::vector<std::byte>& buf) {
+const sexp_view_t Serializer::unserialize_view(Span<const std::byte> buf) {
   const char* data = reinterpret_cast<const char*>(buf.data());
 
   sexp_view_t sexp_view;
@@ -9,6 +9,8 @@
 #include <Rinternals.h>
 #include <Rdefines.h>
 
+#include "span.h"
+
 struct sexp_view_t {
   SEXPTYPE type = ANYSXP;
   const void* data = nullptr;
@@ -79,7 +81,8 @@ public:
   // Analyzes a RDS serialization header
   static SEXP analyze_header(std::vector<std::byte>& buf);
   // Get a view of the data, that does not require allocating
-  static const sexp_view_t unserialize_view(const std::vector<std::byte>& buf);
+  // buf can be a view into a mapped table
+  static const sexp_view_t unserialize_view(Span<const std::byte> buf);
 };
 
 #endif
@@ -0,0 +1,53 @@
+#ifndef SXPDB_SPAN_H
+#define SXPDB_SPAN_H
+
+#include <cstddef>
+#include <vector>
+#include <cassert>
+#include <type_traits>
+
+// A non-owning view over a contiguous sequence of T.
+// This is a minimal stand-in for std::span, which is C++20 only
+// while the package targets C++17.
+// The view does not extend the lifetime of the memory it points to:
+// for a table, it is valid until the next append or the table is closed.
+template<typename T>
+class Span {
+private:
+  T* ptr = nullptr;
+  size_t length = 0;
+public:
+  using value_type = std::remove_cv_t<T>;
+  using iterator = T*;
+
+  Span() {}
+  Span(T* data, size_t size) : ptr(data), length(size) {}
+
+  template<typename U, typename = std::enable_if_t<std::is_convertible_v<U*, T*>>>
+  Span(const std::vector<U>& vec) : ptr(vec.data()), length(vec.size()) {}
+
+  template<typename U, typename = std::enable_if_t<std::is_convertible_v<U*, T*>>>
+  Span(std::vector<U>& vec) : ptr(vec.data()), length(vec.size()) {}
+
+  T* data() const { return ptr; }
+  size_t size() const { return length; }
+  bool empty() const { return length == 0; }
+
+  T& operator[](size_t i) const {
+    assert(i < length);
+    return ptr[i];
+  }
+
+  T& front() const { return ptr[0]; }
+  T& back() const { return ptr[length - 1]; }
+
+  T* begin() const { return ptr; }
+  T* end() const { return ptr + length; }
+
+  Span subspan(size_t offset, size_t count) const {
+    assert(offset + count <= length);
+    return Span(ptr + offset, count);
+  }
+};
+
+#endif
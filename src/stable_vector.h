@@ -2,19 +2,25 @@
 #define SXPDB_STABLE_VECTOR_H
 
 #include <cstddef>
+#include <cstdint>
 #include <vector>
 #include <stdexcept>
 #include <unistd.h>
 #include <iterator>
 #include <cassert>
+#include <algorithm>
+#include <type_traits>
 
 #include "posix_compat.h" // Windows equivalent for sysconf(_SC_PAGE_SIZE)
 
+template<typename T, bool is_const>
+class StableVectorIteratorBase;
+
 template<typename T>
-class StableVectorIterator;
+using StableVectorIterator = StableVectorIteratorBase<T, false>;
 
 template<typename T>
-class ConstStableVectorIterator;
+using ConstStableVectorIterator = StableVectorIteratorBase<T, true>;
 
 /**
  * Defines a stable vector, i.e. addresses won't change even in case of
@@ -22,208 +28,161 @@ class ConstStableVectorIterator;
  * The price is contiguity, but we make it more flexible and exposes more internals
  * than a deque for better performance.
  * It allow only constant insertion at the end, not at the front.
+ *
+ * The elements are stored in chunks of geometrically increasing sizes:
+ * chunk k holds base * 2^k elements, where base is a power of 2 (about a page worth of elements).
+ * The chunk and the position in the chunk of an index are then computed in constant time,
+ * and there are at most 64 chunks. Chunks are never reallocated.
  */
 template<typename T>
 class StableVector {
-  friend class StableVectorIterator<T>;
-  friend class ConstStableVectorIterator<T>;
+  friend class StableVectorIteratorBase<T, false>;
+  friend class StableVectorIteratorBase<T, true>;
 private:
   std::vector<std::vector<T>> data;
   size_t total_size = 0;
-  size_t elem_capacity = 0;
-  size_t last_chunk = 0;
-  size_t nb_pages = 1; // how many multiple of the page size to allocate
-  size_t page_size;
-
-  // returns true if it created a new chunk
-  bool pre_reserve(size_t new_cap) {
-    if(new_cap > elem_capacity) {
-      size_t chunk_size = new_cap - elem_capacity;
-      if(data.size() > 0 && data[last_chunk].size() == 0) {
-        // the last chunk is empty so we can directly extend it instead of
-        // allocating a new chunk
-        size_t old_chunk_capacity = data[last_chunk].capacity();
-        data[last_chunk].reserve(chunk_size + data[last_chunk].capacity());
-        elem_capacity += data.back().capacity() - old_chunk_capacity;
-        return false;
-      }
-      else {
-        std::vector<T> chunk;
-        data.push_back(std::vector<T>());
-        data.back().reserve(chunk_size);
-        elem_capacity += data.back().capacity();
-        return true;
-      }
+  size_t base = 1;
+  int base_log = 0;
+
+  static int log2_floor(uint64_t x) {
+    assert(x > 0);
+    return 63 - __builtin_clzll(x);
+  }
+
+  size_t chunk_capacity(size_t chunk) const {
+    return base << chunk;
+  }
+
+  // First index in the chunk
+  size_t chunk_start(size_t chunk) const {
+    return base * ((size_t(1) << chunk) - 1);
+  }
+
+  size_t chunk_of(size_t pos) const {
+    return log2_floor((pos >> base_log) + 1);
+  }
+
+  // Allocate the chunks to hold new_cap elements
+  void allocate(size_t new_cap) {
+    while(capacity() < new_cap) {
+      data.emplace_back();
+      data.back().reserve(chunk_capacity(data.size() - 1));
     }
-    return false;
   }
 
-public:
-  using value_type = T;
+  T& get(size_t pos) {
+    size_t chunk = chunk_of(pos);
+    return data[chunk][pos - chunk_start(chunk)];
+  }
 
-  StableVector() : page_size(sysconf(_SC_PAGE_SIZE)) {
-    // reserve a page worth of elements
-    reserve(page_size / sizeof(T));
+  const T& get(size_t pos) const {
+    size_t chunk = chunk_of(pos);
+    return data[chunk][pos - chunk_start(chunk)];
   }
 
-  StableVector(size_t count, const T& value = T()) : total_size(count), page_size(sysconf(_SC_PAGE_SIZE)) {
-    // round up count at a multiple of a page size?
-    data.push_back(std::vector(count, value));
-    elem_capacity = data[0].capacity();
+public:
+  using value_type = T;
+
+  StableVector() {
+    // a page worth of elements in the first chunk
+    size_t per_page = std::max<size_t>(1, sysconf(_SC_PAGE_SIZE) / sizeof(T));
+    base_log = log2_floor(per_page);
+    base = size_t(1) << base_log;
   }
 
-  // Just reserve
-  StableVector(size_t count) : page_size(sysconf(_SC_PAGE_SIZE)) {
-    std::vector<T> chunk;
-    // round count to a multiple of a page size?
-    data.push_back(chunk);
-    data[0].reserve(count);
-    elem_capacity = data[0].capacity();
+  StableVector(size_t count, const T& value = T()) : StableVector() {
+    resize(count, value);
   }
 
   size_t size() const { return total_size; }
 
-  size_t capacity() const { return capacity; }
+  size_t capacity() const { return data.empty() ? 0 : chunk_start(data.size()); }
 
   size_t nb_chunks() const {return data.size(); }
 
   void reserve(size_t new_cap) {
-    pre_reserve(new_cap);
+    allocate(new_cap);
   }
 
   T& at(size_t pos) {
-    size_t p = pos;
-    for(auto& chunk : data) {
-      if(p < chunk.size()) {
-        return chunk[p];
-      }
-      p -= chunk.size();
+    if(pos >= total_size) {
+      throw std::out_of_range("Out of range access in stable vector.\n");
     }
-    throw std::out_of_range("Out of range access in stable vector.\n");
+    return get(pos);
   }
 
   const T& at(size_t pos) const {
-    size_t p = pos;
-    for(auto& chunk : data) {
-      if(p < chunk.size()) {
-        return chunk[p];
-      }
-      p -= chunk.size();
+    if(pos >= total_size) {
+      throw std::out_of_range("Out of range access in stable vector.\n");
     }
-    throw std::out_of_range("Out of range access in stable vector.\n");
+    return get(pos);
   }
 
   T& operator[](size_t pos) {
-    size_t p = pos;
-    for(auto& chunk : data) {
-      if(p < chunk.size()) {
-        return chunk[p];
-      }
-      p -= chunk.size();
-    }
-    //that will access out of bound memory
-    return (data.back())[p];
+    assert(pos < total_size);
+    return get(pos);
   }
 
-
   const T& operator[](size_t pos) const {
-    size_t p = pos;
-    for(auto& chunk : data) {
-      if(p < chunk.size()) {
-        return chunk[p];
-      }
-      p -= chunk.size();
-    }
-    //that will access out of bound memory
-    return (data.back())[p];
+    assert(pos < total_size);
+    return get(pos);
   }
 
   T& back() {
-    return data[last_chunk].back();
+    return get(total_size - 1);
   }
 
   const T& back() const {
-    return data[last_chunk].back();
+    return get(total_size - 1);
   }
 
   void push_back(const T& value) {
-    // do we need to allocate a new chunk?
-    // we need last_chunk because people could have called reserve although there was
-    // still some capacity in the last chunk
-    if(data.size() > 0 && data[last_chunk].capacity() - data[last_chunk].size() > 0) {
-      data[last_chunk].push_back(value);
-    }
-    else {
-      //allocate a new chunk with double the size of the previous one
-      //
-      bool res = pre_reserve(elem_capacity + nb_pages * page_size / sizeof(T));
-      if(res) {last_chunk++;}
-      nb_pages *= 2;
-      data[last_chunk].push_back(value);
-    }
+    allocate(total_size + 1);
+    data[chunk_of(total_size)].push_back(value);
     total_size++;
   }
 
-  void push_back(const T&& value) {
-    if(data[last_chunk].capacity() - data[last_chunk].size() > 0) {
-      data[last_chunk].push_back(value);
-    }
-    else {
-      bool res = pre_reserve(elem_capacity + nb_pages * page_size / sizeof(T));
-      if(res) {last_chunk++;}
-      nb_pages *= 2;
-      data[last_chunk].push_back(value);
-    }
+  void push_back(T&& value) {
+    allocate(total_size + 1);
+    data[chunk_of(total_size)].push_back(std::move(value));
     total_size++;
   }
 
-  void resize(size_t count) {
-    size_t to_add = count;
-    // is there capacity in the last chunk?
-    if(data.size() > 0 && data[last_chunk].capacity() > data[last_chunk].size()) {
-      data[0].resize(std::min(count, data[0].capacity()));
-      to_add -= data[last_chunk].size();
+  void resize(size_t count, const T& value = T()) {
+    if(count < total_size) {
+      size_t last = chunk_of(count);
+      data[last].resize(count - chunk_start(last));
+      for(size_t chunk = last + 1; chunk < data.size(); chunk++) {
+        data[chunk].clear();
+      }
     }
-    if(to_add > 0) {
-      data.push_back(std::vector<T>(to_add));
+    else if(count > total_size) {
+      allocate(count);
+      for(size_t chunk = chunk_of(total_size); chunk < data.size() && chunk_start(chunk) < count; chunk++) {
+        data[chunk].resize(std::min(chunk_capacity(chunk), count - chunk_start(chunk)), value);
+      }
     }
-    elem_capacity = std::max(elem_capacity, count);
     total_size = count;
   }
 
+  // Only at the end
   template< class InputIt>
   StableVectorIterator<T> insert(StableVectorIterator<T> pos, InputIt first, InputIt last ) {
-    size_t length = last - first;
-    bool res = pre_reserve(total_size + length);
-
-    // insert in the remaining of the last chunk
-    size_t available_size_chunk = data[last_chunk].capacity() - data[last_chunk].size();
-
-    StableVectorIterator ret(*this, last_chunk, data[last_chunk].size() - 1);
-
-    if(available_size_chunk > 0) {
-      if(length < available_size_chunk) {
-        data[last_chunk].insert(data[last_chunk].end(), first, last);
-        return ret;
-      }
-      else {
-        data[last_chunk].insert(data[last_chunk].end(), first, first + available_size_chunk);
-      }
-    }
-    else {
-      ret.chunk_pos = last_chunk + 1;
-      ret.pos = 0;
+    assert(pos.index == total_size);
+    size_t length = std::distance(first, last);
+    allocate(total_size + length);
+
+    StableVectorIterator<T> ret(*this, total_size);
+
+    while(first != last) {
+      size_t chunk = chunk_of(total_size);
+      size_t n = std::min<size_t>(chunk_capacity(chunk) - data[chunk].size(), std::distance(first, last));
+      InputIt chunk_last = std::next(first, n);
+      data[chunk].insert(data[chunk].end(), first, chunk_last);
+      first = chunk_last;
+      total_size += n;
     }
 
-    assert(!res || available_size_chunk < length);
-
-    last_chunk++;
-    data[last_chunk].insert(data[last_chunk].end(), first + available_size_chunk, last);
-
-    total_size += length;
-
-    elem_capacity = std::max(elem_capacity, total_size);
-
     return ret;
   }
 
@@ -231,7 +190,6 @@ public:
     for(auto& chunk : data) {
       chunk.clear();
     }
-    last_chunk = 0;
     total_size = 0;
   }
 
@@ -239,14 +197,15 @@ public:
     return total_size == 0;
   }
 
-  StableVectorIterator<T> begin() { return StableVectorIterator<T>(*this); }
-  StableVectorIterator<T> end() { return StableVectorIterator<T>(*this, total_size > 0 ? data.size() : 0, 0); }
-  ConstStableVectorIterator<T> begin() const { return ConstStableVectorIterator<T>(*this); }
-  ConstStableVectorIterator<T> end() const { return ConstStableVectorIterator<T>(*this, total_size > 0 ? data.size() : 0, 0); }
+  StableVectorIterator<T> begin() { return StableVectorIterator<T>(*this, 0); }
+  StableVectorIterator<T> end() { return StableVectorIterator<T>(*this, total_size); }
+  ConstStableVectorIterator<T> begin() const { return ConstStableVectorIterator<T>(*this, 0); }
+  ConstStableVectorIterator<T> end() const { return ConstStableVectorIterator<T>(*this, total_size); }
 
-  ConstStableVectorIterator<T> cbegin() const { return ConstStableVectorIterator<T>(*this); }
-  ConstStableVectorIterator<T> cend() const { return ConstStableVectorIterator<T>(*this, total_size > 0 ? data.size() : 0, 0); }
+  ConstStableVectorIterator<T> cbegin() const { return ConstStableVectorIterator<T>(*this, 0); }
+  ConstStableVectorIterator<T> cend() const { return ConstStableVectorIterator<T>(*this, total_size); }
 
+  // Chunks are filled in order: only the last non-empty one can be partially filled
   const std::vector<T>& chunk(size_t pos) const {
     return data.at(pos);
   }
@@ -255,300 +214,88 @@ public:
   virtual ~StableVector() {  }
 };
 
-template<typename T>
-class StableVectorIterator {
+// The iterator only keeps the index: dereferencing is constant time.
+template<typename T, bool is_const>
+class StableVectorIteratorBase {
   friend class StableVector<T>;
+  using vector_type = std::conditional_t<is_const, const StableVector<T>, StableVector<T>>;
 public:
   using iterator_category = std::random_access_iterator_tag;
   using difference_type   = std::ptrdiff_t;
   using value_type        = T;
-  using pointer           = T*;  // or also value_type*
-  using reference         = T&;  // or also value_type&
-
-  reference operator*() const { return v.data[chunk_pos][pos];}
-  pointer operator->() { return &v.datadata[chunk_pos][pos]; }
-  reference operator[](size_t i) { return v[i]; }
+  using pointer           = std::conditional_t<is_const, const T*, T*>;
+  using reference         = std::conditional_t<is_const, const T&, T&>;
 
+  reference operator*() const { return v->get(index); }
+  pointer operator->() const { return &v->get(index); }
+  reference operator[](difference_type i) const { return v->get(index + i); }
 
-  StableVectorIterator& operator++() {
-    if(pos < v.data[chunk_pos].size() - 1) {
-      pos++;
-      assert(pos > 0);
-    }
-    else {
-      chunk_pos++;
-      pos = 0;
-      assert(chunk_pos > 0);
-    }
+  StableVectorIteratorBase& operator++() {
+    index++;
     return *this;
   }
 
-  StableVectorIterator operator++(int) {
-    StableVectorIterator tmp = *this;
+  StableVectorIteratorBase operator++(int) {
+    StableVectorIteratorBase tmp = *this;
     ++(*this);
     return tmp;
   }
 
-  StableVectorIterator& operator+=(difference_type rhs) {
-    difference_type shift = rhs;
-    int sign  = rhs > 0 ? 1 : -1;
-    while(pos + shift >= v.data[chunk_pos].size() || pos < 0) {
-      shift -= v.data[chunk_pos].size();
-      pos += shift;
-      chunk_pos += sign;
-      assert(pos >= 0);
-      assert(chunk_pos >= 0);
-    }
-
-    return *this;
-  }
-
-  StableVectorIterator operator+(difference_type rhs) const {
-    StableVectorIterator tmp = *this;
-    tmp += rhs;
-    return tmp;
-  }
-
-  StableVectorIterator& operator-=(difference_type rhs) {
-    return (*this) += - rhs;
-  }
-
-
-
-  StableVectorIterator& operator--() {
-    if(pos > 0 ) {
-      pos--;
-    }
-    else {
-      chunk_pos--;
-      assert(chunk_pos > 0);
-      pos = v.data[chunk_pos].size() - 1;
-    }
+  StableVectorIteratorBase& operator--() {
+    index--;
     return *this;
   }
 
-  StableVectorIterator operator--(int) {
-    StableVectorIterator tmp = *this;
+  StableVectorIteratorBase operator--(int) {
+    StableVectorIteratorBase tmp = *this;
     --(*this);
     return tmp;
   }
 
-  StableVectorIterator operator-(difference_type rhs) const {
-    StableVectorIterator tmp = *this;
-    tmp -= rhs;
-    return tmp;
-  }
-
-
-  difference_type operator-(const StableVectorIterator& rhs) const {
-    ptrdiff_t diff = 0;
-    size_t chunk_pos1 = chunk_pos;
-    size_t chunk_pos2 = rhs.chunk_pos;
-    size_t pos1 = pos;
-    size_t pos2 = rhs.pos;
-    int sign = 1;
-    if(chunk_pos < rhs.chunk_pos || (chunk_pos== rhs.chunk_pos && pos < rhs.pos)) {
-        chunk_pos1 = rhs.chunk_pos;
-        chunk_pos2 = chunk_pos;
-
-        pos1 = rhs.pos;
-        pos2 = pos;
-
-        sign = -1;
-    }
-    for(size_t i = chunk_pos1; i < chunk_pos2 ; i++) {
-      diff += v.data[i].size();
-    }
-    diff += pos2 - pos1;
-    assert(diff > 0);
-    return sign * diff;
-  }
-
-  friend inline StableVectorIterator operator+(difference_type lhs, const StableVectorIterator& rhs) {
-    StableVectorIterator tmp = rhs;
-    tmp += lhs;
-    return tmp;
-  }
-
-  friend inline StableVectorIterator operator-(difference_type lhs, const StableVectorIterator& rhs) {
-    StableVectorIterator tmp = rhs;
-    tmp -= lhs;
-    return tmp;
-  }
-
-  friend bool operator== (const StableVectorIterator& a, const StableVectorIterator& b) {
-    return a.chunk_pos == b.chunk_pos && a.pos == b.pos;
-  }
-  friend bool operator!= (const StableVectorIterator& a, const StableVectorIterator& b) { return !(a == b); }
-  friend bool operator>(const StableVectorIterator& a, const StableVectorIterator& b) {
-    return a.chunk_pos > b.chunk_pos || (a.chunk_pos == b.chunk_pos && a.pos > b.pos);
-  }
-  friend bool operator<(const StableVectorIterator& a, const StableVectorIterator& b) {
-    return a.chunk_pos < b.chunk_pos || (a.chunk_pos == b.chunk_pos && a.pos < b.pos);
-  }
-  friend bool operator>=(const StableVectorIterator& a, const StableVectorIterator& b) {
-    return a.chunk_pos > b.chunk_pos || (a.chunk_pos == b.chunk_pos && a.pos >= b.pos);
-  }
-  friend bool operator<=(const StableVectorIterator& a, const StableVectorIterator& b) {
-    return a.chunk_pos < b.chunk_pos || (a.chunk_pos == b.chunk_pos && a.pos <= b.pos);
-  }
-
-private:
-  StableVectorIterator(StableVector<T>& vec, size_t chunk_pos_= 0 , size_t pos_ = 0) :
-  v(vec), chunk_pos(chunk_pos_), pos(pos_) {}
-
-  StableVector<T>& v;
-  size_t chunk_pos = 0;
-  size_t pos = 0;
-};
-
-template<typename T>
-class ConstStableVectorIterator {
-  friend class StableVector<T>;
-public:
-  using iterator_category = std::random_access_iterator_tag;
-  using difference_type   = std::ptrdiff_t;
-  using value_type        = T;
-  using pointer           = T*;  // or also value_type*
-  using reference         = T&;  // or also value_type&
-  using const_reference   = const T&;
-
-  const_reference operator*() const {
-   return v.data[chunk_pos][pos];
-  }
-  const pointer operator->() { return &v.get(chunk_pos, pos); }
-  const_reference operator[](size_t i) { return v[i]; }
-
-
-  ConstStableVectorIterator& operator++() {
-    if(pos < v.data[chunk_pos].size() - 1) {
-      pos++;
-    }
-    else {
-      chunk_pos++;
-      pos = 0;
-    }
+  StableVectorIteratorBase& operator+=(difference_type rhs) {
+    index += rhs;
     return *this;
   }
 
-  ConstStableVectorIterator operator++(int) {
-    ConstStableVectorIterator tmp = *this;
-    ++(*this);
-    return tmp;
-  }
-
-  ConstStableVectorIterator& operator+=(difference_type rhs) {
-    difference_type shift = rhs;
-    pos+= shift;
-    int sign  = rhs > 0 ? 1 : -1;
-    while(pos >= v.data[chunk_pos].size() || pos < 0) {
-      shift -= v.data[chunk_pos].size();
-      pos += shift;
-      chunk_pos += sign;
-      assert(pos >= 0);
-      assert(chunk_pos >= 0);
-    }
-
+  StableVectorIteratorBase& operator-=(difference_type rhs) {
+    index -= rhs;
     return *this;
   }
 
-  ConstStableVectorIterator operator+(difference_type rhs) const {
-    ConstStableVectorIterator tmp = *this;
+  StableVectorIteratorBase operator+(difference_type rhs) const {
+    StableVectorIteratorBase tmp = *this;
     tmp += rhs;
     return tmp;
   }
 
-  ConstStableVectorIterator& operator-=(difference_type rhs) {
-    return (*this) += - rhs;
-  }
-
-
-
-  ConstStableVectorIterator& operator--() {
-    if(pos > 0 ) {
-      pos--;
-    }
-    else {
-      chunk_pos--;
-      assert(chunk_pos > 0);
-      pos = v.data[chunk_pos].size() - 1;
-    }
-    return *this;
-  }
-
-  ConstStableVectorIterator operator--(int) {
-    ConstStableVectorIterator tmp = *this;
-    --(*this);
-    return tmp;
-  }
-
-  ConstStableVectorIterator operator-(difference_type rhs) const {
-    ConstStableVectorIterator tmp = *this;
+  StableVectorIteratorBase operator-(difference_type rhs) const {
+    StableVectorIteratorBase tmp = *this;
     tmp -= rhs;
     return tmp;
   }
 
-
-  difference_type operator-(const ConstStableVectorIterator& rhs) const {
-    ptrdiff_t diff = 0;
-    size_t chunk_pos1 = chunk_pos;
-    size_t chunk_pos2 = rhs.chunk_pos;
-    size_t pos1 = pos;
-    size_t pos2 = rhs.pos;
-    int sign = 1;
-    if(chunk_pos < rhs.chunk_pos || (chunk_pos== rhs.chunk_pos && pos < rhs.pos)) {
-      chunk_pos1 = rhs.chunk_pos;
-      chunk_pos2 = chunk_pos;
-
-      pos1 = rhs.pos;
-      pos2 = pos;
-
-      sign = -1;
-    }
-    for(size_t i = chunk_pos1; i < chunk_pos2 ; i++) {
-      diff += v.data[i].size();
-    }
-    diff += pos2 - pos1;
-    assert(diff > 0);
-    return sign * diff;
-  }
-
-  friend inline ConstStableVectorIterator operator+(difference_type lhs, const ConstStableVectorIterator& rhs) {
-    ConstStableVectorIterator tmp = rhs;
-    tmp += lhs;
-    return tmp;
+  difference_type operator-(const StableVectorIteratorBase& rhs) const {
+    return difference_type(index) - difference_type(rhs.index);
   }
 
-  friend inline ConstStableVectorIterator operator-(difference_type lhs, const ConstStableVectorIterator& rhs) {
-    ConstStableVectorIterator tmp = rhs;
-    tmp -= lhs;
-    return tmp;
+  friend inline StableVectorIteratorBase operator+(difference_type lhs, const StableVectorIteratorBase& rhs) {
+    return rhs + lhs;
   }
 
-  friend bool operator== (const ConstStableVectorIterator& a, const ConstStableVectorIterator& b) {
-    return a.chunk_pos == b.chunk_pos && a.pos == b.pos;
-  }
-  friend bool operator!= (const ConstStableVectorIterator& a, const ConstStableVectorIterator& b) { return !(a == b); }
-  friend bool operator>(const ConstStableVectorIterator& a, const ConstStableVectorIterator& b) {
-    return a.chunk_pos > b.chunk_pos || (a.chunk_pos == b.chunk_pos && a.pos > b.pos);
-  }
-  friend bool operator<(const ConstStableVectorIterator& a, const ConstStableVectorIterator& b) {
-    return a.chunk_pos < b.chunk_pos || (a.chunk_pos == b.chunk_pos && a.pos < b.pos);
-  }
-  friend bool operator>=(const ConstStableVectorIterator& a, const ConstStableVectorIterator& b) {
-    return a.chunk_pos > b.chunk_pos || (a.chunk_pos == b.chunk_pos && a.pos >= b.pos);
-  }
-  friend bool operator<=(const ConstStableVectorIterator& a, const ConstStableVectorIterator& b) {
-    return a.chunk_pos < b.chunk_pos || (a.chunk_pos == b.chunk_pos && a.pos <= b.pos);
+  friend bool operator== (const StableVectorIteratorBase& a, const StableVectorIteratorBase& b) {
+    return a.index == b.index;
   }
+  friend bool operator!= (const StableVectorIteratorBase& a, const StableVectorIteratorBase& b) { return !(a == b); }
+  friend bool operator>(const StableVectorIteratorBase& a, const StableVectorIteratorBase& b) { return a.index > b.index; }
+  friend bool operator<(const StableVectorIteratorBase& a, const StableVectorIteratorBase& b) { return a.index < b.index; }
+  friend bool operator>=(const StableVectorIteratorBase& a, const StableVectorIteratorBase& b) { return a.index >= b.index; }
+  friend bool operator<=(const StableVectorIteratorBase& a, const StableVectorIteratorBase& b) { return a.index <= b.index; }
 
 private:
-  ConstStableVectorIterator(const StableVector<T>& vec, size_t chunk_pos_= 0 , size_t pos_ = 0) :
-  v(vec), chunk_pos(chunk_pos_), pos(pos_) {}
+  StableVectorIteratorBase(vector_type& vec, size_t index_ = 0) : v(&vec), index(index_) {}
 
-  const StableVector<T>& v;
-  size_t chunk_pos = 0;
-  size_t pos = 0;
+  vector_type* v;
+  size_t index = 0;
 };
 
 #endif
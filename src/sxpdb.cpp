@@ -9,7 +9,7 @@
 
 #define EMPTY_ORIGIN_PART ""
 
-SEXP open_db(SEXP filename, SEXP mode_, SEXP quiet) {
+SEXP open_db(SEXP filename, SEXP mode_, SEXP quiet, SEXP autorepair) {
   Database* db = nullptr;
 
   auto mode = Database::OpenMode::Read;
@@ -22,7 +22,7 @@ SEXP open_db(SEXP filename, SEXP mode_, SEXP quiet) {
   }
 
   try{
-    db = new Database(CHAR(STRING_ELT(filename, 0)), mode, Rf_asLogical(quiet));
+    db = new Database(CHAR(STRING_ELT(filename, 0)), mode, Rf_asLogical(quiet), Rf_asLogical(autorepair));
   }
   catch(std::exception& e) {
     Rf_error("Error opening the database %s : %s\n", CHAR(STRING_ELT(filename, 0)), e.what());
@@ -595,20 +595,46 @@ SEXP path_db(SEXP sxpdb) {
   return res;
 }
 
-SEXP check_db(SEXP sxpdb, SEXP slow) {
+SEXP check_db(SEXP sxpdb, SEXP slow, SEXP repair) {
   void* ptr = R_ExternalPtrAddr(sxpdb);
   if(ptr== nullptr) {
     return R_NilValue;
   }
   Database* db = static_cast<Database*>(ptr);
 
-  std::vector<size_t> errors = db->check(Rf_asLogical(slow));
+  // The values added since the last checkpoint are checked from the files
+  db->checkpoint();
+  check_report_t report = db->check(Rf_asLogical(slow));
+  if(Rf_asLogical(repair)) {
+    db->repair(report);
+  }
+
+  static const char* kinds[] = {"location", "size", "hash", "hash_index", "metadata", "call_ids"};
+  // Indexes and counts can go beyond the range of an R integer
+  SEXP indices = PROTECT(Rf_allocVector(REALSXP, report.errors.size()));
+  SEXP errors = PROTECT(Rf_allocVector(STRSXP, report.errors.size()));
+  for(size_t i = 0; i < report.errors.size(); i++) {
+    REAL(indices)[i] = report.errors[i].index;
+    SET_STRING_ELT(errors, i, Rf_mkChar(kinds[static_cast<int>(report.errors[i].kind)]));
+  }
+  SEXP df = PROTECT(create_data_frame({
+    {"index", indices},
+    {"error", errors}
+  }));
 
-  SEXP res = PROTECT(Rf_allocVector(INTSXP, errors.size()));
+  SEXP tables = PROTECT(Rf_allocVector(STRSXP, report.table_errors.size()));
+  for(size_t i = 0; i < report.table_errors.size(); i++) {
+    SET_STRING_ELT(tables, i, Rf_mkChar(report.table_errors[i].c_str()));
+  }
 
-  std::copy_n(errors.begin(), errors.size(), INTEGER(res));
+  const char* names[] = {"nb_values", "valid_values", "errors", "tables", ""};
+  SEXP res = PROTECT(Rf_mkNamed(VECSXP, names));
+  SET_VECTOR_ELT(res, 0, Rf_ScalarReal(report.nb_values));
+  SET_VECTOR_ELT(res, 1, Rf_ScalarReal(report.valid_values));
+  SET_VECTOR_ELT(res, 2, df);
+  SET_VECTOR_ELT(res, 3, tables);
 
-  UNPROTECT(1);
+  UNPROTECT(5);
 
   return res;
 }
@@ -798,6 +824,75 @@ SEXP write_mode(SEXP sxpdb) {
   return Rf_ScalarLogical(db->rw_mode());
 }
 
+SEXP set_layout_db(SEXP sxpdb, SEXP layout) {
+  void* ptr = R_ExternalPtrAddr(sxpdb);
+  if(ptr== nullptr) {
+    return R_NilValue;
+  }
+  Database* db = static_cast<Database*>(ptr);
+
+  db->set_layout(CHAR(STRING_ELT(layout, 0)));
+
+  return R_NilValue;
+}
+
+SEXP compression_stats_db(SEXP sxpdb) {
+  void* ptr = R_ExternalPtrAddr(sxpdb);
+  if(ptr== nullptr) {
+    return R_NilValue;
+  }
+  Database* db = static_cast<Database*>(ptr);
+
+  return db->compression_stats();
+}
+
+SEXP compact_db(SEXP sxpdb) {
+  void* ptr = R_ExternalPtrAddr(sxpdb);
+  if(ptr== nullptr) {
+    return R_NilValue;
+  }
+  Database* db = static_cast<Database*>(ptr);
+
+  db->compact();
+
+  return R_NilValue;
+}
+
+SEXP set_max_call_ids_db(SEXP sxpdb, SEXP max_call_ids) {
+  void* ptr = R_ExternalPtrAddr(sxpdb);
+  if(ptr== nullptr) {
+    return R_NilValue;
+  }
+  Database* db = static_cast<Database*>(ptr);
+
+  double n = Rf_asReal(max_call_ids);
+  if(ISNAN(n) || n < 0) {
+    Rf_error("The maximum number of call ids must be a non-negative number.\n");
+  }
+
+  db->set_max_call_ids(static_cast<uint64_t>(n));
+
+  return R_NilValue;
+}
+
+SEXP set_checkpoint_db(SEXP sxpdb, SEXP n_values, SEXP seconds) {
+  void* ptr = R_ExternalPtrAddr(sxpdb);
+  if(ptr== nullptr) {
+    return R_NilValue;
+  }
+  Database* db = static_cast<Database*>(ptr);
+
+  double n = Rf_asReal(n_values);
+  double s = Rf_asReal(seconds);
+  if(ISNAN(n) || n < 0 || ISNAN(s) || s < 0) {
+    Rf_error("The number of values and of seconds between checkpoints must be non-negative numbers.\n");
+  }
+
+  db->set_checkpoint_policy(static_cast<uint64_t>(n), static_cast<uint64_t>(s));
+
+  return R_NilValue;
+}
+
 SEXP values_from_origins(SEXP sxpdb, SEXP pkg, SEXP fun) {
   void* ptr = R_ExternalPtrAddr(sxpdb);
   if(ptr== nullptr) {
@@ -824,6 +919,25 @@ SEXP values_from_calls(SEXP sxpdb, SEXP pkg, SEXP fun) {
   return db->values_from_calls(pkg_name, fun_name);
 }
 
+SEXP type_signatures_db(SEXP sxpdb, SEXP pkg, SEXP fun) {
+  void* ptr = R_ExternalPtrAddr(sxpdb);
+  if(ptr== nullptr) {
+    return R_NilValue;
+  }
+  Database* db = static_cast<Database*>(ptr);
+
+  std::optional<std::string> pkg_name;
+  if(!Rf_isNull(pkg)) {
+    pkg_name = CHAR(STRING_ELT(pkg, 0));
+  }
+  std::optional<std::string> fun_name;
+  if(!Rf_isNull(fun)) {
+    fun_name = CHAR(STRING_ELT(fun, 0));
+  }
+
+  return db->view_type_signatures(pkg_name, fun_name);
+}
+
 SEXP query_from_value(SEXP value) {
   Query* query = new Query();
   *query = Query::from_value(value); // populate from the value
@@ -888,6 +1002,18 @@ SEXP relax_query(SEXP query_ptr, SEXP relax) {
     else if(relax_param == "length") {
       query->relax_length();
     }
+    else if(relax_param == "size") {
+      query->relax_range(range_column::Size);
+    }
+    else if(relax_param == "n_calls") {
+      query->relax_range(range_column::Calls);
+    }
+    else if(relax_param == "n_rows") {
+      query->relax_range(range_column::Rows);
+    }
+    else if(relax_param == "n_attributes") {
+      query->relax_range(range_column::Attributes);
+    }
     else if(relax_param == "attributes") {
       query->relax_attributes();
     }
@@ -907,6 +1033,7 @@ SEXP relax_query(SEXP query_ptr, SEXP relax) {
       query->relax_ndims();
       query->relax_vector();
       query->relax_length();
+      query->relax_ranges();
     }
     else if(relax_param == "keep_class") {
       query->relax_attributes();
@@ -914,6 +1041,7 @@ SEXP relax_query(SEXP query_ptr, SEXP relax) {
       query->relax_ndims();
       query->relax_vector();
       query->relax_length();
+      query->relax_ranges();
       query->relax_type();
     }
   }
@@ -20,9 +20,10 @@ extern "C" {
  * @param filename
  * @param mode boolean or "merge" open the database in write (T), read (F) or merge mode. Read and merge mode do not load into memory as much
  * @param quiet boolean print helpful messages or not
+ * @param autorepair boolean truncate the database to its valid values if it was not closed properly and is corrupted
  * @return R_NilValue on error, a external pointer to the database on success
  */
-SEXP open_db(SEXP filename, SEXP mode, SEXP quiet);
+SEXP open_db(SEXP filename, SEXP mode, SEXP quiet, SEXP autorepair);
 
 /**
  * This function closes the database, materializes totally on disk.
@@ -213,9 +214,11 @@ SEXP path_db(SEXP sxpdb);
  * @method check_db
  * @param sxpdb external pointer to the target database
  * @param slow boolean enables slow checks
- * @return integer vector of indices to values with problems
+ * @param repair boolean truncate the database to its valid values, in write mode
+ * @return list with the number of values, the number of valid values, a data frame of the
+ *   indices of the values with problems and of their problems, and the inconsistent tables
  */
-SEXP check_db(SEXP sxpdb, SEXP slow);
+SEXP check_db(SEXP sxpdb, SEXP slow, SEXP repair);
 
 /**
  * Map over the values of the database
@@ -293,6 +296,49 @@ SEXP build_indexes(SEXP sxpdb);
  */
 SEXP write_mode(SEXP sxpdb);
 
+/**
+ * Rewrite the values of the database with another storage layout
+ * @method set_layout_db
+ * @param sxpdb external pointer to the target database
+ * @param layout character vector, "plain", "block", "dict" or "inline"
+ * @return R_NilValue
+ */
+SEXP set_layout_db(SEXP sxpdb, SEXP layout);
+
+/**
+ * @method compression_stats_db
+ * @param sxpdb external pointer to the target database
+ * @return a data frame with, for each type, the number of values, their serialized size and their size on disk
+ */
+SEXP compression_stats_db(SEXP sxpdb);
+
+/**
+ * Fold the logs of metadata added to existing values into their tables
+ * @method compact_db
+ * @param sxpdb external pointer to the target database
+ * @return R_NilValue
+ */
+SEXP compact_db(SEXP sxpdb);
+
+/**
+ * Limit the number of call ids recorded for each value
+ * @method set_max_call_ids_db
+ * @param sxpdb external pointer to the target database
+ * @param max_call_ids integer or double vector of length 1, 0 for no limit
+ * @return R_NilValue
+ */
+SEXP set_max_call_ids_db(SEXP sxpdb, SEXP max_call_ids);
+
+/**
+ * Set when the database is automatically checkpointed
+ * @method set_checkpoint_db
+ * @param sxpdb external pointer to the target database
+ * @param n_values integer or double vector of length 1, number of new values between two checkpoints, 0 to disable
+ * @param seconds integer or double vector of length 1, seconds between two checkpoints, 0 to disable
+ * @return R_NilValue
+ */
+SEXP set_checkpoint_db(SEXP sxpdb, SEXP n_values, SEXP seconds);
+
 /**
  * @method has_search_index
  * @param sxpdb external pointer to the target database
@@ -313,11 +359,13 @@ SEXP query_from_value(SEXP value);
  *      the associated metadatum will be set to unspecified. Metadata:
  *         - type: any value of the desired type
  *         - vector: boolean
- *         - length: integer
+ *         - length: integer, or c(min, max)
  *         - class name: character vector of class names, or boolean
  *         - na: boolean
  *         - ndims: integer
  *         - attributes: boolean
+ *         - size, n_calls, n_rows, n_attributes: number, or c(min, max)
+ *      The bounds of the ranges are included. Inf is no upper bound.
  * @return external pointer to the query object
  */
 SEXP query_from_plan(SEXP value);
@@ -333,7 +381,8 @@ SEXP close_query(SEXP query);
  * @method relax_query
  * It will modify the query in place
  * @param query external pointer to the query object
- * @param relax character vector none or several of "na", "length", "attributes", "type", "vector", "ndims", "class". You can
+ * @param relax character vector none or several of "na", "length", "attributes", "type", "vector", "ndims", "class",
+ * "size", "n_calls", "n_rows", "n_attributes". You can
  * also give "keep_type" or "keep_class" to relax on all constraints, except the type, or except the class names.
  * It will relax the given constraints inferred from the example value.
  * @return boolean, true if the query changed or not
@@ -396,6 +445,16 @@ SEXP values_from_origins(SEXP sxpdb, SEXP pkg, SEXP fun);
  */
 SEXP values_from_calls(SEXP sxpdb, SEXP pkg, SEXP fun);
 
+/**
+ * @method type_signatures_db
+ *
+ * @param sxpdb external pointer to the target database
+ * @param pkg character name of the package, or R_NilValue for all the packages
+ * @param fun character name of the function, or R_NilValue for all the functions
+ * @return data frame with, for each parameter, the type signatures of its values and how many times they were seen
+ */
+SEXP type_signatures_db(SEXP sxpdb, SEXP pkg, SEXP fun);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
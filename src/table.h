@@ -14,10 +14,13 @@
 #include <cstddef>
 #include <filesystem>
 #include <string>
+#include <string_view>
 #include <cassert>
 #include <unistd.h>
 #include <iterator>
 #include <optional>
+#include <cstring>
+#include <chrono>
 
 
 #include <fcntl.h>
@@ -31,6 +34,8 @@
 #include "utils.h"
 
 #include "stable_vector.h"
+#include "mapped_file.h"
+#include "span.h"
 
 namespace fs = std::filesystem;
 
@@ -160,7 +165,47 @@ private:
   mutable std::fstream file;
   std::vector<T> store;
   uint64_t last_written = 0;
+  // Rows before last_written modified in memory since the last flush
+  roaring::Roaring64Map dirty;
   mutable T data;
+
+  // In read mode, the file is mapped read-only instead of going through the fstream
+  MappedFile mapping;
+  bool mapped = false;
+
+  const T* mapped_data() const {
+    return reinterpret_cast<const T*>(mapping.data());
+  }
+
+  // Only write the modified rows, by runs of consecutive rows, and the new ones
+  void write_store() {
+    if(!write_mode || !in_memory || mapped || pid != getpid() || (dirty.isEmpty() && n_values == last_written)) {
+      return;
+    }
+    file.open(file_path, std::fstream::in | std::fstream::out | std::fstream::binary);
+    uint64_t run_start = 0;
+    uint64_t run_end = 0;
+    auto write_run = [&]() {
+      if(run_end > run_start) {
+        file.seekp(run_start * sizeof(T));
+        file.write(reinterpret_cast<char*>(store.data() + run_start), (run_end - run_start) * sizeof(T));
+      }
+    };
+    for(uint64_t i : dirty) {
+      if(i != run_end) {
+        write_run();
+        run_start = i;
+      }
+      run_end = i + 1;
+    }
+    write_run();
+    dirty.clear();
+
+    file.seekp(last_written * sizeof(T));
+    file.write(reinterpret_cast<char*>(store.data() + last_written), (n_values - last_written) * sizeof(T));
+    file.close();
+    last_written = n_values;
+  }
 public:
   FSizeTable(const fs::path& path, bool write) : Table<T>(path, write) {
     open(path, write);
@@ -176,30 +221,52 @@ public:
       file.close();
     }
 
-    file.open(file_path, std::fstream::in | std::fstream::out | std::fstream::binary | std::fstream::ate);
-
-    if(!file) {
-      Rf_error("Impossible to open the table file at %s: %s\n", file_path.string().c_str(), strerror(errno));
-    }
-
-
     // check if the size is coherent
     uint64_t n_values_file = fs::file_size(file_path) / sizeof(T);
+    if(n_values_file > n_values) {
+      // A crash can leave values after the ones of the last checkpoint: they are discarded
+      // in write mode, and ignored in read mode
+      if(write_mode) {
+        fs::resize_file(file_path, n_values * sizeof(T));
+      }
+      n_values_file = n_values;
+    }
     if(n_values != n_values_file) {
       Rf_error("Number of values in config file and file do not match for table %s: %llu vs %llu.\n", path.string().c_str(), (unsigned long long) n_values, (unsigned long long) n_values_file);
     }
 
-    file.exceptions(std::fstream::failbit);
-
     last_written = n_values;
+
+    if(!write_mode) {
+      // Reads are just pointer arithmetic into the mapping
+      if(!mapping.map(file_path)) {
+        Rf_error("Impossible to map the table file at %s: %s\n", file_path.string().c_str(), strerror(errno));
+      }
+      mapped = true;
+      in_memory = true;
+      return;
+    }
+
+    file.open(file_path, std::fstream::in | std::fstream::out | std::fstream::binary | std::fstream::ate);
+
+    if(!file) {
+      Rf_error("Impossible to open the table file at %s: %s\n", file_path.string().c_str(), strerror(errno));
+    }
+
+    file.exceptions(std::fstream::failbit);
   }
 
 
   void append(const T& value) override {
-    if(in_memory) {
+    if(mapped) {
+      Rf_error("Cannot append to table %s opened in read mode.\n", file_path.string().c_str());
+    }
+    else if(in_memory) {
       store.push_back(value);
     }
     else {
+      // get and put positions are shared in a fstream so a read could have moved it
+      file.seekp(0, std::ios_base::end);
       file.write(reinterpret_cast<const char*>(&value), sizeof(value));
       last_written++;
     }
@@ -208,10 +275,14 @@ public:
   }
 
   void append(const std::vector<T>& values) override {
-    if(in_memory) {
+    if(mapped) {
+      Rf_error("Cannot append to table %s opened in read mode.\n", file_path.string().c_str());
+    }
+    else if(in_memory) {
         store.insert(store.end(), values.begin(), values.end());
     }
     else {
+      file.seekp(0, std::ios_base::end);
       file.write(reinterpret_cast<const char*>(values.data()), sizeof(T) * values.size());
       last_written += values.size();
     }
@@ -219,7 +290,10 @@ public:
   }
 
   const T& read(uint64_t index) const override {
-    if(in_memory) {
+    if(mapped) {
+      return mapped_data()[index];
+    }
+    else if(in_memory) {
       return store[index];
     }
     else {
@@ -230,7 +304,10 @@ public:
   }
 
   void read_in(uint64_t index, T& value) const override {
-    if(in_memory) {
+    if(mapped) {
+      value = mapped_data()[index];
+    }
+    else if(in_memory) {
       value = store[index];
     }
     else {
@@ -240,8 +317,14 @@ public:
   }
 
   void write(uint64_t index, const T& value) override {
-    if(in_memory) {
+    if(mapped) {
+      Rf_error("Cannot write to table %s opened in read mode.\n", file_path.string().c_str());
+    }
+    else if(in_memory) {
       store[index] = value;
+      if(index < last_written) {
+        dirty.add(index);
+      }
     }
     else {
       file.seekp(index * sizeof(T));
@@ -249,9 +332,9 @@ public:
       // seek back to the end
       file.seekp(0, std::ios_base::end);
     }
-    last_written = std::min(last_written, index + 1);// Invalidate from that index
   }
 
+  // When the table is mapped, everything is already addressable
   void load_all() override {
     if(!in_memory) {
       store.resize(n_values);
@@ -266,22 +349,44 @@ public:
     }
   }
 
-  const std::vector<T>& memory_view() {
+  // Does not copy anything when the table is mapped
+  Span<const T> memory_view() {
+    if(mapped) {
+      return Span<const T>(mapped_data(), n_values);
+    }
     if(!in_memory) {
       load_all();
     }
 
-    return store;
+    return Span<const T>(store);
+  }
+
+  // Drop the values from index n, for instance to repair the table
+  void truncate(uint64_t n) {
+    if(!write_mode || mapped) {
+      Rf_error("Cannot truncate table %s opened in read mode.\n", file_path.string().c_str());
+    }
+    if(n >= n_values) {
+      return;
+    }
+    if(in_memory) {
+      write_store();
+      store.resize(n);
+    }
+    else {
+      file.flush();
+    }
+    fs::resize_file(file_path, n * sizeof(T));
+    n_values = n;
+    last_written = n;
+    flush();
   }
 
   void flush() override {
-    uint64_t nb_new_values = n_values - last_written;
-    if(write_mode && in_memory && nb_new_values > 0 && pid == getpid()) {
-      //only materialize new values
-      file.open(file_path, std::fstream::out | std::fstream::binary);
-      file.seekp(last_written * sizeof(T));
-      file.write(reinterpret_cast<char*>(store.data() + last_written - 1), nb_new_values * sizeof(T));
-      file.close();
+    write_store();
+    // The configuration file must not count values still in the buffer of the stream
+    if(!in_memory && file.is_open()) {
+      file.flush();
     }
     // Always rewrite the configuration file
     new_elements = true;
@@ -290,14 +395,7 @@ public:
   }
 
   virtual ~FSizeTable() {
-    uint64_t nb_new_values = n_values - last_written;
-    if(write_mode && in_memory  && nb_new_values > 0 && pid == getpid()) {
-      //only materialize new values
-      file.open(file_path, std::fstream::out | std::fstream::app | std::fstream::binary);
-      file.seekp(last_written * sizeof(T));
-      file.write(reinterpret_cast<char*>(store.data() + last_written), nb_new_values * sizeof(T));
-      file.close();
-    }
+    write_store();
     new_elements = true;// Always force writing of the config file
   }
 
@@ -316,9 +414,49 @@ private:
   using Table<T>::write_mode;
 
   mutable int fd = -1;
-  StableVector<T> store;
+  StableVector<T> store;// values appended since the table was open
   uint64_t last_written = 0;
   mutable T data;
+
+  // The values already in the file when the table is opened are mapped read-only,
+  // and the new values are appended to the store. Opening is then O(1), whatever the size
+  // of the table, and neither the mapping nor the store move: pointers to the values stay valid
+  // until the next flush. Flushing maps the values it has written, and releases the store.
+  MappedFile mapping;
+  uint64_t nb_mapped = 0;
+
+  const T* mapped_data() const {
+    return reinterpret_cast<const T*>(mapping.data());
+  }
+
+  void write_new_values() {
+    uint64_t nb_new_values = n_values - last_written;
+    if(write_mode && nb_new_values > 0 && pid == getpid()) {
+      //only materialize new values
+      fd = ::open(file_path.string().c_str(), O_CREAT | O_RDWR | O_BINARY, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+      lseek(fd, last_written * sizeof(T), SEEK_SET);
+      for(auto it = store.begin() + (last_written - nb_mapped); it != store.end(); it++) {
+        std::ignore = ::write(fd, reinterpret_cast<char*>(&(*it)), sizeof(T));
+      }
+      ::close(fd);
+      last_written = n_values;
+    }
+  }
+
+  // Read the written values from the file rather than from the store
+  void remap() {
+    if(!write_mode || pid != getpid() || nb_mapped == last_written) {
+      return;
+    }
+    fd = ::open(file_path.string().c_str(), O_RDONLY | O_BINARY);
+    if(fd == -1 || !mapping.map(fd, last_written * sizeof(T))) {
+      Rf_error("Impossible to map the table file at %s: %s\n", file_path.string().c_str(), strerror(errno));
+    }
+    ::close(fd);
+    fd = -1;
+    nb_mapped = last_written;
+    store = StableVector<T>();
+  }
 public:
   FSizeMemoryViewTable(const fs::path& path, bool write) : Table<T>(path, write) {
     open(path, write);
@@ -335,86 +473,99 @@ public:
     if(fd == -1) {
       Rf_error("Impossible to open the table file at %s: %s\n", file_path.string().c_str(), strerror(errno));
     }
-    // Now seek to the end for write to be able to append to the file
     uint64_t end_pos = lseek(fd, 0, SEEK_END);
 
     // check if the size is coherent
     uint64_t n_values_file = fs::file_size(file_path) / sizeof(T);
+    if(n_values_file > n_values) {
+      // Values after the ones of the last checkpoint
+      end_pos = n_values * sizeof(T);
+      if(write_mode && ftruncate(fd, end_pos) != 0) {
+        Rf_error("Impossible to truncate the table file at %s: %s\n", file_path.string().c_str(), strerror(errno));
+      }
+      n_values_file = n_values;
+    }
     if(n_values != n_values_file) {
       Rf_error("Number of values in config file and file do not match for table %s: %llu vs %llu.\n", path.string().c_str(), (unsigned long long) n_values, (unsigned long long) n_values_file);
     }
 
     last_written = n_values;
+
+    if(!mapping.map(fd, end_pos)) {
+      Rf_error("Impossible to map the table file at %s: %s\n", file_path.string().c_str(), strerror(errno));
+    }
+    ::close(fd);
+    fd = -1;
+    nb_mapped = n_values;
+    in_memory = true;
   }
 
 
   void append(const T& value) override {
+    if(!write_mode) {
+      Rf_error("Cannot append to table %s opened in read mode.\n", file_path.string().c_str());
+    }
     store.push_back(value);
 
     n_values++;
   }
 
   void append(const std::vector<T>& values) override {
+    if(!write_mode) {
+      Rf_error("Cannot append to table %s opened in read mode.\n", file_path.string().c_str());
+    }
     store.insert(store.end(), values.begin(), values.end());
     n_values += values.size();
   }
 
   const T& read(uint64_t index) const override {
-    return store[index];
+    if(index < nb_mapped) {
+      return mapped_data()[index];
+    }
+    return store[index - nb_mapped];
   }
 
   void read_in(uint64_t index, T& value) const override {
-    value = store[index];
+    value = read(index);
   }
 
   void write(uint64_t index, const T& value) override {
-    store[index] = value;
-    last_written = std::min(last_written, index + 1);
+    if(index < nb_mapped) {
+      Rf_error("Cannot overwrite value %llu of table %s: it was already written to the file.\n",
+               (unsigned long long) index, file_path.string().c_str());
+    }
+    store[index - nb_mapped] = value;
+    last_written = std::min(last_written, index);
   }
 
-  void load_all() override {
-    store.resize(n_values);
-
+  // Everything is always addressable
+  void load_all() override {}
 
-    // We will read sequentially
-    uint64_t end_pos = lseek(fd, 0, SEEK_END);
-#ifdef POSIX_FADV_SEQUENTIAL
-    posix_fadvise(fd, 0, end_pos, POSIX_FADV_SEQUENTIAL);
-#else
-    (void) end_pos;  // posix_fadvise is a Linux-only hint; no-op on macOS/Windows
-#endif
-
-    lseek(fd, 0, SEEK_SET);
-
-    for(auto& v : store) {
-      std::ignore = ::read(fd, reinterpret_cast<char*>(&v), sizeof(T));
-    }
-    in_memory = true;
-    // all the values up to that index are already in the file
-
-    // Now we can close the backing file a
-    // and open it only when when materializing the data back on disk
-    ::close(fd);
+  // Zero-copy view on the values that were in the file when it was opened or last flushed
+  // (all of them in read mode).
+  Span<const T> mapped_view() const {
+    return Span<const T>(mapped_data(), nb_mapped);
   }
 
-  const StableVector<T>& memory_view() {
-    if(!in_memory) {
-      load_all();
+  // Drop the values from index n, for instance to repair the table
+  void truncate(uint64_t n) {
+    if(!write_mode) {
+      Rf_error("Cannot truncate table %s opened in read mode.\n", file_path.string().c_str());
     }
-    return store;
+    if(n >= n_values) {
+      return;
+    }
+    write_new_values();
+    fs::resize_file(file_path, n * sizeof(T));
+    n_values = n;
+    last_written = n;
+    remap();
+    flush();
   }
 
   void flush() override {
-    uint64_t nb_new_values = n_values - last_written;
-    if(write_mode && in_memory && nb_new_values > 0 && pid == getpid()) {
-      //only materialize new values
-      fd = ::open(file_path.string().c_str(), O_CREAT | O_RDWR | O_BINARY, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
-      lseek(fd, last_written * sizeof(T), SEEK_SET);
-      for(auto it = store.begin() + last_written; it != store.end(); it++) {
-        std::ignore = ::write(fd, reinterpret_cast<char*>(&(*it)), sizeof(T));
-      }
-      ::close(fd);
-    }
+    write_new_values();
+    remap();
     // Always rewrite the configuration file
     new_elements = true;
     Table<T>::flush();
@@ -422,16 +573,7 @@ public:
   }
 
   virtual ~FSizeMemoryViewTable() {
-    uint64_t nb_new_values = n_values - last_written;
-    if(write_mode && in_memory && nb_new_values > 0 && pid == getpid()) {
-      //only materialize new values
-      fd = ::open(file_path.string().c_str(), O_CREAT | O_RDWR | O_BINARY, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
-      lseek(fd, last_written * sizeof(T), SEEK_SET);
-      for(auto it = store.begin() + last_written; it != store.end(); it++) {
-        std::ignore = ::write(fd, reinterpret_cast<char*>(&(*it)), sizeof(T));
-      }
-      ::close(fd);
-    }
+    write_new_values();
     new_elements = true;// Always force writing of the config file
   }
 
@@ -454,7 +596,80 @@ private:
   // 8 bytes (64 bit unsigned integer),  n bytes
   // Size, actual value
   mutable T value;
+
+  // Read-only mapping of the file, for read_view.
+  // In read mode, it is created when opening the table.
+  // In write mode, it is (re)created lazily when a view reaches
+  // past the end of the current mapping.
+  mutable MappedFile blob_map;
+
+  void ensure_mapped(uint64_t end) const {
+    if(end > blob_map.size()) {
+      if(!blob_map.map(fd, fs::file_size(file_path))) {
+        Rf_error("Impossible to map the table file at %s: %s\n", file_path.string().c_str(), strerror(errno));
+      }
+      if(end > blob_map.size()) {
+        Rf_error("Out of bounds read in table %s: %llu vs %llu bytes.\n", file_path.string().c_str(),
+                 (unsigned long long) end, (unsigned long long) blob_map.size());
+      }
+    }
+  }
+
+  // Buffered appends
+  // The records (size, value) and their offsets are accumulated in memory
+  // and written in one go when the buffer is large or old enough, or in flush.
+  bool buffered = false;
+  size_t buffer_max_bytes = 0;
+  std::chrono::milliseconds buffer_max_age{0};
+  std::chrono::steady_clock::time_point buffer_start;
+  std::vector<std::byte> pending;
+  std::vector<uint64_t> pending_offsets;// absolute offsets in the file
+  uint64_t file_end = 0;// end of the data already written in the file
+
+  uint64_t nb_flushed_values() const {
+    return n_values - pending_offsets.size();
+  }
+
+  // Where the values before index n end in the file
+  uint64_t end_of_values(uint64_t n) const {
+    if(n == 0) {
+      return 0;
+    }
+    uint64_t offset = offset_table.read(n - 1);
+    uint64_t size = 0;
+    std::ignore = pread(fd, reinterpret_cast<char*>(&size), sizeof(size), offset);
+    return offset + sizeof(size) + sizeof(value_type) * size;
+  }
+
+  const std::byte* pending_record(uint64_t idx) const {
+    return pending.data() + (pending_offsets[idx - nb_flushed_values()] - file_end);
+  }
+
+  void flush_buffer() {
+    if(pending_offsets.empty() || Table<T>::pid != getpid()) {
+      return;
+    }
+
+    size_t written = 0;
+    while(written < pending.size()) {
+      ssize_t res = pwrite(fd, pending.data() + written, pending.size() - written, file_end + written);
+      if(res <= 0) {
+        Rf_error("Error while writing to table %s: %s\n", file_path.string().c_str(), strerror(errno));
+      }
+      written += res;
+    }
+    // unbuffered appends write at the current position
+    lseek(fd, 0, SEEK_END);
+
+    offset_table.append(pending_offsets);
+
+    file_end += pending.size();
+    pending.clear();
+    pending_offsets.clear();
+  }
 public:
+  using value_type = typename T::value_type;
+
   VSizeTable(const fs::path& path, bool write=true) : Table<T>(path, write) {
     open(path, write);
   }
@@ -472,6 +687,15 @@ public:
       Rf_error("Impossible to open the table file at %s: %s\n", file_path.string().c_str(), strerror(errno));
     }
 
+    // A crash can leave values after the ones of the last checkpoint: they are discarded,
+    // so that the next appends follow the last value
+    if(write_mode && n_values <= offset_table.nb_values()) {
+      uint64_t end = end_of_values(n_values);
+      if(static_cast<uint64_t>(lseek(fd, 0, SEEK_END)) > end && ftruncate(fd, end) != 0) {
+        Rf_error("Impossible to truncate the table file at %s: %s\n", file_path.string().c_str(), strerror(errno));
+      }
+    }
+
     // Now seek to the end for write to be able to append to the file
     uint64_t end_pos = lseek(fd, 0, SEEK_END);
     // This is for the merge case
@@ -481,16 +705,62 @@ public:
 #else
     (void) end_pos;  // posix_fadvise is a Linux-only hint; no-op on macOS/Windows
 #endif
+
+    if(!write_mode) {
+      ensure_mapped(end_pos);
+    }
   }
 
   void append(const T& value) override {
+    append_view(Span<const value_type>(value));
+  }
+
+  // Switch to buffered appends: they are written to the file
+  // when the buffer exceeds max_bytes, when the oldest buffered value is older than max_age
+  // (checked at the next append), or on flush.
+  // Reads of buffered values are served from the buffer.
+  void set_buffered(bool buffer, size_t max_bytes = 16 * 1024 * 1024,
+                    std::chrono::milliseconds max_age = std::chrono::milliseconds(2000)) {
+    if(!buffer) {
+      flush_buffer();
+    }
+    else if(!buffered) {
+      file_end = lseek(fd, 0, SEEK_END);
+      pending.reserve(max_bytes);
+    }
+    buffered = buffer;
+    buffer_max_bytes = max_bytes;
+    buffer_max_age = max_age;
+  }
+
+  // Append from a view, for instance one obtained with read_view on another table
+  void append_view(Span<const value_type> value) {
     uint64_t size = value.size();
 
+    if(buffered) {
+      if(pending_offsets.empty()) {
+        buffer_start = std::chrono::steady_clock::now();
+      }
+      pending_offsets.push_back(file_end + pending.size());
+      const std::byte* size_bytes = reinterpret_cast<const std::byte*>(&size);
+      pending.insert(pending.end(), size_bytes, size_bytes + sizeof(size));
+      const std::byte* data = reinterpret_cast<const std::byte*>(value.data());
+      pending.insert(pending.end(), data, data + sizeof(value_type) * size);
+
+      n_values++;
+      new_elements = true;
+
+      if(pending.size() >= buffer_max_bytes ||
+         std::chrono::steady_clock::now() - buffer_start >= buffer_max_age) {
+        flush_buffer();
+      }
+      return;
+    }
+
     auto pos = lseek(fd, 0, SEEK_CUR);// Get current position
 
     std::ignore = ::write(fd, reinterpret_cast<char*>(&size), sizeof(size));
-    // TODO: have a variant for non-contiguous types that would use begin and end
-    std::ignore = ::write(fd, reinterpret_cast<const char*>(value.data()), sizeof(typename T::value_type) * size);
+    std::ignore = ::write(fd, reinterpret_cast<const char*>(value.data()), sizeof(value_type) * size);
 
     offset_table.append(pos);
 
@@ -513,6 +783,12 @@ public:
 
   // Can read in parallel because of pread
   void read_in(uint64_t idx, T& val) const override {
+    if(!write_mode || idx >= nb_flushed_values()) {
+      auto view = read_view(idx);
+      val.assign(view.begin(), view.end());
+      return;
+    }
+
     uint64_t offset = offset_table.read(idx);
 
     uint64_t size = 0;
@@ -523,6 +799,63 @@ public:
     std::ignore = pread(fd, reinterpret_cast<char*>(val.data()), sizeof(typename T::value_type) * size, offset + sizeof(size));
   }
 
+  // Zero-copy access to a value.
+  // The view is valid until the table is closed, or, in write mode,
+  // until the next call to read_view that needs to extend the mapping.
+  // read_view can be called concurrently in read mode, or after map()
+  // as long as nothing is appended.
+  Span<const value_type> read_view(uint64_t idx) const {
+    uint64_t size = 0;
+
+    if(idx >= nb_flushed_values()) {
+      const std::byte* record = pending_record(idx);
+      std::memcpy(&size, record, sizeof(size));
+      return Span<const value_type>(reinterpret_cast<const value_type*>(record + sizeof(size)), size);
+    }
+
+    uint64_t offset = offset_table.read(idx);
+
+    ensure_mapped(offset + sizeof(size));
+    std::memcpy(&size, blob_map.data() + offset, sizeof(size));
+
+    ensure_mapped(offset + sizeof(size) + sizeof(value_type) * size);
+    return Span<const value_type>(reinterpret_cast<const value_type*>(blob_map.data() + offset + sizeof(size)), size);
+  }
+
+  // Like read_view, but returns false instead of failing if the record is not in the file,
+  // or does not end where the next one starts. Can be called concurrently after map().
+  bool read_view_checked(uint64_t idx, Span<const value_type>& view) const {
+    if(idx >= nb_flushed_values()) {
+      view = read_view(idx);
+      return true;
+    }
+
+    uint64_t offset = offset_table.read(idx);
+    uint64_t file_size = blob_map.size();
+    uint64_t size = 0;
+    if((idx == 0 && offset != 0) || offset > file_size || file_size - offset < sizeof(size)) {
+      return false;
+    }
+    std::memcpy(&size, blob_map.data() + offset, sizeof(size));
+    if(size > (file_size - offset - sizeof(size)) / sizeof(value_type)) {
+      return false;
+    }
+    uint64_t end = offset + sizeof(size) + sizeof(value_type) * size;
+    if(idx + 1 < nb_flushed_values() && offset_table.read(idx + 1) != end) {
+      return false;
+    }
+    view = Span<const value_type>(reinterpret_cast<const value_type*>(blob_map.data() + offset + sizeof(size)), size);
+    return true;
+  }
+
+  // Load the offsets and map the whole file,
+  // so that read_view can be called from several threads.
+  void map() const {
+    offset_table.load_all();
+    ensure_mapped(fs::file_size(file_path));
+    blob_map.advise_sequential();
+  }
+
   void load_all() override {
     offset_table.load_all();
     in_memory = true;
@@ -539,9 +872,21 @@ public:
   }
 
   void write(uint64_t idx, const T& value) override {
+    uint64_t size = 0;
+
+    if(idx >= nb_flushed_values()) {
+      std::byte* record = pending.data() + (pending_offsets[idx - nb_flushed_values()] - file_end);
+      std::memcpy(&size, record, sizeof(size));
+      if(value.size() != size) {
+        Rf_warning("Cannot write at index %llu a value of a different size in table %s : %llu vs %llu.\n", (unsigned long long) idx, file_path.string().c_str(), (unsigned long long) size, (unsigned long long) value.size());
+        return;
+      }
+      std::memcpy(record + sizeof(size), value.data(), sizeof(value_type) * size);
+      return;
+    }
+
     uint64_t offset = offset_table.read(idx);
 
-    uint64_t size = 0;
     std::ignore = pread(fd, reinterpret_cast<char*>(&size), sizeof(size), offset);
     assert(size > 0 );
 
@@ -556,22 +901,68 @@ public:
   }
 
 
+  // Drop the values from index n, for instance to repair the table.
+  // The file ends after value n - 1.
+  void truncate(uint64_t n) {
+    if(!write_mode) {
+      Rf_error("Cannot truncate table %s opened in read mode.\n", file_path.string().c_str());
+    }
+    if(n >= n_values) {
+      return;
+    }
+    flush_buffer();
+    uint64_t end = end_of_values(n);
+    blob_map.unmap();
+    if(ftruncate(fd, end) != 0) {
+      Rf_error("Impossible to truncate the table file at %s: %s\n", file_path.string().c_str(), strerror(errno));
+    }
+    lseek(fd, 0, SEEK_END);
+    file_end = end;
+    offset_table.truncate(n);
+    n_values = n;
+    new_elements = true;
+    flush();
+  }
+
+  // The table can still be used after flushing it, for instance at a checkpoint
   void flush() override {
+      flush_buffer();
       offset_table.flush();
       Table<T>::flush();
       new_elements = false;
-      close(fd);
   }
 
   int get_fd() const { return fd; }
 
+  const fs::path& offsets_path() const { return offset_table.get_path(); }
+
   virtual ~VSizeTable() {
+    flush_buffer();
     close(fd);
   }
 };
 
 
 // Store only unique values
+//
+// The strings are stored in a string pool:
+// - the .bin file contains all the strings, each one followed by a newline.
+//   It is also the format of the old text tables, so that they do not have to be rewritten.
+// - the _offsets.bin file contains the end offset of each string in the .bin file
+// - the _hash.bin file is an open-addressing hash table from the strings to their index.
+// All the three files are mapped so that opening the table does not have to parse anything.
+// The hash table is written back only when there are new strings.
+//
+// Old text tables (without the _offsets.bin file) are converted when they are opened
+// in write mode; in read mode, the offsets are computed in memory.
+struct string_hash_header_t {
+  uint64_t magic = 0;
+  uint32_t version = 0;
+  uint32_t reserved = 0;
+  uint64_t capacity = 0;// number of slots, a power of 2
+  uint64_t nb_values = 0;// number of strings in the table
+};
+
 class UniqTextTable : public Table<std::string> {
 private:
   using Table<std::string>::file_path;
@@ -581,27 +972,183 @@ private:
   using Table<std::string>::pid;
   using Table<std::string>::write_mode;
 
-  mutable std::fstream file;
+  static constexpr uint64_t hash_magic = 0x4c4f4f5052545358;// "XSTRPOOL"
+  static constexpr uint32_t hash_version = 1;
+  static constexpr uint64_t min_capacity = 64;
 
   mutable std::string val;
 
-  StableVector<std::string> store;//to not get invalidated pointers in the hash table
-  robin_hood::unordered_map<std::string, uint64_t> unique_lines;
+  fs::path offsets_path;
+  fs::path hash_path;
+
+  // Strings that were in the table when it was opened
+  MappedFile blob_mapping;
+  MappedFile offsets_mapping;
+  std::vector<uint64_t> converted_ends;// offsets of an old text table opened in read mode
+  const uint64_t* mapped_ends = nullptr;
+  uint64_t nb_mapped = 0;
+  uint64_t mapped_blob_end = 0;
+
+  // Strings added since then
+  std::string tail_blob;
+  std::vector<uint64_t> tail_ends;
   uint64_t last_written = 0;
 
+  // A slot is the high 32 bits of the hash of the string and 1 + its index, 0 if empty.
+  // The slots are mapped from the _hash.bin file, and copied into
+  // hash_store when we add new strings.
+  MappedFile hash_mapping;
+  std::vector<uint64_t> hash_store;
+  const uint64_t* slots = nullptr;
+  uint64_t capacity = 0;
+  bool hash_dirty = false;
+
   bool unique_loaded = false;
 
-public:
-  class line {
-    std::string data;
-  public:
-    friend std::istream &operator>>(std::istream &is, line &l) {
-      std::getline(is, l.data);
-      return is;
+  static uint64_t hash_string(std::string_view s) {
+    return XXH3_64bits(s.data(), s.size());
+  }
+
+  uint64_t end_of(uint64_t index) const {
+    return index < nb_mapped ? mapped_ends[index] : tail_ends[index - nb_mapped];
+  }
+
+  void insert_slot(uint64_t h, uint64_t index) {
+    uint64_t mask = capacity - 1;
+    for(uint64_t pos = h & mask; ; pos = (pos + 1) & mask) {
+      if(hash_store[pos] == 0) {
+        hash_store[pos] = ((h >> 32) << 32) | (index + 1);
+        return;
+      }
+    }
+  }
+
+  void rebuild_hash(uint64_t new_capacity) {
+    hash_mapping.unmap();
+    capacity = new_capacity;
+    hash_store.assign(capacity, 0);
+    for(uint64_t i = 0; i < n_values; i++) {
+      insert_slot(hash_string(view(i)), i);
+    }
+    slots = hash_store.data();
+    hash_dirty = true;
+  }
+
+  // Make the hash table modifiable
+  void ensure_hash_store() {
+    if(slots != hash_store.data()) {
+      hash_store.assign(slots, slots + capacity);
+      hash_mapping.unmap();
+      slots = hash_store.data();
+    }
+  }
+
+  bool map_hash() {
+    if(!fs::exists(hash_path) || fs::file_size(hash_path) < sizeof(string_hash_header_t)) {
+      return false;
+    }
+    string_hash_header_t h;
+    std::ifstream hash_file(hash_path, std::fstream::binary);
+    hash_file.read(reinterpret_cast<char*>(&h), sizeof(h));
+    if(!hash_file || h.magic != hash_magic || h.version != hash_version || h.nb_values != n_values ||
+       fs::file_size(hash_path) != sizeof(h) + h.capacity * sizeof(uint64_t)) {
+      return false;
+    }
+    if(!hash_mapping.map(hash_path)) {
+      return false;
+    }
+    capacity = h.capacity;
+    slots = reinterpret_cast<const uint64_t*>(hash_mapping.data() + sizeof(h));
+    return true;
+  }
+
+  void write_hash() const {
+    string_hash_header_t h;
+    h.magic = hash_magic;
+    h.version = hash_version;
+    h.capacity = capacity;
+    h.nb_values = n_values;
+
+    fs::path tmp_path = hash_path;
+    tmp_path += ".tmp";
+    std::ofstream hash_file(tmp_path, std::fstream::binary | std::fstream::trunc);
+    hash_file.write(reinterpret_cast<const char*>(&h), sizeof(h));
+    hash_file.write(reinterpret_cast<const char*>(slots), capacity * sizeof(uint64_t));
+    hash_file.close();
+    if(!hash_file) {
+      Rf_error("Impossible to write the hash table at %s.\n", hash_path.string().c_str());
+    }
+    fs::rename(tmp_path, hash_path);
+  }
+
+  // Offsets of the strings of an old text table
+  std::vector<uint64_t> text_offsets() const {
+    MappedFile text;
+    if(!text.map(file_path)) {
+      Rf_error("Impossible to map the table file at %s: %s\n", file_path.string().c_str(), strerror(errno));
+    }
+    std::vector<uint64_t> ends;
+    ends.reserve(n_values);
+    const char* begin = reinterpret_cast<const char*>(text.data());
+    const char* p = begin;
+    const char* last = begin + text.size();
+    while(ends.size() < n_values) {
+      const char* nl = p == nullptr ? nullptr : static_cast<const char*>(std::memchr(p, '\n', last - p));
+      if(nl == nullptr) {
+        Rf_error("Table %s has fewer lines than expected: %llu vs %llu.\n", file_path.string().c_str(),
+                 (unsigned long long) ends.size(), (unsigned long long) n_values);
+      }
+      p = nl + 1;
+      ends.push_back(p - begin);
     }
-    operator std::string() const { return data; }
-  };
+    return ends;
+  }
+
+  void write_new_values() {
+    if(!write_mode || pid != getpid()) {
+      return;
+    }
+
+    if(hash_dirty) {
+      write_hash();
+      hash_dirty = false;
+    }
+
+    if(n_values == last_written) {
+      return;
+    }
+    uint64_t blob_begin = last_written == 0 ? 0 : end_of(last_written - 1);
+    uint64_t blob_end = end_of(n_values - 1);
+
+    int fd = ::open(file_path.string().c_str(), O_CREAT | O_WRONLY | O_BINARY, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    int offsets_fd = ::open(offsets_path.string().c_str(), O_CREAT | O_WRONLY | O_BINARY, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if(fd == -1 || offsets_fd == -1) {
+      Rf_error("Impossible to open the table file at %s: %s\n", file_path.string().c_str(), strerror(errno));
+    }
+    // Only the strings after the mapped ones can be new
+    assert(last_written >= nb_mapped);
+    write_all(fd, tail_blob.data() + (blob_begin - mapped_blob_end), blob_end - blob_begin, blob_begin);
+    write_all(offsets_fd, tail_ends.data() + (last_written - nb_mapped), (n_values - last_written) * sizeof(uint64_t),
+              last_written * sizeof(uint64_t));
+    ::close(fd);
+    ::close(offsets_fd);
+
+    last_written = n_values;
+    new_elements = true;
+  }
 
+  void write_all(int fd, const void* data, size_t size, uint64_t offset) const {
+    size_t written = 0;
+    while(written < size) {
+      ssize_t res = pwrite(fd, static_cast<const char*>(data) + written, size - written, offset + written);
+      if(res <= 0) {
+        Rf_error("Error while writing to table %s: %s\n", file_path.string().c_str(), strerror(errno));
+      }
+      written += res;
+    }
+  }
+
+public:
   UniqTextTable() {}
   UniqTextTable(const fs::path& path, bool write = true) {
     open(path, write);
@@ -610,56 +1157,103 @@ public:
   void open(const fs::path& path, bool write = true) override {
     Table<std::string>::open(path, write);
 
+    offsets_path = file_path.parent_path() / (file_path.stem().string() + "_offsets.bin");
+    hash_path = file_path.parent_path() / (file_path.stem().string() + "_hash.bin");
+
+    blob_mapping.unmap();
+    offsets_mapping.unmap();
+    hash_mapping.unmap();
+    converted_ends.clear();
+    tail_blob.clear();
+    tail_ends.clear();
+    hash_store.clear();
+    slots = nullptr;
+    capacity = 0;
+    hash_dirty = false;
+    unique_loaded = false;
+
     // Create the file if it does not exist
     if(!fs::exists(file_path)) {
-      file.open(file_path, std::fstream::out | std::fstream::app);
-      file.close();
+      std::ofstream file(file_path, std::fstream::out | std::fstream::app);
     }
-    else {
-      file.open(file_path, std::fstream::in);
 
-      if(!file) {
-        Rf_error("Impossible to open the table file at %s: %s\n", file_path.string().c_str(), strerror(errno));
+    bool has_offsets = fs::exists(offsets_path) && fs::file_size(offsets_path) >= n_values * sizeof(uint64_t);
+    if(!has_offsets && n_values > 0) {
+      // Old text table
+      converted_ends = text_offsets();
+      if(write_mode) {
+        fs::path tmp_path = offsets_path;
+        tmp_path += ".tmp";
+        std::ofstream offsets_file(tmp_path, std::fstream::binary | std::fstream::trunc);
+        offsets_file.write(reinterpret_cast<const char*>(converted_ends.data()), converted_ends.size() * sizeof(uint64_t));
+        offsets_file.close();
+        if(!offsets_file) {
+          Rf_error("Impossible to write the offsets of table %s.\n", file_path.string().c_str());
+        }
+        fs::rename(tmp_path, offsets_path);
       }
+      mapped_ends = converted_ends.data();
+    }
+    else if(n_values > 0) {
+      // A crash could have left offsets and bytes after the ones in the config file; they are ignored
+      int fd = ::open(offsets_path.string().c_str(), O_RDONLY | O_BINARY);
+      if(fd == -1 || !offsets_mapping.map(fd, n_values * sizeof(uint64_t))) {
+        Rf_error("Impossible to map the offsets of table %s: %s\n", file_path.string().c_str(), strerror(errno));
+      }
+      ::close(fd);
+      mapped_ends = reinterpret_cast<const uint64_t*>(offsets_mapping.data());
+    }
+    else if(write_mode) {
+      // Create it, so that the next opening does not take the table for a text table
+      std::ofstream offsets_file(offsets_path, std::fstream::out | std::fstream::app);
+    }
 
-      // There will be only one chunk at the beginning
-      // because the default StableVector constructor does not allocate at all.
-      // If there are no values at all, reserve will pre-allocate a page worth of values.
-      store.reserve(n_values);
-
-      std::copy(std::istream_iterator<line>(file),
-                std::istream_iterator<line>(),
-                std::back_inserter(store));
-
-      file.close();
-
-      last_written = store.size();
+    nb_mapped = n_values;
+    mapped_blob_end = n_values > 0 ? mapped_ends[n_values - 1] : 0;
+    if(mapped_blob_end > fs::file_size(file_path)) {
+      Rf_error("Table %s is shorter than expected: %llu vs %llu bytes.\n", file_path.string().c_str(),
+               (unsigned long long) fs::file_size(file_path), (unsigned long long) mapped_blob_end);
     }
+    if(write_mode) {
+      // Strings after the ones in the config file would otherwise stay between the last string
+      // and the next ones
+      if(fs::file_size(file_path) > mapped_blob_end) {
+        fs::resize_file(file_path, mapped_blob_end);
+      }
+      if(fs::exists(offsets_path) && fs::file_size(offsets_path) > n_values * sizeof(uint64_t)) {
+        fs::resize_file(offsets_path, n_values * sizeof(uint64_t));
+      }
+    }
+    if(mapped_blob_end > 0) {
+      int fd = ::open(file_path.string().c_str(), O_RDONLY | O_BINARY);
+      if(fd == -1 || !blob_mapping.map(fd, mapped_blob_end)) {
+        Rf_error("Impossible to map the table file at %s: %s\n", file_path.string().c_str(), strerror(errno));
+      }
+      ::close(fd);
+    }
+    last_written = n_values;
+
+    unique_loaded = map_hash();
 
     // Only populate the hash table in write mode
     if(write_mode) {
       load_unique();
     }
 
-    throw_assert(n_values == store.size());
-
     in_memory = true;
-
   }
 
   void load_unique() {
     if(unique_loaded) {
       return;
     }
-    // Populate the hash table
-    unique_lines.reserve(store.size());
-    throw_assert(store.nb_chunks() == 1);
-    auto chunk = store.chunk(0);
-    for(uint64_t i = 0; i < chunk.size() ; i++) {
-      unique_lines.insert({chunk[i], i});
+    uint64_t new_capacity = min_capacity;
+    while(new_capacity < 2 * n_values) {
+      new_capacity *= 2;
     }
-
-    throw_assert(unique_lines.size() == n_values);// the file should contain unique names
+    rebuild_hash(new_capacity);
+    // Only write the rebuilt table back in write mode
+    hash_dirty = write_mode;
 
     unique_loaded = true;
   }
@@ -668,21 +1262,40 @@ public:
     return unique_loaded;
   }
 
-  uint64_t append_index(const std::string& value) {
-    auto it = unique_lines.find(value);
+  // Valid until the next append
+  std::string_view view(uint64_t index) const {
+    assert(index < n_values);
+    uint64_t begin = index == 0 ? 0 : end_of(index - 1);
+    uint64_t end = end_of(index) - 1;// without the newline
+    const char* p = index < nb_mapped ?
+      reinterpret_cast<const char*>(blob_mapping.data()) + begin :
+      tail_blob.data() + (begin - mapped_blob_end);
+    return std::string_view(p, end - begin);
+  }
 
-    if(it == unique_lines.end()) {
-      store.push_back(value);
-      auto res = unique_lines.insert({store.back(), store.size() - 1});
+  uint64_t append_index(const std::string& value) {
+    assert(value.find('\n') == std::string::npos);
+    uint64_t h = hash_string(value);
+    auto idx = find(value, h);
+    if(idx) {
+      return *idx;
+    }
 
-      n_values++;
-      assert(store.size() == n_values);
-      assert(res.second);//insertion actually happened
-      return store.size() - 1;
+    // at most 3/4 full
+    if(4 * (n_values + 1) > 3 * capacity) {
+      rebuild_hash(2 * capacity);
     }
     else {
-      return it->second;
+      ensure_hash_store();
     }
+
+    tail_blob.append(value);
+    tail_blob.push_back('\n');
+    tail_ends.push_back(mapped_blob_end + tail_blob.size());
+    insert_slot(h, n_values);
+    hash_dirty = true;
+
+    return n_values++;
   }
 
   void append(const std::string& value) override {
@@ -696,7 +1309,7 @@ public:
   }
 
   void read_in(uint64_t index, std::string& value) const override {
-    value = store[index];
+    value.assign(view(index));
   }
 
   const std::string& read(uint64_t index) const override {
@@ -704,15 +1317,23 @@ public:
     return val;
   }
 
-  std::optional<uint64_t> get_index(const std::string& value) const {
-    assert(unique_loaded);
-    auto it = unique_lines.find(value);
-    if(it != unique_lines.end()) {
-      return it->second;
-    }
-    else {
+  std::optional<uint64_t> find(std::string_view value, uint64_t h) const {
+    if(capacity == 0) {
       return {};
     }
+    uint64_t mask = capacity - 1;
+    for(uint64_t pos = h & mask; slots[pos] != 0; pos = (pos + 1) & mask) {
+      uint64_t slot = slots[pos];
+      if((slot >> 32) == (h >> 32) && view((slot & 0xFFFFFFFF) - 1) == value) {
+        return (slot & 0xFFFFFFFF) - 1;
+      }
+    }
+    return {};
+  }
+
+  std::optional<uint64_t> get_index(std::string_view value) const {
+    assert(unique_loaded);
+    return find(value, hash_string(value));
   }
 
   void write(uint64_t index, const std::string& value) override {
@@ -727,45 +1348,19 @@ public:
   }
 
   virtual ~UniqTextTable() {
-    int nb_new_elements = n_values - last_written;
-    if(write_mode && pid== getpid() && nb_new_elements > 0 ) {
-      file.open(file_path, std::fstream::out | std::fstream::app);
-      for(auto line = store.begin() + last_written; line != store.end() ; line++) {
-        file << *line << "\n";
-      }
-      file << std::flush;
-    }
-
-    if(nb_new_elements > 0) {
-      new_elements = true;
-    }
+    write_new_values();
   }
 
   void flush() override {
-    int nb_new_elements = n_values - last_written;
-    if(write_mode && pid== getpid() && nb_new_elements > 0 ) {
-      file.open(file_path, std::fstream::out | std::fstream::app);
-      for(auto line = store.begin() + last_written; line != store.end() ; line++) {
-        file << *line << "\n";
-      }
-      file << std::flush;
-    }
-
-    if(nb_new_elements > 0) {
-      new_elements = true;
-      Table<std::string>::flush();
-      last_written = n_values;
-    }
-    new_elements = false;
+    write_new_values();
+    Table<std::string>::flush();
   }
 
   const SEXP to_sexp() const {
     SEXP s = PROTECT(Rf_allocVector(STRSXP, nb_values()));
-    int i = 0;
-    throw_assert(nb_values() == store.size());
-    for(const auto& name : std::as_const(store)) {
-      SET_STRING_ELT(s, i, Rf_mkChar(name.c_str()));
-      i++;
+    for(uint64_t i = 0; i < nb_values(); i++) {
+      std::string_view name = view(i);
+      SET_STRING_ELT(s, i, Rf_mkCharLen(name.data(), static_cast<int>(name.size())));
     }
 
     UNPROTECT(1);
@@ -11,9 +11,16 @@
 // header file.
 #include <testthat.h>
 #include <algorithm>
+#include <numeric>
+#include <random>
+#include <limits>
 
 #include "search_index.h"
 #include "r_compat.h"
+#include "stable_vector.h"
+#include "table.h"
+#include "wal.h"
+#include "varint.h"
 
 
 context("Index tests") {
@@ -112,3 +119,194 @@ context("gp caching-flag assumptions") {
 #endif
 
 }
+
+context("StableVector") {
+
+  test_that("indexing across chunks") {
+    StableVector<uint64_t> v;
+    for(uint64_t i = 0; i < 100000; i++) {
+      v.push_back(i);
+    }
+    expect_true(v.size() == 100000);
+    // chunks grow geometrically
+    expect_true(v.nb_chunks() < 20);
+
+    bool all_equal = true;
+    for(uint64_t i = 0; i < v.size(); i++) {
+      all_equal = all_equal && v[i] == i;
+    }
+    expect_true(all_equal);
+    expect_true(v.back() == 99999);
+    expect_true(*(v.begin() + 54321) == 54321);
+    expect_true(v.end() - v.begin() == 100000);
+  }
+
+  test_that("pointers are stable and bulk insertions are chunked") {
+    StableVector<uint64_t> v;
+    v.push_back(42);
+    const uint64_t* first = &v[0];
+
+    std::vector<uint64_t> values(50000);
+    std::iota(values.begin(), values.end(), 1);
+    v.insert(v.end(), values.begin(), values.end());
+    v.resize(200000);
+
+    expect_true(first == &v[0]);
+    expect_true(v[50000] == 50000);
+    expect_true(v[199999] == 0);
+    expect_true(v.chunk(v.nb_chunks() - 1).capacity() <= v.size());
+  }
+}
+
+context("UniqTextTable") {
+
+  test_that("old text tables are converted to string pools") {
+    fs::path dir = fs::temp_directory_path() / ("sxpdb_uniq_text_" + std::to_string(getpid()));
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+    {
+      std::ofstream text(dir / "names.bin");
+      text << "\na\nbb\n";
+      std::ofstream conf(dir / "names.conf");
+      conf << "path=names.bin\nnb_values=3\n";
+    }
+
+    {
+      UniqTextTable names(dir / "names.bin", true);
+      expect_true(names.read(2) == "bb");
+      expect_true(names.append_index("a") == 1);
+      expect_true(names.append_index("ccc") == 3);
+    }
+
+    {
+      UniqTextTable names(dir / "names.bin", false);
+      expect_true(fs::exists(dir / "names_offsets.bin"));
+      // the persisted hash table is used as is
+      expect_true(names.is_loaded());
+      expect_true(names.nb_values() == 4);
+      expect_true(names.get_index("ccc").value_or(0) == 3);
+      expect_false(names.get_index("dddd").has_value());
+    }
+
+    fs::remove_all(dir);
+  }
+}
+
+context("WriteAheadLog") {
+
+  test_that("partial records at the end of the log are discarded") {
+    fs::path dir = fs::temp_directory_path() / ("sxpdb_wal_" + std::to_string(getpid()));
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+    fs::path path = dir / "wal.bin";
+
+    {
+      WriteAheadLog wal;
+      wal.create(path, 3);
+      for(uint64_t i = 0; i < 2; i++) {
+        wal.begin(wal_record_type::Origin);
+        wal.put(i);
+        wal.put_string("pkg");
+        wal.end();
+      }
+    }
+    uint64_t valid_size = fs::file_size(path);
+    {
+      // A record whose end was not written
+      std::ofstream file(path, std::fstream::binary | std::fstream::app);
+      file.write("\x20\0\0\0abcd", 8);
+    }
+
+    WriteAheadLog wal;
+    wal_header_t header;
+    std::vector<wal_record_t> records;
+    expect_true(wal.read(path, header, records));
+    expect_true(header.base_nb_values == 3);
+    expect_true(records.size() == 2);
+    expect_true(fs::file_size(path) == valid_size);
+
+    WalCursor cursor(records[1].payload);
+    expect_true(cursor.get<uint64_t>() == 1);
+    expect_true(cursor.get_string() == "pkg");
+
+    wal.reset(5);
+    expect_true(wal.read(path, header, records));
+    expect_true(records.empty() && header.base_nb_values == 5);
+
+    fs::remove_all(dir);
+  }
+}
+
+context("Varints") {
+
+  test_that("corrupted integers are detected") {
+    std::vector<uint8_t> bytes;
+    put_varint(bytes, std::numeric_limits<uint64_t>::max());
+    put_varint(bytes, 300);
+    expect_true(bytes.size() == max_varint_bytes + 2);
+    expect_true(valid_varints(bytes));
+
+    size_t pos = 0;
+    uint64_t v = 0;
+    expect_true(get_varint(bytes, pos, v) && v == std::numeric_limits<uint64_t>::max());
+    expect_true(get_varint(bytes, pos, v) && v == 300 && pos == bytes.size());
+
+    // Cut short
+    bytes.pop_back();
+    expect_false(valid_varints(bytes));
+    std::vector<uint64_t> out;
+    expect_false(decode_deltas(bytes, out));
+
+    // More continuation bytes than a 64-bit integer can have
+    std::vector<uint8_t> too_long(max_varint_bytes + 1, 0x80);
+    too_long.push_back(1);
+    expect_false(valid_varints(too_long));
+    pos = 0;
+    expect_false(get_varint(too_long, pos, v));
+  }
+}
+
+context("BitSlicedIndex") {
+
+  test_that("comparisons match a scan of the values") {
+    std::vector<uint64_t> values = {0, 1, 2, 3, 7, 8, 100, 1000, 1023, 1024, 65537, 1000000, std::numeric_limits<uint64_t>::max()};
+    std::default_random_engine rand_engine(42);
+    std::uniform_int_distribution<uint64_t> dist(0, 5000);
+    for(int i = 0; i < 2000; i++) {
+      values.push_back(dist(rand_engine));
+    }
+
+    BitSlicedIndex index;
+    for(uint64_t i = 0; i < values.size(); i++) {
+      index.add(i, values[i]);
+    }
+    // A value seen again
+    values[5] = 4000;
+    index.set(5, values[5]);
+
+    auto same = [&values](const roaring::Roaring64Map& res, auto pred) {
+      std::vector<uint64_t> expected;
+      for(uint64_t i = 0; i < values.size(); i++) {
+        if(pred(values[i])) {
+          expected.push_back(i);
+        }
+      }
+      std::vector<uint64_t> actual;
+      for(uint64_t i : res) {
+        actual.push_back(i);
+      }
+      return actual == expected;
+    };
+
+    bool all_equal = true;
+    std::vector<uint64_t> constants = {0, 1, 7, 8, 999, 1024, 2500, 4000, 5000, uint64_t(1) << 40, std::numeric_limits<uint64_t>::max()};
+    for(uint64_t v : constants) {
+      all_equal = all_equal && same(index.less_equal(v), [v](uint64_t x) {return x <= v; });
+      all_equal = all_equal && same(index.greater_equal(v), [v](uint64_t x) {return x >= v; });
+      all_equal = all_equal && same(index.equal(v), [v](uint64_t x) {return x == v; });
+      all_equal = all_equal && same(index.range(v / 2, v), [v](uint64_t x) {return x >= v / 2 && x <= v; });
+    }
+    expect_true(all_equal);
+    expect_true(index.range(10, 9).isEmpty());
+  }
+}
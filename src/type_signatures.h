@@ -0,0 +1,311 @@
+#ifndef SXPDB_TYPE_SIGNATURES_H
+#define SXPDB_TYPE_SIGNATURES_H
+
+#define R_NO_REMAP
+#include <R.h>
+#include <Rinternals.h>
+
+#include <vector>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <cstring>
+#include <memory>
+#include <unistd.h>
+
+#include "robin_hood.h"
+#include "table.h"
+#include "hasher.h"
+#include "origins.h"
+
+// The type of a value, as seen by a function
+struct type_signature_t {
+  uint32_t classes = 0;// in the class signatures table, 0 if the value has no class
+  uint8_t sexptype = 0;
+  uint8_t has_na = 0;
+  uint8_t n_dims = 0;// values with 5 dimensions or more share the same one
+  uint8_t length_bin = 0;// in SearchIndex::length_intervals
+
+  uint64_t packed() const {
+    uint64_t key;
+    std::memcpy(&key, this, sizeof(key));
+    return key;
+  }
+};
+static_assert(sizeof(type_signature_t) == sizeof(uint64_t), "type signatures are packed into 64 bits");
+
+// Number of times a type signature was seen at a location
+struct signature_count_t {
+  location_t loc;
+  uint32_t signature = 0;
+  uint64_t count = 0;
+};
+
+struct signature_key_t {
+  location_t loc;
+  uint32_t signature;
+
+  bool operator==(const signature_key_t& other) const {
+    return loc == other.loc && signature == other.signature;
+  }
+};
+
+struct signature_key_hash {
+  std::size_t operator()(const signature_key_t& key) const {
+    std::size_t result = std::hash<location_t>()(key.loc);
+    hash_combine(result, key.signature);
+    return result;
+  }
+};
+
+// Aggregated type signatures per parameter: for each (package, function, parameter),
+// how many times values of each type signature have been passed (or returned).
+// The counts are updated when values are added or merged, so that querying them
+// does not need to look at the values.
+//
+// Files:
+//  * type_signatures.bin: the distinct type signatures
+//  * signature_classes.bin: the distinct class attributes of the signatures, as class names separated by ","
+//  * value_signatures.bin: type signature of each value of the database
+//  * signature_counts.bin: the counts, kept in memory. It has no configuration file: its size
+//    gives the number of counts.
+//  * signature_counts_log.bin: the increments of the counts since signature_counts.bin was written.
+//    A flush only appends a record for each count that changed since the previous one.
+//
+// The log is folded into the counts by compact(), which also happens at flushes when the log
+// has more records than the counts. The counts and the log are numbered with a generation
+// (signature_counts_<n>.bin), which signature_counts_generation.conf gives: folding writes
+// the new counts, and switches to them, and to an empty log, by replacing that file.
+class TypeSignatures {
+private:
+  std::unique_ptr<FSizeTable<type_signature_t>> signatures;
+  UniqTextTable class_signatures;
+  std::unique_ptr<FSizeTable<uint32_t>> value_signatures;
+
+  robin_hood::unordered_map<uint64_t, uint32_t> signature_ids;
+  robin_hood::unordered_map<signature_key_t, uint64_t, signature_key_hash> counts;
+  // Increments since the last flush
+  robin_hood::unordered_map<signature_key_t, uint64_t, signature_key_hash> changed_counts;
+  std::unique_ptr<FSizeTable<signature_count_t>> counts_log;
+  uint64_t nb_base_counts = 0;
+  uint64_t generation = 0;
+
+  bool write_mode = false;
+  pid_t pid;
+
+  fs::path base_path = "";
+
+  fs::path generation_conf_path() const {
+    return base_path / "signature_counts_generation.conf";
+  }
+
+  fs::path generation_path(const std::string& name, uint64_t gen) const {
+    return base_path / (name + (gen == 0 ? "" : "_" + std::to_string(gen)) + ".bin");
+  }
+
+  void remove_generation(uint64_t gen) const {
+    std::error_code ec;
+    fs::remove(generation_path("signature_counts", gen), ec);
+    fs::path log_path = generation_path("signature_counts_log", gen);
+    fs::remove(log_path, ec);
+    fs::remove(log_path.replace_extension(".conf"), ec);
+  }
+
+  void open_counts() {
+    counts_log.reset();
+    counts.clear();
+    changed_counts.clear();
+
+    generation = 0;
+    if(fs::exists(generation_conf_path())) {
+      Config conf(generation_conf_path());
+      generation = std::stoul(conf["generation"]);
+    }
+    if(write_mode && generation > 0) {
+      // Left by a crash after the switch
+      remove_generation(generation - 1);
+    }
+
+    fs::path counts_path = generation_path("signature_counts", generation);
+    nb_base_counts = 0;
+    if(fs::exists(counts_path)) {
+      std::vector<signature_count_t> records(fs::file_size(counts_path) / sizeof(signature_count_t));
+      std::ifstream file(counts_path, std::fstream::binary);
+      file.read(reinterpret_cast<char*>(records.data()), records.size() * sizeof(signature_count_t));
+      if(!file) {
+        Rf_error("Impossible to read type signature counts %s\n", counts_path.string().c_str());
+      }
+      counts.reserve(records.size());
+      for(const auto& c : records) {
+        counts[signature_key_t{c.loc, c.signature}] += c.count;
+      }
+      nb_base_counts = records.size();
+    }
+
+    counts_log = std::make_unique<FSizeTable<signature_count_t>>(generation_path("signature_counts_log", generation), write_mode);
+    for(uint64_t i = 0; i < counts_log->nb_values(); i++) {
+      const signature_count_t& c = counts_log->read(i);
+      counts[signature_key_t{c.loc, c.signature}] += c.count;
+    }
+  }
+
+  // Write all the counts in a new generation, with an empty log
+  void write_counts() {
+    std::vector<signature_count_t> records;
+    records.reserve(counts.size());
+    for(const auto& c : counts) {
+      records.push_back({c.first.loc, c.first.signature, c.second});
+    }
+
+    uint64_t new_generation = generation + 1;
+    // Left by a crash before the switch
+    remove_generation(new_generation);
+    fs::path path = generation_path("signature_counts", new_generation);
+    std::ofstream file(path, std::fstream::binary | std::fstream::trunc);
+    if(!file) {
+      Rf_error("Impossible to open for write type signature counts %s\n", path.string().c_str());
+    }
+    file.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(signature_count_t));
+    file.close();
+    if(!file) {
+      Rf_error("Impossible to write type signature counts %s\n", path.string().c_str());
+    }
+
+    // From now on, the new counts, with an empty log, are the valid ones
+    Config conf({{"generation", std::to_string(new_generation)}});
+    conf.write(generation_conf_path());
+
+    counts_log.reset();
+    remove_generation(generation);
+    // Written by the versions that stored the counts in a table
+    std::error_code ec;
+    fs::remove(base_path / "signature_counts.conf", ec);
+
+    generation = new_generation;
+    nb_base_counts = records.size();
+    counts_log = std::make_unique<FSizeTable<signature_count_t>>(generation_path("signature_counts_log", generation), write_mode);
+    changed_counts.clear();
+  }
+
+public:
+  TypeSignatures() : pid(getpid()) {}
+
+  void open(const fs::path& base_path_, bool write = true) {
+    write_mode = write;
+    base_path = fs::absolute(base_path_);
+
+    // Databases created before the type signatures do not have the files:
+    // we do not create them in read mode
+    bool exists = fs::exists(base_path / "value_signatures.conf");
+    if(!exists && !write_mode) {
+      return;
+    }
+
+    signatures = std::make_unique<FSizeTable<type_signature_t>>(base_path / "type_signatures.bin", write_mode);
+    class_signatures.open(base_path / "signature_classes.bin", write_mode);
+    value_signatures = std::make_unique<FSizeTable<uint32_t>>(base_path / "value_signatures.bin", write_mode);
+
+    if(write_mode) {
+      // They are read when adding every value
+      signatures->load_all();
+      value_signatures->load_all();
+      if(class_signatures.nb_values() == 0) {
+        class_signatures.append("");
+      }
+      for(uint64_t i = 0; i < signatures->nb_values(); i++) {
+        signature_ids[signatures->read(i).packed()] = i;
+      }
+    }
+
+    open_counts();
+  }
+
+  // The classes are the class names, separated by ","
+  uint32_t intern(type_signature_t sig, std::string_view classes) {
+    assert(write_mode);
+    sig.classes = class_signatures.append_index(std::string(classes));
+    auto it = signature_ids.find(sig.packed());
+    if(it != signature_ids.end()) {
+      return it->second;
+    }
+    uint32_t id = signatures->nb_values();
+    signatures->append(sig);
+    signature_ids[sig.packed()] = id;
+    return id;
+  }
+
+  // Values must be added in order
+  void add_value(uint64_t index, uint32_t signature) {
+    assert(write_mode);
+    throw_assert(index == value_signatures->nb_values());
+    value_signatures->append(signature);
+  }
+
+  void observe(const location_t& loc, uint32_t signature, uint64_t n = 1) {
+    assert(write_mode);
+    signature_key_t key{loc, signature};
+    counts[key] += n;
+    changed_counts[key] += n;
+  }
+
+  // Number of values with a type signature.
+  // It can be lower than the number of values of a database created before the type signatures
+  uint64_t nb_values() const { return value_signatures ? value_signatures->nb_values() : 0; }
+
+  uint32_t value_signature(uint64_t index) const { return value_signatures->read(index); }
+
+  const type_signature_t& signature(uint32_t id) const { return signatures->read(id); }
+
+  std::string_view class_signature(uint32_t id) const { return class_signatures.view(id); }
+
+  const robin_hood::unordered_map<signature_key_t, uint64_t, signature_key_hash>& signature_counts() const {
+    return counts;
+  }
+
+  // Only keep the type signatures of the first n values.
+  // The counts per parameter are aggregated, so they still include the removed values.
+  void truncate(uint64_t n) {
+    if(value_signatures && write_mode) {
+      value_signatures->truncate(n);
+    }
+  }
+
+  void flush() {
+    if(!write_mode || pid != getpid()) {
+      return;
+    }
+    signatures->flush();
+    class_signatures.flush();
+    value_signatures->flush();
+    if(changed_counts.empty()) {
+      return;
+    }
+    if(counts_log->nb_values() + changed_counts.size() > nb_base_counts) {
+      write_counts();
+      return;
+    }
+    for(const auto& c : changed_counts) {
+      counts_log->append({c.first.loc, c.first.signature, c.second});
+    }
+    counts_log->flush();
+    changed_counts.clear();
+  }
+
+  // Fold the log into the counts
+  void compact() {
+    if(!write_mode || pid != getpid()) {
+      return;
+    }
+    flush();
+    if(counts_log->nb_values() > 0) {
+      write_counts();
+    }
+  }
+
+  virtual ~TypeSignatures() {
+    flush();
+  }
+};
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef SXPDB_VARINT_H
+#define SXPDB_VARINT_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#include "span.h"
+
+// LEB128 variable-length integers: 7 bits per byte, the high bit is set
+// on all the bytes but the last one.
+
+inline void put_varint(std::vector<uint8_t>& out, uint64_t v) {
+  while(v >= 0x80) {
+    out.push_back(static_cast<uint8_t>(v) | 0x80);
+    v >>= 7;
+  }
+  out.push_back(static_cast<uint8_t>(v));
+}
+
+// A 64-bit integer takes at most 10 bytes
+constexpr size_t max_varint_bytes = 10;
+
+// Advances pos past the integer.
+// False if the bytes are corrupted: the integer is cut short, or longer than max_varint_bytes
+inline bool get_varint(Span<const uint8_t> in, size_t& pos, uint64_t& v) {
+  v = 0;
+  for(size_t n = 0; n < max_varint_bytes && pos < in.size(); n++) {
+    uint8_t byte = in[pos++];
+    v |= static_cast<uint64_t>(byte & 0x7f) << (7 * n);
+    if((byte & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// The bytes are a sequence of valid integers
+inline bool valid_varints(Span<const uint8_t> in) {
+  size_t n = 0;
+  for(uint8_t byte : in) {
+    n = (byte & 0x80) ? n + 1 : 0;
+    if(n >= max_varint_bytes) {
+      return false;
+    }
+  }
+  return n == 0;
+}
+
+// Number of integers in an encoded sequence
+inline size_t count_varints(Span<const uint8_t> in) {
+  size_t n = 0;
+  for(uint8_t byte : in) {
+    n += (byte & 0x80) == 0;
+  }
+  return n;
+}
+
+// Signed integers, with the sign in the low bit, so that small negative ones are short too
+inline uint64_t zigzag(int64_t v) {
+  return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+}
+
+inline int64_t unzigzag(uint64_t v) {
+  return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+}
+
+// Sorted integers, as the first one followed by the differences between consecutive ones
+inline void encode_deltas(Span<const uint64_t> sorted, std::vector<uint8_t>& out) {
+  uint64_t previous = 0;
+  for(uint64_t v : sorted) {
+    put_varint(out, v - previous);
+    previous = v;
+  }
+}
+
+// Appends the decoded integers to out.
+// False if the bytes are corrupted
+inline bool decode_deltas(Span<const uint8_t> in, std::vector<uint64_t>& out) {
+  uint64_t previous = 0;
+  size_t pos = 0;
+  uint64_t delta = 0;
+  while(pos < in.size()) {
+    if(!get_varint(in, pos, delta)) {
+      return false;
+    }
+    previous += delta;
+    out.push_back(previous);
+  }
+  return true;
+}
+
+#endif
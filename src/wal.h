@@ -0,0 +1,323 @@
+#ifndef SXPDB_WAL_H
+#define SXPDB_WAL_H
+
+#define R_NO_REMAP
+#include <R.h>
+#include <Rinternals.h>
+
+#include <vector>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <cstring>
+#include <cstdint>
+#include <chrono>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "posix_compat.h"
+#include "span.h"
+#include "xxhash.h"
+#include "utils.h"
+
+namespace fs = std::filesystem;
+
+enum class wal_record_type : uint8_t {
+  Value = 1,// a value passed to add_value, with its origin and call id
+  Origin = 2,// add_origin
+  CheckpointBegin = 3,
+  CheckpointEnd = 4// with the number of values of the checkpoint
+};
+
+struct wal_header_t {
+  uint64_t magic = 0;
+  uint32_t version = 0;
+  uint32_t reserved = 0;
+  uint64_t base_nb_values = 0;// number of values at the checkpoint the log starts from
+};
+
+// Each record is preceded by the size of its payload and the checksum of the payload
+struct wal_record_header_t {
+  uint32_t size = 0;
+  uint32_t checksum = 0;
+};
+
+// Reads the fields of a record, in the order they were written
+class WalCursor {
+private:
+  Span<const std::byte> payload;
+  size_t pos = 0;
+
+  void check(size_t n) const {
+    if(pos + n > payload.size()) {
+      Rf_error("Truncated record in the write-ahead log.\n");
+    }
+  }
+
+public:
+  WalCursor(Span<const std::byte> payload_) : payload(payload_) {}
+
+  template<typename T>
+  T get() {
+    check(sizeof(T));
+    T v;
+    std::memcpy(&v, payload.data() + pos, sizeof(T));
+    pos += sizeof(T);
+    return v;
+  }
+
+  Span<const std::byte> get_bytes() {
+    uint64_t size = get<uint64_t>();
+    check(size);
+    Span<const std::byte> bytes(payload.data() + pos, size);
+    pos += size;
+    return bytes;
+  }
+
+  std::string get_string() {
+    Span<const std::byte> bytes = get_bytes();
+    return std::string(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+  }
+};
+
+struct wal_record_t {
+  wal_record_type type;
+  Span<const std::byte> payload;// without the type
+};
+
+// Write-ahead log of the operations since the last checkpoint (wal.bin).
+//
+// The tables only reach a consistent state on disk at checkpoints: they are flushed,
+// the configuration files are written, and the log is reset. Between two checkpoints,
+// the operations are appended to the log: records are buffered, and written and synced
+// (with fdatasync) in batches, when the buffer is large or old enough. A crash then loses
+// at most the last batch. At the next opening, the tables are truncated to the checkpoint
+// and the records are replayed, which only takes time proportional to the log.
+//
+// A record that was not completely written, or with a wrong checksum, ends the log:
+// it and everything after it are discarded.
+class WriteAheadLog {
+private:
+  static constexpr uint64_t magic = 0x474f4c4441455257;// "WREADLOG"
+  static constexpr uint32_t version = 1;
+
+  fs::path path;
+  int fd = -1;
+  pid_t pid;
+
+  uint64_t file_end = 0;// synced part of the file
+  std::vector<std::byte> pending;
+  size_t record_start = 0;
+
+  size_t sync_bytes = 1024 * 1024;
+  std::chrono::milliseconds sync_age{1000};
+  std::chrono::steady_clock::time_point batch_start;
+
+  // Content of the log read by read()
+  std::vector<std::byte> content;
+
+  void write_all(const void* data, size_t size, uint64_t offset) {
+    size_t written = 0;
+    while(written < size) {
+      ssize_t res = pwrite(fd, static_cast<const char*>(data) + written, size - written, offset + written);
+      if(res <= 0) {
+        Rf_error("Error while writing to the write-ahead log %s: %s\n", path.string().c_str(), strerror(errno));
+      }
+      written += res;
+    }
+  }
+
+  void put_raw(const void* data, size_t size) {
+    const std::byte* p = static_cast<const std::byte*>(data);
+    pending.insert(pending.end(), p, p + size);
+  }
+
+public:
+  WriteAheadLog() : pid(getpid()) {}
+  WriteAheadLog(const WriteAheadLog&) = delete;
+  WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+  // Start a new log at p, after a checkpoint with base_nb_values values.
+  // It replaces the current one.
+  void create(const fs::path& p, uint64_t base_nb_values) {
+    close();
+    path = p;
+    pending.clear();
+    content.clear();
+    content.shrink_to_fit();
+    fs::path tmp_path = path;
+    tmp_path += ".tmp";
+    fd = ::open(tmp_path.string().c_str(), O_CREAT | O_TRUNC | O_RDWR | O_BINARY, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if(fd == -1) {
+      Rf_error("Impossible to create the write-ahead log %s: %s\n", tmp_path.string().c_str(), strerror(errno));
+    }
+    wal_header_t header;
+    header.magic = magic;
+    header.version = version;
+    header.base_nb_values = base_nb_values;
+    write_all(&header, sizeof(header), 0);
+    fdatasync(fd);
+    fs::rename(tmp_path, path);
+    file_end = sizeof(header);
+  }
+
+  // Read the valid records of the log at p, and truncate the file after the last one.
+  // Returns false if there is no usable log.
+  // The records are valid until the log is created again or reset.
+  bool read(const fs::path& p, wal_header_t& header, std::vector<wal_record_t>& records) {
+    path = p;
+    records.clear();
+    content.clear();
+    if(!fs::exists(path) || fs::file_size(path) < sizeof(wal_header_t)) {
+      return false;
+    }
+
+    int rfd = ::open(path.string().c_str(), O_RDONLY | O_BINARY);
+    if(rfd == -1) {
+      return false;
+    }
+    content.resize(fs::file_size(path));
+    size_t done = 0;
+    while(done < content.size()) {
+      ssize_t res = pread(rfd, content.data() + done, content.size() - done, done);
+      if(res <= 0) {
+        break;
+      }
+      done += res;
+    }
+    ::close(rfd);
+    content.resize(done);
+
+    std::memcpy(&header, content.data(), sizeof(header));
+    if(header.magic != magic || header.version != version) {
+      return false;
+    }
+
+    size_t pos = sizeof(wal_header_t);
+    while(pos + sizeof(wal_record_header_t) <= content.size()) {
+      wal_record_header_t rec;
+      std::memcpy(&rec, content.data() + pos, sizeof(rec));
+      size_t start = pos + sizeof(rec);
+      if(rec.size == 0 || rec.size > content.size() - start ||
+         XXH32(content.data() + start, rec.size, 0) != rec.checksum) {
+        break;
+      }
+      wal_record_t record;
+      record.type = static_cast<wal_record_type>(content[start]);
+      record.payload = Span<const std::byte>(content.data() + start + 1, rec.size - 1);
+      records.push_back(record);
+      pos = start + rec.size;
+    }
+
+    // Discard the partial or corrupted records
+    if(pos < content.size()) {
+      fs::resize_file(path, pos);
+    }
+    file_end = pos;
+    return true;
+  }
+
+  // Append to the log after the records returned by read
+  void open() {
+    throw_assert(fd == -1 && file_end >= sizeof(wal_header_t));
+    fd = ::open(path.string().c_str(), O_RDWR | O_BINARY);
+    if(fd == -1) {
+      Rf_error("Impossible to open the write-ahead log %s: %s\n", path.string().c_str(), strerror(errno));
+    }
+  }
+
+  // Records are written after sync_bytes bytes, or if the oldest pending record
+  // is older than sync_age (checked when adding records)
+  void set_sync_policy(size_t bytes, std::chrono::milliseconds age) {
+    sync_bytes = bytes;
+    sync_age = age;
+  }
+
+  // The fields of a record are added between begin and end
+  void begin(wal_record_type type) {
+    if(pending.empty()) {
+      batch_start = std::chrono::steady_clock::now();
+    }
+    record_start = pending.size();
+    wal_record_header_t rec;
+    put_raw(&rec, sizeof(rec));
+    put_raw(&type, sizeof(type));
+  }
+
+  template<typename T>
+  void put(const T& v) {
+    put_raw(&v, sizeof(T));
+  }
+
+  void put_bytes(Span<const std::byte> bytes) {
+    put<uint64_t>(bytes.size());
+    put_raw(bytes.data(), bytes.size());
+  }
+
+  void put_string(std::string_view s) {
+    put<uint64_t>(s.size());
+    put_raw(s.data(), s.size());
+  }
+
+  void end() {
+    wal_record_header_t rec;
+    size_t start = record_start + sizeof(rec);
+    rec.size = pending.size() - start;
+    rec.checksum = XXH32(pending.data() + start, rec.size, 0);
+    std::memcpy(pending.data() + record_start, &rec, sizeof(rec));
+
+    if(pending.size() >= sync_bytes || std::chrono::steady_clock::now() - batch_start >= sync_age) {
+      sync();
+    }
+  }
+
+  // Write the pending records and wait for them to be on disk
+  void sync() {
+    if(fd == -1 || pending.empty() || pid != getpid()) {
+      return;
+    }
+    write_all(pending.data(), pending.size(), file_end);
+    fdatasync(fd);
+    file_end += pending.size();
+    pending.clear();
+  }
+
+  // Start again from an empty log, after a checkpoint with base_nb_values values
+  void reset(uint64_t base_nb_values) {
+    if(pid != getpid()) {
+      return;
+    }
+    pending.clear();
+    create(path, base_nb_values);
+  }
+
+  // Wait for the log, and all the files of the file system it is on, to be on disk
+  void sync_all() {
+    sync();
+    if(fd != -1 && pid == getpid()) {
+      sync_filesystem(fd);
+    }
+  }
+
+  // Size of the log, with the records that are not written yet
+  uint64_t size() const { return file_end + pending.size(); }
+
+  bool empty() const { return size() <= sizeof(wal_header_t); }
+
+  const fs::path& get_path() const { return path; }
+
+  void close() {
+    if(fd != -1) {
+      sync();
+      ::close(fd);
+      fd = -1;
+    }
+  }
+
+  virtual ~WriteAheadLog() {
+    close();
+  }
+};
+
+#endif